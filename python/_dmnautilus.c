@@ -0,0 +1,357 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+/* Python bindings for libdmnautilus: bins a NumPy image in memory with
+ * dmnautilus_bin_arrays().  The input arrays are read in place when
+ * they already have a type the library takes (see dmnautilusArrays) and
+ * are C-contiguous; the output images are NumPy arrays the library
+ * fills directly, and the bins are a record array over the library's
+ * own list.  Nothing here knows about the WCS; see dmnautilus.regions(). */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "dmnautilus.h"
+
+
+/* NumPy types the pixel kernels read in place */
+static const struct {
+  int typenum;
+  dmDataType dt;
+} pix_types[] = {
+  { NPY_UBYTE,  dmBYTE },
+  { NPY_SHORT,  dmSHORT },
+  { NPY_USHORT, dmUSHORT },
+  { NPY_LONG,   dmLONG },
+  { NPY_ULONG,  dmULONG },
+  { NPY_FLOAT,  dmFLOAT },
+  { NPY_DOUBLE, dmDOUBLE },
+};
+
+#define NUM_PIX_TYPES  ( sizeof(pix_types)/sizeof(pix_types[0]) )
+
+
+/* The data array, w/o a copy if it is already a pixel kernel type,
+ * C-contiguous, and in native byte order (FITS files are big-endian, 
+ * so eg astropy images are swapped once); anything else is converted
+ * to double */
+static PyArrayObject *get_data_array( PyObject *obj, dmDataType *dt )
+{
+  PyArrayObject *arr;
+  size_t ii;
+  int typenum = NPY_DOUBLE;
+
+  arr = (PyArrayObject*)PyArray_CheckFromAny( obj, NULL, 2, 2,
+                               NPY_ARRAY_IN_ARRAY | NPY_ARRAY_NOTSWAPPED, NULL );
+  if ( NULL == arr ) {
+    return(NULL);
+  }
+  *dt = dmDOUBLE;
+  for (ii=0; ii<NUM_PIX_TYPES; ii++ ) {
+    if ( PyArray_EquivTypenums( PyArray_TYPE(arr), pix_types[ii].typenum ) ) {
+      typenum = pix_types[ii].typenum;
+      *dt = pix_types[ii].dt;
+      break;
+    }
+  }
+  if ( !PyArray_EquivTypenums( PyArray_TYPE(arr), typenum ) ) {
+    PyArrayObject *conv;
+    conv = (PyArrayObject*)PyArray_FROMANY( (PyObject*)arr, typenum, 2, 2, NPY_ARRAY_IN_ARRAY );
+    Py_DECREF( arr );
+    arr = conv;
+  }
+  return(arr);
+}
+
+
+/* An optional input the same shape as the data; None gives NULL and
+ * *arr is left NULL */
+static int get_aux_array( PyObject *obj, int typenum, const char *name,
+                          PyArrayObject *data, PyArrayObject **arr )
+{
+  *arr = NULL;
+  if ( ( NULL == obj ) || ( Py_None == obj ) ) {
+    return(0);
+  }
+  *arr = (PyArrayObject*)PyArray_FROMANY( obj, typenum, 2, 2,
+                                          NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST );
+  if ( NULL == *arr ) {
+    return(-1);
+  }
+  if ( !PyArray_SAMESHAPE( *arr, data ) ) {
+    PyErr_Format( PyExc_ValueError, "%s must be the same shape as data", name );
+    Py_CLEAR( *arr );
+    return(-1);
+  }
+  return(0);
+}
+
+
+/* An output image: True for a new array, False or None to skip it, or
+ * an array of the right type and shape to fill in place */
+static int get_out_array( PyObject *obj, int typenum, const char *name,
+                          PyArrayObject *data, PyArrayObject **arr )
+{
+  *arr = NULL;
+  if ( ( NULL == obj ) || ( Py_None == obj ) || ( Py_False == obj ) ) {
+    return(0);
+  }
+  if ( Py_True == obj ) {
+    *arr = (PyArrayObject*)PyArray_SimpleNew( 2, PyArray_DIMS(data), typenum );
+    return( ( NULL == *arr ) ? -1 : 0 );
+  }
+  if ( !PyArray_Check( obj ) ||
+       !PyArray_EquivTypenums( PyArray_TYPE((PyArrayObject*)obj), typenum ) ||
+       !PyArray_IS_C_CONTIGUOUS( (PyArrayObject*)obj ) ||
+       !PyArray_ISWRITEABLE( (PyArrayObject*)obj ) ||
+       !PyArray_SAMESHAPE( (PyArrayObject*)obj, data ) ) {
+    PyErr_Format( PyExc_ValueError,
+                  "%s must be True, False, or a writeable C-contiguous %s array "
+                  "the same shape as data", name,
+                  ( NPY_ULONG == typenum ) ? "uint64" : "float32" );
+    return(-1);
+  }
+  Py_INCREF( obj );
+  *arr = (PyArrayObject*)obj;
+  return(0);
+}
+
+
+static void free_bins( PyObject *capsule )
+{
+  free( PyCapsule_GetPointer( capsule, "dmnautilus.bins" ) );
+}
+
+
+/* A record array over the list of bins; it owns the list from now on */
+static PyObject *make_bins_array( dmnautilusBin *bins, long nbins )
+{
+  PyObject *spec, *capsule, *arr;
+  PyArray_Descr *descr = NULL;
+  npy_intp dims[1];
+
+  spec = Py_BuildValue( "{s:[sssssssss],s:[sssssssss],s:[nnnnnnnnn],s:n}",
+    "names", "xs", "ys", "xl", "yl", "sum", "val", "area", "snr", "level",
+    "formats", "l", "l", "l", "l", "f4", "f4", "l", "f4", "h",
+    "offsets",
+      (Py_ssize_t)offsetof(dmnautilusBin,xs), (Py_ssize_t)offsetof(dmnautilusBin,ys),
+      (Py_ssize_t)offsetof(dmnautilusBin,xl), (Py_ssize_t)offsetof(dmnautilusBin,yl),
+      (Py_ssize_t)offsetof(dmnautilusBin,sum), (Py_ssize_t)offsetof(dmnautilusBin,val),
+      (Py_ssize_t)offsetof(dmnautilusBin,area), (Py_ssize_t)offsetof(dmnautilusBin,snr),
+      (Py_ssize_t)offsetof(dmnautilusBin,level),
+    "itemsize", (Py_ssize_t)sizeof(dmnautilusBin) );
+  if ( ( NULL == spec ) || ( NPY_SUCCEED != PyArray_DescrConverter( spec, &descr ) ) ) {
+    Py_XDECREF( spec );
+    free( bins );
+    return(NULL);
+  }
+  Py_DECREF( spec );
+
+  capsule = PyCapsule_New( bins, "dmnautilus.bins", free_bins );
+  if ( NULL == capsule ) {
+    Py_DECREF( descr );
+    free( bins );
+    return(NULL);
+  }
+
+  dims[0] = nbins;
+  arr = PyArray_NewFromDescr( &PyArray_Type, descr, 1, dims, NULL, bins,
+                              NPY_ARRAY_CARRAY, NULL );   /* steals descr */
+  if ( NULL == arr ) {
+    Py_DECREF( capsule );
+    return(NULL);
+  }
+  if ( 0 != PyArray_SetBaseObject( (PyArrayObject*)arr, capsule ) ) {
+    Py_DECREF( arr );
+    return(NULL);
+  }
+  return(arr);
+}
+
+
+static int set_choice( const char *val, const char *name, const char *one,
+                       const char *two, int *choice )
+{
+  if ( 0 == strcmp( val, one ) ) {
+    *choice = 0;
+  } else if ( 0 == strcmp( val, two ) ) {
+    *choice = 1;
+  } else {
+    PyErr_Format( PyExc_ValueError, "%s must be '%s' or '%s'", name, one, two );
+    return(-1);
+  }
+  return(0);
+}
+
+
+PyDoc_STRVAR( bin_doc,
+"bin(data, snr, method=0, err=None, var=None, valid=None, nthreads=1,\n"
+"    engine='depth', layout='row', value=True, area=True, snrimg=True,\n"
+"    mask=True)\n"
+"\n"
+"Adaptively bin the 2D image data with the quad-tree algorithm.\n"
+"\n"
+"data is read in place if it is C-contiguous uint8, int16, uint16,\n"
+"int64, uint64, float32, or float64; anything else is converted to\n"
+"float64.  err (sigma) or var are float32 and valid is int16, non-zero\n"
+"for the pixels to use (which must leave out any NaN); they are read in\n"
+"place too, and are converted if they are not.  Without valid the NaN\n"
+"pixels are left out.\n"
+"\n"
+"value, area and snrimg (float32) and mask (uint64) are the output\n"
+"images: True for a new array, False to skip it, or an array to fill.\n"
+"\n"
+"Returns a dict of the output images and 'bins', a record array with\n"
+"xs, ys, xl, yl (0-based pixels), sum, val, area, snr, and level for\n"
+"each bin; mask value n is bins[n-1].\n" );
+
+static PyObject *py_bin( PyObject *self, PyObject *args, PyObject *kwds )
+{
+  static char *kwlist[] = { "data", "snr", "method", "err", "var", "valid",
+                            "nthreads", "engine", "layout", "value", "area",
+                            "snrimg", "mask", NULL };
+  PyObject *odata, *oerr = NULL, *ovar = NULL, *ovalid = NULL;
+  PyObject *ovalue = Py_True, *oarea = Py_True, *osnr = Py_True, *omask = Py_True;
+  PyArrayObject *data = NULL, *err = NULL, *var = NULL, *valid = NULL;
+  PyArrayObject *value = NULL, *area = NULL, *snrimg = NULL, *mask = NULL;
+  PyObject *retval = NULL;
+  const char *engine = "depth";
+  const char *layout = "row";
+  double snr;
+  int method = 0;
+  int nthreads = 1;
+  int choice;
+  dmnautilusContext *ctx;
+  dmnautilusArrays arrays;
+  dmnautilusParams params;
+  dmnautilusArrayOutputs outputs;
+  int status;
+
+  (void)self;
+  if ( !PyArg_ParseTupleAndKeywords( args, kwds, "Od|iOOOissOOOO", kwlist,
+                                     &odata, &snr, &method, &oerr, &ovar, &ovalid,
+                                     &nthreads, &engine, &layout, &ovalue, &oarea,
+                                     &osnr, &omask )) {
+    return(NULL);
+  }
+
+  memset( &arrays, 0, sizeof(dmnautilusArrays));
+  memset( &params, 0, sizeof(dmnautilusParams));
+  memset( &outputs, 0, sizeof(dmnautilusArrayOutputs));
+
+  if ( ( method < ZERO_ABOVE ) || ( method > ALL_ABOVE ) ) {
+    PyErr_SetString( PyExc_ValueError, "method must be 0 to 4" );
+    return(NULL);
+  }
+  params.snr = snr;
+  params.method = method;
+  params.nthreads = nthreads;
+  if ( 0 != set_choice( engine, "engine", "depth", "level", &choice ) ) {
+    return(NULL);
+  }
+  params.engine = choice ? LEVEL_SYNC : DEPTH_FIRST;
+  if ( 0 != set_choice( layout, "layout", "row", "tile", &choice ) ) {
+    return(NULL);
+  }
+  params.layout = choice ? LAYOUT_TILE : LAYOUT_ROW;
+
+  if ( NULL == ( data = get_data_array( odata, &(arrays.datatype) ))) {
+    return(NULL);
+  }
+  if ( ( oerr && ( Py_None != oerr ) ) && ( ovar && ( Py_None != ovar ) ) ) {
+    PyErr_SetString( PyExc_ValueError, "Only one of err and var can be used" );
+    goto done;
+  }
+  if ( ( 0 != get_aux_array( oerr, NPY_FLOAT, "err", data, &err ) ) ||
+       ( 0 != get_aux_array( ovar, NPY_FLOAT, "var", data, &var ) ) ||
+       ( 0 != get_aux_array( ovalid, NPY_SHORT, "valid", data, &valid ) ) ||
+       ( 0 != get_out_array( ovalue, NPY_FLOAT, "value", data, &value ) ) ||
+       ( 0 != get_out_array( oarea, NPY_FLOAT, "area", data, &area ) ) ||
+       ( 0 != get_out_array( osnr, NPY_FLOAT, "snrimg", data, &snrimg ) ) ||
+       ( 0 != get_out_array( omask, NPY_ULONG, "mask", data, &mask ) ) ) {
+    goto done;
+  }
+
+  arrays.data = PyArray_DATA( data );
+  arrays.xlen = PyArray_DIM( data, 1 );
+  arrays.ylen = PyArray_DIM( data, 0 );
+  arrays.err = err ? (const float*)PyArray_DATA( err ) : NULL;
+  arrays.var = var ? (const float*)PyArray_DATA( var ) : NULL;
+  arrays.valid = valid ? (const short*)PyArray_DATA( valid ) : NULL;
+  outputs.value = value ? (float*)PyArray_DATA( value ) : NULL;
+  outputs.area = area ? (float*)PyArray_DATA( area ) : NULL;
+  outputs.snr = snrimg ? (float*)PyArray_DATA( snrimg ) : NULL;
+  outputs.mask = mask ? (unsigned long*)PyArray_DATA( mask ) : NULL;
+
+  if ( NULL == ( ctx = dmnautilus_context_new() ) ) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  status = dmnautilus_bin_arrays( ctx, &arrays, &params, &outputs );
+  dmnautilus_context_free( ctx );
+  Py_END_ALLOW_THREADS
+
+  if ( 0 != status ) {
+    PyErr_SetString( PyExc_RuntimeError, "dmnautilus could not bin the image" );
+    free( outputs.bins );
+    goto done;
+  }
+
+  retval = Py_BuildValue( "{s:O,s:O,s:O,s:O,s:N}",
+                          "value", value ? (PyObject*)value : Py_None,
+                          "area", area ? (PyObject*)area : Py_None,
+                          "snr", snrimg ? (PyObject*)snrimg : Py_None,
+                          "mask", mask ? (PyObject*)mask : Py_None,
+                          "bins", make_bins_array( outputs.bins, outputs.nbins ) );
+
+ done:
+  Py_XDECREF( data );
+  Py_XDECREF( err );
+  Py_XDECREF( var );
+  Py_XDECREF( valid );
+  Py_XDECREF( value );
+  Py_XDECREF( area );
+  Py_XDECREF( snrimg );
+  Py_XDECREF( mask );
+  return(retval);
+}
+
+
+static PyMethodDef module_methods[] = {
+  { "bin", (PyCFunction)(void(*)(void))py_bin, METH_VARARGS | METH_KEYWORDS, bin_doc },
+  { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef module_def = {
+  PyModuleDef_HEAD_INIT, "_dmnautilus",
+  "Quad-tree adaptive binning of NumPy images (libdmnautilus)", -1, module_methods,
+  NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit__dmnautilus( void )
+{
+  import_array();
+  return PyModule_Create( &module_def );
+}
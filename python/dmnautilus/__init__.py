@@ -0,0 +1,50 @@
+#
+#  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 3 of the License, or
+#  (at your option) any later version.
+#
+
+"""Quad-tree adaptive binning of NumPy images.
+
+    >>> import dmnautilus
+    >>> out = dmnautilus.bin(img, snr=10, method=4)
+    >>> out['value'], out['mask'], out['bins']
+
+bin() is the libdmnautilus algorithm run on arrays in memory; see its
+docstring for which inputs are read in place.  regions() turns the bins
+into rectangles, in pixels or through a WCS.
+"""
+
+from ._dmnautilus import bin
+
+__all__ = ["bin", "regions"]
+
+
+def regions(bins, wcs=None):
+    """The bins as CIAO rectangle region strings, in mask number order.
+
+    The corners are the pixel edges.  Without wcs they are in logical
+    (1-based image) coordinates.  wcs is either an object with an
+    all_pix2world() method, eg an astropy.wcs.WCS, which is given the
+    0-based pixel coordinates, or a function that maps the logical x and
+    y arrays to the coordinates to use, eg physical.
+    """
+    xa = bins["xs"] + 0.5
+    ya = bins["ys"] + 0.5
+    xb = xa + bins["xl"]
+    yb = ya + bins["yl"]
+
+    if wcs is None:
+        pass
+    elif hasattr(wcs, "all_pix2world"):
+        xa, ya = wcs.all_pix2world(xa - 1, ya - 1, 0)
+        xb, yb = wcs.all_pix2world(xb - 1, yb - 1, 0)
+    else:
+        xa, ya = wcs(xa, ya)
+        xb, yb = wcs(xb, yb)
+
+    return ["rectangle({},{},{},{})".format(*cc)
+            for cc in zip(xa, ya, xb, yb)]
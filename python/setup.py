@@ -0,0 +1,67 @@
+#
+#  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 3 of the License, or
+#  (at your option) any later version.
+#
+
+"""Build the dmnautilus Python module against CIAO.
+
+The library sources are compiled into the extension (libdmnautilus.a
+is not built position independent).  The CIAO flags come from
+pkg-config, as in configure.ac; run it from a CIAO session, eg
+
+    cd python
+    python setup.py build_ext --inplace
+"""
+
+import os
+import subprocess
+
+import numpy
+from setuptools import Extension, setup
+
+CIAO_MODULES = ["ascdm", "stk", "err", "ds", "dmimgio", "cfitsio"]
+
+# The library sources, the same as libdmnautilus_a_SOURCES in src/Makefile.am
+LIB_SOURCES = ["dmnautilus.c", "dmn_input.c", "dmn_traverse.c", "dmn_incr.c",
+               "dmn_sweep.c", "dmn_tree.c", "dmn_output.c", "dmn_kernels.c"]
+
+
+def pkg_config(flag):
+    'Flags for the CIAO libraries, from $ASCDS_INSTALL if it is set'
+    env = dict(os.environ)
+    path = [env.get("PKG_CONFIG_PATH", "")]
+    if "ASCDS_INSTALL" in env:
+        top = env["ASCDS_INSTALL"]
+        path[:0] = [os.path.join(top, "lib", "pkgconfig"),
+                    os.path.join(top, "ots", "lib", "pkgconfig")]
+    env["PKG_CONFIG_PATH"] = os.pathsep.join(p for p in path if p)
+    out = subprocess.check_output(["pkg-config", flag] + CIAO_MODULES,
+                                  env=env)
+    return out.decode().split()
+
+
+cflags = pkg_config("--cflags")
+libs = pkg_config("--libs")
+
+ext = Extension(
+    "dmnautilus._dmnautilus",
+    sources=["_dmnautilus.c"] +
+    [os.path.join("../src", f) for f in LIB_SOURCES],
+    include_dirs=["../src", numpy.get_include()] +
+    [f[2:] for f in cflags if f.startswith("-I")],
+    extra_compile_args=["-std=gnu99"] +
+    [f for f in cflags if not f.startswith("-I")],
+    library_dirs=[f[2:] for f in libs if f.startswith("-L")],
+    runtime_library_dirs=[f[2:] for f in libs if f.startswith("-L")],
+    libraries=[f[2:] for f in libs if f.startswith("-l")] + ["pthread", "m"],
+    )
+
+setup(name="dmnautilus",
+      version="4.13.0",
+      description="Quad-tree adaptive binning of NumPy images",
+      packages=["dmnautilus"],
+      ext_modules=[ext])
@@ -0,0 +1,173 @@
+#
+#  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 3 of the License, or
+#  (at your option) any later version.
+#
+
+"""Tests of the Python module against the dmnautilus regression data.
+
+Build the module in place first, then run them from this directory:
+
+    cd python
+    python setup.py build_ext --inplace
+    python -m unittest -v test_dmnautilus
+
+img.fits binned with snr=15.8 method=4 must give the same image and mask
+as the new_four save files of test/dmnautilus.t.
+"""
+
+import os
+import unittest
+
+import numpy as np
+
+import dmnautilus
+
+TOP = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "test")
+INDIR = os.path.join(TOP, "indata", "dmnautilus")
+SAVDIR = os.path.join(TOP, "save_data", "dmnautilus")
+
+
+def read_image(path):
+    'The primary image of a FITS file, scaled, in native byte order'
+    with open(path, "rb") as fp:
+        head = {}
+        while "END" not in head:
+            block = fp.read(2880).decode("ascii")
+            for ii in range(0, 2880, 80):
+                card = block[ii:ii+80]
+                key = card[:8].strip()
+                if key == "END":
+                    head["END"] = True
+                    break
+                if card[8:10] == "= ":
+                    head[key] = card[10:].split("/")[0].strip()
+        bitpix = int(head["BITPIX"])
+        shape = (int(head["NAXIS2"]), int(head["NAXIS1"]))
+        dtype = {8: ">u1", 16: ">i2", 32: ">i4", 64: ">i8",
+                 -32: ">f4", -64: ">f8"}[bitpix]
+        data = np.frombuffer(fp.read(shape[0]*shape[1]*abs(bitpix)//8),
+                             dtype=dtype).reshape(shape)
+
+    bzero = float(head.get("BZERO", 0))
+    bscale = float(head.get("BSCALE", 1))
+    if bitpix == 32 and bzero == 2**31 and bscale == 1:
+        return (data.astype(np.int64) + 2**31).astype(np.uint64)
+    if bzero != 0 or bscale != 1:
+        return data * bscale + bzero
+    return data.astype(data.dtype.newbyteorder("="))
+
+
+class TestBin(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.img = read_image(os.path.join(INDIR, "img.fits"))
+        cls.ref = dmnautilus.bin(cls.img, snr=15.8, method=4)
+
+    def assert_same(self, out, ref=None):
+        ref = self.ref if ref is None else ref
+        for key in ("value", "area", "snr", "mask"):
+            np.testing.assert_array_equal(out[key], ref[key], err_msg=key)
+        for key in ref["bins"].dtype.names:
+            np.testing.assert_array_equal(out["bins"][key], ref["bins"][key],
+                                          err_msg="bins " + key)
+
+    def test_new_four(self):
+        'Same image and mask as the dmnautilus tool'
+        value = read_image(os.path.join(SAVDIR, "new_four.fits"))
+        mask = read_image(os.path.join(SAVDIR, "new_four.fits.map"))
+        np.testing.assert_array_equal(self.ref["value"], value)
+        np.testing.assert_array_equal(self.ref["mask"], mask)
+        self.assertEqual(len(self.ref["bins"]), int(mask.max()))
+        self.assertEqual(self.ref["value"].dtype, np.float32)
+        self.assertEqual(self.ref["mask"].dtype, np.uint64)
+
+    def test_dtypes(self):
+        'Each pixel type gives the same bins, read in place or converted'
+        for dtype in ("u2", "i2", "i8", "u8", "f4", "f8", ">i2", "i4"):
+            with self.subTest(dtype=dtype):
+                out = dmnautilus.bin(self.img.astype(dtype), snr=15.8,
+                                     method=4)
+                self.assert_same(out)
+
+        small = np.minimum(self.img, 255).astype(np.uint8)
+        ref = dmnautilus.bin(small.astype(np.float64), snr=15.8, method=4)
+        self.assert_same(dmnautilus.bin(small, snr=15.8, method=4), ref)
+
+        # Not C-contiguous: copied
+        wide = np.zeros((self.img.shape[0], 2*self.img.shape[1]), np.int16)
+        wide[:, ::2] = self.img
+        self.assert_same(dmnautilus.bin(wide[:, ::2], snr=15.8, method=4))
+
+    def test_err_var(self):
+        'err is squared into a work buffer, the same as var; neither changes'
+        err = np.sqrt(self.img + 1.0).astype(np.float32)
+        var = err * err
+        err_in = err.copy()
+        var_in = var.copy()
+
+        out_err = dmnautilus.bin(self.img, snr=15.8, method=4, err=err)
+        out_var = dmnautilus.bin(self.img, snr=15.8, method=4, var=var)
+        self.assert_same(out_err, out_var)
+        np.testing.assert_array_equal(err, err_in)
+        np.testing.assert_array_equal(var, var_in)
+
+        # float64 errors are converted to float32 first
+        out_err64 = dmnautilus.bin(self.img, snr=15.8, method=4,
+                                   err=err.astype(np.float64))
+        self.assert_same(out_err64, out_err)
+
+    def test_valid(self):
+        'valid (int16, read in place) leaves out the same pixels as NaN'
+        valid = np.ones(self.img.shape, dtype=np.int16)
+        valid[100:160, 50:200] = 0
+        nan = self.img.astype(np.float64)
+        nan[valid == 0] = np.nan
+        valid_in = valid.copy()
+
+        ref = dmnautilus.bin(nan, snr=5, method=2)
+        out = dmnautilus.bin(self.img.astype(np.float64), snr=5, method=2,
+                             valid=valid)
+        self.assert_same(out, ref)
+        np.testing.assert_array_equal(valid, valid_in)
+        self.assertTrue(np.isnan(out["value"][valid == 0]).all())
+        self.assertTrue((out["mask"][valid == 0] == 0).all())
+
+        # Other types are converted
+        out32 = dmnautilus.bin(self.img.astype(np.float64), snr=5,
+                               method=2, valid=valid.astype(np.int32))
+        self.assert_same(out32, ref)
+
+        with self.assertRaises(ValueError):
+            dmnautilus.bin(self.img, snr=5, valid=valid[1:])
+
+    def test_outputs(self):
+        'Output images are filled in place, or skipped'
+        value = np.empty(self.img.shape, dtype=np.float32)
+        mask = np.empty(self.img.shape, dtype=np.uint64)
+        out = dmnautilus.bin(self.img, snr=15.8, method=4, value=value,
+                             mask=mask, area=False, snrimg=False)
+        self.assertIs(out["value"], value)
+        self.assertIs(out["mask"], mask)
+        np.testing.assert_array_equal(value, self.ref["value"])
+        np.testing.assert_array_equal(mask, self.ref["mask"])
+
+        with self.assertRaises(ValueError):
+            dmnautilus.bin(self.img, snr=15.8, value=value.astype(np.float64))
+
+    def test_regions(self):
+        'The bins as rectangles around their pixels'
+        regs = dmnautilus.regions(self.ref["bins"])
+        self.assertEqual(len(regs), len(self.ref["bins"]))
+        b = self.ref["bins"][0]
+        self.assertEqual(regs[0], "rectangle({},{},{},{})".format(
+            b["xs"] + 0.5, b["ys"] + 0.5, b["xs"] + b["xl"] + 0.5,
+            b["ys"] + b["yl"] + 0.5))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,338 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <cxcregion.h>
+#include <dsnan.h>
+
+#include "dmn_private.h"
+
+
+/* Incremental binning: the leaves of an earlier run are kept where none
+ * of their pixels changed, and only the rest of the tree is walked. */
+
+
+/* ------Prototypes ----------------------- */
+
+static short leaf_is_inside( const abinLeaf *leaf, long xs, long ys, long xl, long yl );
+static long find_prev_end( abinPrevTree *prev, long xs, long ys, long xl, long yl );
+static int add_incr_children( dmnautilusContext *ctx, abinPrevTree *prev, long xs, long ys, long xl, long yl, short level, const abinStats *sub, abinNodeList *nodes );
+static short get_leaf_level( const abinLeaf *leaf, long xs, long ys, long xl, long yl, short level );
+
+
+/* ----------------------------- */
+
+
+static short leaf_is_inside( const abinLeaf *leaf, long xs, long ys, long xl, long yl )
+{
+  return( ( leaf->xs >= xs ) && ( leaf->ys >= ys ) &&
+          ( leaf->xs+leaf->xl <= xs+xl ) && ( leaf->ys+leaf->yl <= ys+yl ) );
+}
+
+
+/* The earlier leaves inside a sub-image follow each other in 
+ * depth-first order; find the first one after prev->at that is not */
+static long find_prev_end( abinPrevTree *prev, long xs, long ys, long xl, long yl )
+{
+  long lo = prev->at+1;
+  long hi = prev->nleaves;
+
+  while ( lo < hi ) {
+    long mid = lo + ( hi - lo ) / 2;
+    if ( leaf_is_inside( prev->leaf+mid, xs, ys, xl, yl ) ) {
+      lo = mid+1;
+    } else {
+      hi = mid;
+    }
+  }
+  return(lo);
+}
+
+
+/* Incremental traversal.  The tree is walked again alongside the leaves
+ * of the earlier run.  A sub-image w/o any changed pixels keeps its
+ * leaves: when the summed-area tables are exact, in this run and the
+ * earlier one, its statistics, and so every split decision below it,
+ * are the same as before and are not looked at again.  Otherwise the decisions are all made again and only
+ * the sums of unchanged leaves are kept.  Where a leaf is now split, the
+ * new sub-tree is traversed as usual.
+ *
+ * The nodes are added in depth-first order, so the leaves and mask
+ * numbers come out the same as binning from scratch.  stats is NULL
+ * if the statistics of the sub-image have not been looked up. */
+int add_incr_nodes( dmnautilusContext *ctx, abinPrevTree *prev, 
+                    long xs, long ys, long xl, long yl, short level, 
+                    const abinStats *stats, abinNodeList *nodes )
+{
+  const abinLeaf *leaf;
+  abinStats own;
+  abinStats sub[4];
+  long end;
+  short is_leaf, changed, check, kk;
+
+  /* Every sub-image the earlier tree reached has its leaves next */
+  if ( ( prev->at >= prev->nleaves ) || 
+       !leaf_is_inside( prev->leaf+prev->at, xs, ys, xl, yl ) ) {
+    return(-1);
+  }
+  leaf = prev->leaf + prev->at;
+  is_leaf = ( leaf->xs == xs ) && ( leaf->ys == ys ) && 
+            ( leaf->xl == xl ) && ( leaf->yl == yl );
+  end = is_leaf ? prev->at+1 : find_prev_end( prev, xs, ys, xl, yl );
+  changed = ( prev->nchanged[end] != prev->nchanged[prev->at] );
+
+  if ( !changed && ctx->exact_sums && prev->exact ) {
+    /* Keep the whole sub-tree */
+    memset( &own, 0, sizeof(abinStats));
+    if ( 0 != add_node( nodes, xs, ys, xl, yl, level, &own, 0 )) {
+      return(-1);
+    }
+    nodes->node[nodes->nnodes-1].prev = leaf;
+    nodes->node[nodes->nnodes-1].nprev = end - prev->at;
+    prev->at = end;
+    return(0);
+  }
+
+  if ( NULL == stats ) {
+    get_stats( ctx, &(ctx->count), xs, ys, xl, yl, &own );
+    stats = &own;
+  }
+  check = split_sub_image( ctx, &(ctx->count), xs, ys, xl, yl, stats, sub );
+  if ( check < 0 ) {
+    return(-1);
+  }
+
+  if ( !check ) {
+    prev->at = end;
+    if ( 0 != add_node( nodes, xs, ys, xl, yl, level, stats, 0 )) {
+      return(-1);
+    }
+    if ( is_leaf && !changed ) {
+      nodes->node[nodes->nnodes-1].prev = leaf;
+      nodes->node[nodes->nnodes-1].nprev = 1;
+    }
+    return(0);
+  }
+
+  if ( !is_leaf ) {
+    return( add_incr_children( ctx, prev, xs, ys, xl, yl, level, sub, nodes ));
+  }
+
+  /* A leaf that is now split; there is nothing to keep below it */
+  prev->at = end;
+  if ( ( 0 != add_node( nodes, xs, ys, FLOOR(xl/2.0), FLOOR(yl/2.0), level+1, sub+0, 0 )) || /* low-left */
+       ( 0 != add_node( nodes, xs+FLOOR(xl/2.0), ys, CEIL(xl/2.0), FLOOR(yl/2.0), level+1, sub+1, 0 )) || /* low-rite*/
+       ( 0 != add_node( nodes, xs, ys+FLOOR(yl/2.0), FLOOR(xl/2.0), CEIL(yl/2.0), level+1, sub+2, 0 )) || /* up-left */
+       ( 0 != add_node( nodes, xs+FLOOR(xl/2.0), ys+FLOOR(yl/2.0), CEIL(xl/2.0), CEIL(yl/2.0), level+1, sub+3, 0 ))) { /* up-rite */
+    return(-1);
+  }
+  for (kk=1; kk<=4; kk++ ) {
+    nodes->node[nodes->nnodes-kk].subtree = 1;
+  }
+  return(0);
+}
+
+
+/* The 4 sub-images, in the same order as get_sub_stats(); sub is NULL
+ * if their statistics have not been looked up */
+static int add_incr_children( dmnautilusContext *ctx, abinPrevTree *prev, 
+                              long xs, long ys, long xl, long yl, short level,
+                              const abinStats *sub, abinNodeList *nodes )
+{
+  if ( ( 0 != add_incr_nodes( ctx, prev, xs, ys, FLOOR(xl/2.0), FLOOR(yl/2.0), level+1, sub ? sub+0 : NULL, nodes )) || /* low-left */
+       ( 0 != add_incr_nodes( ctx, prev, xs+FLOOR(xl/2.0), ys, CEIL(xl/2.0), FLOOR(yl/2.0), level+1, sub ? sub+1 : NULL, nodes )) || /* low-rite*/
+       ( 0 != add_incr_nodes( ctx, prev, xs, ys+FLOOR(yl/2.0), FLOOR(xl/2.0), CEIL(yl/2.0), level+1, sub ? sub+2 : NULL, nodes )) || /* up-left */
+       ( 0 != add_incr_nodes( ctx, prev, xs+FLOOR(xl/2.0), ys+FLOOR(yl/2.0), CEIL(xl/2.0), CEIL(yl/2.0), level+1, sub ? sub+3 : NULL, nodes ))) { /* up-rite */
+    return(-1);
+  }
+  return(0);
+}
+
+
+/* The depth of a leaf in the tree, going down from the sub-image it is
+ * in; the table of bins does not have it */
+static short get_leaf_level( const abinLeaf *leaf, long xs, long ys, long xl, long yl, 
+                             short level )
+{
+  /* Same halves as get_sub_stats(); xl/2 is FLOOR(xl/2.0) and xl-xl/2 
+   * is CEIL(xl/2.0), w/o going through double for every level */
+  while ( ( leaf->xl != xl ) || ( leaf->yl != yl ) ) {
+    long hx = xl/2;
+    long hy = yl/2;
+    if ( ( hx < 1 ) || ( hy < 1 ) ) {
+      break;  /* not in the tree; cannot happen for a matched leaf */
+    }
+    if ( leaf->xs < xs+hx ) {
+      xl = hx;
+    } else {
+      xs += hx;
+      xl -= hx;
+    }
+    if ( leaf->ys < ys+hy ) {
+      yl = hy;
+    } else {
+      ys += hy;
+      yl -= hy;
+    }
+    level++;
+  }
+  return(level);
+}
+
+
+/* Make the leaves for one task of the incremental traversal: keep the
+ * unchanged ones, sum up the changed ones, and traverse new sub-trees */
+void run_incr_task( dmnautilusContext *ctx, abinTask *task )
+{
+  long nn, kk;
+
+  for (nn=0; nn<task->nnodes; nn++ ) {
+    abinNode *node = &(task->nodes[nn]);
+
+    if ( node->prev ) {
+      for (kk=0; kk<node->nprev; kk++ ) {
+        abinLeaf *leaf = new_leaf( ctx, &(task->leaves) );
+        if ( NULL == leaf ) {
+          return;
+        }
+        *leaf = node->prev[kk];
+        leaf->level = get_leaf_level( leaf, node->xs, node->ys, node->xl, node->yl, 
+                                      node->level );
+      }
+      continue;
+    }
+
+    if ( node->subtree ) {
+      abin_rec( ctx, &(task->count), node->xs, node->ys, node->xl, node->yl, node->level, 
+                &(node->stats), &(task->leaves) );
+    } else {
+      add_leaf( ctx, &(task->count), &(task->leaves), node->xs, node->ys, node->xl, node->yl, 
+                node->level, &(node->stats) );
+    }
+  }
+}
+
+
+/* Read the leaves of an earlier run and find the ones with a changed
+ * pixel: one that is non-zero or null in the delta image.  ctx->row must
+ * be allocated. */
+int load_prev_tree( dmnautilusContext *ctx, const char *binfile, const char *deltafile,
+                    const dmnautilusParams *params, abinPrevTree *prev )
+{
+  dmBlock *inBlock;
+  dmDescriptor *xdesc, *ydesc;
+  dmnPixelKernels kern;
+  regRegion *dss=NULL;
+  long *lAxes=NULL;
+  void *data = NULL;
+  dmDataType dt;
+  long null;
+  short has_null;
+  short *mask = NULL;
+  long nn, xx, yy;
+  int retval = 0;
+
+  memset( prev, 0, sizeof(abinPrevTree));
+  if ( 0 != read_bin_table( ctx, binfile, 1, params, &(prev->tasks), &(prev->exact) ) ) {
+    return(-1);
+  }
+  if ( prev->tasks.ntasks > 0 ) {
+    prev->leaf = prev->tasks.task[0].leaves.leaf;
+    prev->nleaves = prev->tasks.task[0].leaves.nleaves;
+  }
+  prev->nchanged = (long*)calloc( prev->nleaves+1, sizeof(long));
+  if ( NULL == prev->nchanged ) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+
+  pthread_mutex_lock( &dm_lock );
+  inBlock = dmImageOpen( deltafile );
+  if ( !inBlock ) {
+    pthread_mutex_unlock( &dm_lock );
+    err_msg("ERROR: Could not open indeltafile='%s'\n", deltafile );
+    return(-1);
+  }
+  dt = get_image_data( inBlock, &data, &lAxes, &dss, &null, &has_null );
+  if ( ( NULL == data ) || ( lAxes[0] != ctx->xlen ) || ( lAxes[1] != ctx->ylen ) ) {
+    err_msg("ERROR: Delta image '%s' must be the same size as infile\n", deltafile );
+    retval = -1;
+  } else if ( 0 != get_pixel_kernels( dt, &kern ) ) {
+    err_msg("ERROR: Unsupported datatype in delta image '%s'\n", deltafile );
+    retval = -1;
+  } else {
+    get_image_wcs( inBlock, &xdesc, &ydesc );
+    mask = get_image_mask( inBlock, data, dt, lAxes, dss, null, has_null, xdesc, ydesc );
+  }
+  dmImageClose( inBlock );
+  pthread_mutex_unlock( &dm_lock );
+  if ( lAxes ) free( lAxes );
+  if ( dss ) regFree( dss );
+
+  /* load_row() needs a mask; make one from the NaNs, as select_kernels()
+   * does, if there isn't one */
+  if ( ( 0 == retval ) && ( NULL == mask ) ) {
+    mask = (short*)calloc( ctx->xlen*ctx->ylen, sizeof(short));
+    if ( NULL == mask ) {
+      err_msg("ERROR: Could not allocate memory\n");
+      retval = -1;
+    }
+    for (yy=0; ( 0 == retval ) && ( yy<ctx->ylen ); yy++) {
+      for (xx=0; xx<ctx->xlen; xx++) {
+        double pixval = get_image_value( data, dt, xx, yy, ctx->lAxes, NULL );
+        mask[xx+yy*ctx->xlen] = ds_dNAN(pixval) ? 0 : 1;
+      }
+    }
+  }
+
+  for (nn=0; ( 0 == retval ) && ( nn<prev->nleaves ); nn++ ) {
+    const abinLeaf *leaf = prev->leaf+nn;
+    short changed = 0;
+
+    for (yy=leaf->ys; ( !changed ) && ( yy<leaf->ys+leaf->yl ); yy++ ) {
+      long first = leaf->xs + yy*ctx->xlen;
+      kern.load_row( data, first, leaf->xl, mask, ctx->row );
+      ctx->count.pixels += leaf->xl;
+      for (xx=0; xx<leaf->xl; xx++ ) {
+        if ( ( !mask[first+xx] ) || ( 0 != ctx->row[xx] ) ) {
+          changed = 1;
+          break;
+        }
+      }
+    }
+    prev->nchanged[nn+1] = prev->nchanged[nn] + changed;
+  }
+
+  if ( mask ) free( mask );
+  if ( data ) free( data );
+  return(retval);
+}
+
+
+void free_prev_tree( abinPrevTree *prev )
+{
+  free_tasks( &(prev->tasks) );
+  if ( prev->nchanged ) free( prev->nchanged );
+  memset( prev, 0, sizeof(abinPrevTree));
+}
@@ -0,0 +1,674 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <cxcregion.h>
+#include <dsnan.h>
+
+#include "dmn_private.h"
+
+
+/* Reading the input: the images and their errors, the summed-area
+ * tables, and the work buffers they are kept in between runs. */
+
+
+/* ------Prototypes ----------------------- */
+
+static float *load_band_row( dmnautilusContext *ctx, abinBand *band, long first, double *row, float *vrow );
+static float *sum_band_rows( dmnautilusContext *ctx, long first );
+static void check_exact_row( const double *row, const float *var, const short *valid, long nn, int *minexp, double *total );
+
+
+/* ----------------------------- */
+
+
+/* Read the error (sigma) or variance image, if there is one.  With
+ * neither the errors are Poisson and there is no array at all; the 
+ * variance is computed from the data as it is needed.  An error image
+ * is squared when the summed-area tables are made. */
+int load_error_image( dmnautilusContext *ctx, abinBand *band,
+                      const char *errimg, const char *varimg )
+{
+  unsigned long npix = ctx->xlen*ctx->ylen;
+  const char *infile;
+  long enAxes;
+  long *elAxes;
+  dmDescriptor *errDs;
+  dmBlock *erBlock;
+
+  band->dvar = NULL;
+  band->var_is_sigma = 0;
+  if ( want_output( errimg ) && want_output( varimg ) ) {
+    err_msg("ERROR: Only one of inerrfile and invarfile can be used\n");
+    return(-1);
+  }
+  if ( want_output( errimg ) ) {
+    infile = errimg;
+    band->var_is_sigma = 1;
+  } else if ( want_output( varimg ) ) {
+    infile = varimg;
+  } else {
+    return(0);  /* assumes Poisson stats */
+  }
+
+  if ( 0 != get_buffer( ctx, &(band->varbuf), npix*sizeof(float) ) ) {
+    err_msg("ERROR: Could not allocate memory for image\n");
+    return(-1);
+  }
+
+  pthread_mutex_lock( &dm_lock );
+  erBlock = dmImageOpen( infile );
+  if ( erBlock == NULL ) {
+    pthread_mutex_unlock( &dm_lock );
+    err_msg("ERROR: Could not open file '%s'\n", infile);
+    return(-1);
+  }
+  errDs = dmImageGetDataDescriptor(erBlock );
+  enAxes = dmGetArrayDimensions( errDs, &elAxes );
+  if ( (enAxes != 2 ) || 
+   ( elAxes[0] != ctx->xlen ) ||
+   ( elAxes[1] != ctx->ylen )    ) {
+    dmImageClose( erBlock );
+    pthread_mutex_unlock( &dm_lock );
+    err_msg("ERROR: Error image must be 2D image with non-zero axes\n");
+    return(-1);
+  }
+
+  dmGetArray_f( errDs, (float*)band->varbuf.ptr, npix );
+
+  dmImageClose( erBlock );
+  pthread_mutex_unlock( &dm_lock );
+
+  band->dvar = (float*)band->varbuf.ptr;
+  return 0;
+}
+
+
+/* Load one row of a band into row, and return its variances: either
+ * vrow, filled in here, or the row of the variance image.  An error
+ * image is squared in place so the leaves can use it as the variance;
+ * each row is only loaded once. */
+static float *load_band_row( dmnautilusContext *ctx, abinBand *band, long first,
+                             double *row, float *vrow )
+{
+  float *var = vrow;
+  long xx;
+
+  band->kern.load_row( band->kdata, first, ctx->xlen, ctx->pixmask, row );
+  ctx->count.pixels += ctx->xlen;
+
+  if ( NULL == band->dvar ) {
+    /* Poisson: the float error, squared, as the old error image had */
+    for (xx=0; xx<ctx->xlen; xx++) {
+      float err = sqrt(row[xx]);
+      var[xx] = err * err;
+    }
+  } else if ( band->var_is_sigma ) {
+    var = band->dvar + first;
+    for (xx=0; xx<ctx->xlen; xx++) {
+      var[xx] = var[xx] * var[xx];
+    }
+  } else {
+    var = band->dvar + first;
+  }
+  return(var);
+}
+
+
+/* Load one row of all the bands summed into ctx->row and ctx->vrow */
+static float *sum_band_rows( dmnautilusContext *ctx, long first )
+{
+  double *brow = ctx->row + ctx->xlen;
+  float *bvrow = ctx->vrow + ctx->xlen;
+  float *var;
+  short bb;
+  long xx;
+
+  var = load_band_row( ctx, ctx->band, first, ctx->row, ctx->vrow );
+  if ( var != ctx->vrow ) {
+    memcpy( ctx->vrow, var, ctx->xlen*sizeof(float));
+  }
+  for (bb=1; bb<ctx->nbands; bb++ ) {
+    var = load_band_row( ctx, ctx->band+bb, first, brow, bvrow );
+    for (xx=0; xx<ctx->xlen; xx++) {
+      ctx->row[xx] += brow[xx];
+      ctx->vrow[xx] += var[xx];
+    }
+  }
+  return( ctx->vrow );
+}
+
+
+/* Find the smallest power of 2 (2^minexp) that all the values in the
+ * row are a multiple of, and add up their magnitudes.  minexp only ever
+ * goes down so this is about one test per value. */
+static void check_exact_row( const double *row, const float *var, const short *valid,
+                             long nn, int *minexp, double *total )
+{
+  double scale = ldexp( 1.0, -*minexp );
+  double sum = 0;
+  long xx;
+
+  for (xx=0; xx<nn; xx++) {
+    double vals[2];
+    short kk;
+
+    if ( !valid[xx] ) {
+      continue;
+    }
+    vals[0] = row[xx];
+    vals[1] = var[xx];
+    for (kk=0; kk<2; kk++ ) {
+      double scaled = vals[kk] * scale;
+      if ( !isfinite( scaled ) ) {
+        sum = HUGE_VAL;
+        continue;
+      }
+      while ( scaled != floor( scaled ) ) {
+        *minexp -= 1;
+        scale *= 2;
+        scaled = vals[kk] * scale;
+      }
+      sum += fabs( vals[kk] );
+    }
+  }
+  *total += sum;
+}
+
+
+/* Build the summed-area tables from the data and variance in one pass
+ * over the image.  Null/NaN pixels contribute nothing, same as they were
+ * skipped in the old pixel-by-pixel get_snr().
+ *
+ * With ctx->check_exact set, this also finds whether every sum in the
+ * tables is exact: it is if all the values are multiples of some 2^minexp
+ * and the total is less than 2^52 of those.  Counts always are. */
+int make_sum_tables( dmnautilusContext *ctx )
+{
+  long xx, yy;
+  short ss;
+  int minexp = 0;
+  double total = 0;
+
+  /* Buffers may be left over from the last image; zero the first row
+   * and column, everything else gets filled in below. */
+  for (ss=0; ss<ctx->nsat; ss++ ) {
+    abinSat *sat = ctx->sat+ss;
+    for (xx=0; xx<=ctx->xlen; xx++) {
+      sat->sumval[SAT_IDX(xx,0)] = 0;
+      sat->sumvar[SAT_IDX(xx,0)] = 0;
+    }
+    for (yy=0; yy<=ctx->ylen; yy++) {
+      sat->sumval[SAT_IDX(0,yy)] = 0;
+      sat->sumvar[SAT_IDX(0,yy)] = 0;
+    }
+  }
+  for (xx=0; xx<=ctx->xlen; xx++) {
+    ctx->sumpix[SAT_IDX(xx,0)] = 0;
+  }
+  for (yy=0; yy<=ctx->ylen; yy++) {
+    ctx->sumpix[SAT_IDX(0,yy)] = 0;
+  }
+
+  for (yy=0; yy<ctx->ylen; yy++) {
+    long first = yy*ctx->xlen;
+    const short *valid = ctx->pixmask + first;
+    long *nat = ctx->sumpix + SAT_IDX(1,yy+1);
+    long *nbelow = ctx->sumpix + SAT_IDX(1,yy);
+    long rpix = 0;
+
+    /* A row w/o any valid pixels adds nothing; same as the row below */
+    if ( ( yy < ctx->vbox[1] ) || ( yy >= ctx->vbox[3] ) ) {
+      memcpy( nat, nbelow, ctx->xlen*sizeof(long));
+      for (ss=0; ss<ctx->nsat; ss++ ) {
+        abinSat *sat = ctx->sat+ss;
+        memcpy( sat->sumval + SAT_IDX(1,yy+1), sat->sumval + SAT_IDX(1,yy), 
+                ctx->xlen*sizeof(double));
+        memcpy( sat->sumvar + SAT_IDX(1,yy+1), sat->sumvar + SAT_IDX(1,yy), 
+                ctx->xlen*sizeof(double));
+      }
+      continue;
+    }
+
+    for (xx=0; xx<ctx->xlen; xx++) {
+      rpix += ( valid[xx] != 0 );
+      nat[xx] = nbelow[xx] + rpix;
+    }
+
+    for (ss=0; ss<ctx->nsat; ss++ ) {
+      abinSat *sat = ctx->sat+ss;
+      double *at = sat->sumval + SAT_IDX(1,yy+1);
+      double *below = sat->sumval + SAT_IDX(1,yy);
+      double *vat = sat->sumvar + SAT_IDX(1,yy+1);
+      double *vbelow = sat->sumvar + SAT_IDX(1,yy);
+      const float *var;
+
+      /* Running sums along the current row */
+      double rval = 0;
+      double rvar = 0;
+
+      if ( ctx->nsat < ctx->nbands ) {
+        var = sum_band_rows( ctx, first );
+      } else {
+        var = load_band_row( ctx, ctx->band+ss, first, ctx->row, ctx->vrow );
+      }
+
+      for (xx=0; xx<ctx->xlen; xx++) {
+        rval += ctx->row[xx];
+        rvar += valid[xx] ? var[xx] : 0;
+
+        at[xx] = below[xx] + rval;
+        vat[xx] = vbelow[xx] + rvar;
+      } // end xx
+
+      if ( ctx->check_exact ) {
+        check_exact_row( ctx->row, var, valid, ctx->xlen, &minexp, &total );
+      }
+    } // end ss
+  } // end yy
+
+  ctx->exact_sums = ctx->check_exact && ( total < ldexp( 1.0, 52+minexp ) );
+  ctx->have_counts = 1;
+
+  return(0);
+}
+
+
+/* The smallest box that has all the valid pixels, eg the chips of a
+ * rotated observation w/o the blank corners around them */
+void find_valid_box( dmnautilusContext *ctx )
+{
+  long x0 = ctx->xlen;
+  long y0 = ctx->ylen;
+  long x1 = 0;
+  long y1 = 0;
+  long yy;
+
+  for (yy=0; yy<ctx->ylen; yy++) {
+    const short *valid = ctx->pixmask + yy*ctx->xlen;
+    long lo = 0;
+    long hi = ctx->xlen;
+
+    while ( ( lo < hi ) && !valid[lo] ) lo++;
+    if ( lo == hi ) {
+      continue;
+    }
+    while ( !valid[hi-1] ) hi--;
+
+    if ( lo < x0 ) x0 = lo;
+    if ( hi > x1 ) x1 = hi;
+    if ( yy < y0 ) y0 = yy;
+    y1 = yy+1;
+  }
+
+  if ( x1 == 0 ) {
+    x0 = y0 = 0;  /* no valid pixels */
+  }
+  ctx->vbox[0] = x0;
+  ctx->vbox[1] = y0;
+  ctx->vbox[2] = x1;
+  ctx->vbox[3] = y1;
+}
+
+
+/* layout=tile: once the summed-area tables are made the pixels are only
+ * read to sum the leaves, so copy them (and the variances and validity)
+ * into tiles and drop the image as read.  The row-major pixmask is kept
+ * for the outputs. */
+int tile_bands( dmnautilusContext *ctx )
+{
+  size_t ntiles = DMN_NUM_TILES( ctx->xlen ) * DMN_NUM_TILES( ctx->ylen );
+  size_t tilepix = ntiles*DMN_TILE*DMN_TILE;
+  dmnPixelKernels mkern, vkern;
+  short bb;
+
+  get_pixel_kernels( dmSHORT, &mkern );
+  get_pixel_kernels( dmFLOAT, &vkern );
+
+  if ( 0 != get_buffer( ctx, &(ctx->tilemaskbuf), tilepix*sizeof(short) ) ) {
+    err_msg("ERROR: Could not allocate memory for image tiles\n");
+    return(-1);
+  }
+  ctx->tilemask = (short*)ctx->tilemaskbuf.ptr;
+  mkern.to_tiles( ctx->pixmask, ctx->xlen, ctx->ylen, ctx->tilemask );
+
+  for (bb=0; bb<ctx->nbands; bb++ ) {
+    abinBand *band = ctx->band+bb;
+
+    if ( 0 != get_buffer( ctx, &(band->tilebuf[0]), tilepix*band->kern.size ) ) {
+      err_msg("ERROR: Could not allocate memory for image tiles\n");
+      return(-1);
+    }
+    band->kern.to_tiles( band->kdata, ctx->xlen, ctx->ylen, band->tilebuf[0].ptr );
+    if ( band->data && !ctx->borrowed ) free( band->data );
+    if ( band->dplane ) free( band->dplane );
+    band->data = NULL;
+    band->dplane = NULL;
+    band->kdata = band->tilebuf[0].ptr;
+
+    if ( band->dvar ) {
+      if ( 0 != get_buffer( ctx, &(band->tilebuf[1]), tilepix*sizeof(float) ) ) {
+        err_msg("ERROR: Could not allocate memory for image tiles\n");
+        return(-1);
+      }
+      vkern.to_tiles( band->dvar, ctx->xlen, ctx->ylen, band->tilebuf[1].ptr );
+      band->dvar = (float*)band->tilebuf[1].ptr;
+    }
+  }
+  return(0);
+}
+
+
+/* Pick the pixel kernels for the image datatype.  This is the only place
+ * that needs to know about the datatype; the loops that touch every
+ * pixel call the kernels and never go through get_image_value(). */
+int select_kernels( dmnautilusContext *ctx, abinBand *band )
+{
+  long npix = ctx->xlen*ctx->ylen;
+  long xx, yy;
+
+  /* Should always have a mask, but just in case */
+  if ( NULL == ctx->pixmask ) {
+    ctx->pixmask = (short*)calloc( npix, sizeof(short));
+    if ( NULL == ctx->pixmask ) {
+      err_msg("ERROR: Could not allocate memory for image\n");
+      return(-1);
+    }
+    for (yy=0; yy<ctx->ylen; yy++) {
+      for (xx=0; xx<ctx->xlen; xx++) {
+        double pixval = get_image_value( band->data, band->datatype, xx, yy,
+                                         ctx->lAxes, NULL );
+        ctx->pixmask[xx+yy*ctx->xlen] = ds_dNAN(pixval) ? 0 : 1;
+      }
+    }
+  }
+
+  if ( 0 == get_pixel_kernels( band->datatype, &(band->kern) )) {
+    band->kdata = band->data;
+    return(0);
+  }
+
+  /* No kernel for this datatype; convert to double once */
+  band->dplane = (double*)calloc( npix, sizeof(double));
+  if ( NULL == band->dplane ) {
+    err_msg("ERROR: Could not allocate memory for image\n");
+    return(-1);
+  }
+  for (yy=0; yy<ctx->ylen; yy++) {
+    for (xx=0; xx<ctx->xlen; xx++) {
+      band->dplane[xx+yy*ctx->xlen] = get_image_value( band->data, band->datatype,
+                                         xx, yy, ctx->lAxes, ctx->pixmask );
+    }
+  }
+  get_pixel_kernels( dmDOUBLE, &(band->kern) );
+  band->kdata = band->dplane;
+  return(0);
+}
+
+
+/* Make sure the work buffers are big enough for the current image */
+int alloc_buffers( dmnautilusContext *ctx )
+{
+  long nsat = (ctx->xlen+1)*(ctx->ylen+1);
+  short ss;
+
+  if ( ctx->xlen > ctx->xlen_alloc ) {
+    if (ctx->row) free(ctx->row);
+    if (ctx->vrow) free(ctx->vrow);
+    ctx->row = (double*)calloc(2*ctx->xlen,sizeof(double));
+    ctx->vrow = (float*)calloc(2*ctx->xlen,sizeof(float));
+    ctx->xlen_alloc = ctx->xlen;
+    if ( ( NULL == ctx->row ) || ( NULL == ctx->vrow ) ) {
+      ctx->xlen_alloc = 0;
+      err_msg("ERROR: Could not allocate memory for image\n");
+      return(-1);
+    }
+  }
+
+  for (ss=0; ss<ctx->nsat; ss++ ) {
+    abinSat *sat = ctx->sat+ss;
+    if ( ( 0 != get_buffer( ctx, &(sat->buf[0]), nsat*sizeof(double) ) ) ||
+         ( 0 != get_buffer( ctx, &(sat->buf[1]), nsat*sizeof(double) ) ) ) {
+      err_msg("ERROR: Could not allocate memory for summed-area tables\n");
+      return(-1);
+    }
+    sat->sumval = (double*)sat->buf[0].ptr;
+    sat->sumvar = (double*)sat->buf[1].ptr;
+  }
+  if ( 0 != get_buffer( ctx, &(ctx->pixbuf), nsat*sizeof(long) ) ) {
+    err_msg("ERROR: Could not allocate memory for summed-area tables\n");
+    return(-1);
+  }
+  ctx->sumpix = (long*)ctx->pixbuf.ptr;
+
+  return(0);
+}
+
+
+/* Make room for nbands bands and their summed-area tables.  The 
+ * buffers of bands already there are kept. */
+int alloc_bands( dmnautilusContext *ctx, short nbands )
+{
+  abinBand *band;
+  abinSat *sat;
+
+  if ( nbands > ctx->maxbands ) {
+    band = (abinBand*)realloc( ctx->band, nbands*sizeof(abinBand));
+    if ( NULL == band ) {
+      return(-1);
+    }
+    ctx->band = band;
+    sat = (abinSat*)realloc( ctx->sat, nbands*sizeof(abinSat));
+    if ( NULL == sat ) {
+      return(-1);
+    }
+    ctx->sat = sat;
+    memset( ctx->band+ctx->maxbands, 0, (nbands-ctx->maxbands)*sizeof(abinBand));
+    memset( ctx->sat+ctx->maxbands, 0, (nbands-ctx->maxbands)*sizeof(abinSat));
+    ctx->maxbands = nbands;
+  }
+  ctx->nbands = nbands;
+  return(0);
+}
+
+
+/* Read one more band.  It must be the same size as infile; a pixel is
+ * only valid if it is valid in every band. */
+int load_band( dmnautilusContext *ctx, abinBand *band, const char *infile,
+               const char *binspec )
+{
+  dmBlock *inBlock;
+  dmDescriptor *xdesc, *ydesc;
+  regRegion *dss=NULL;
+  long *lAxes=NULL;
+  long null;
+  short has_null;
+  short *mask;
+  char *name;
+  long ii;
+
+  if ( NULL == ( name = get_infile_name( infile, binspec ))) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+
+  pthread_mutex_lock( &dm_lock );
+  inBlock = dmImageOpen( name );
+  if ( !inBlock ) {
+    pthread_mutex_unlock( &dm_lock );
+    err_msg("ERROR: Could not open infile='%s'\n", name );
+    free( name );
+    return(-1);
+  }
+  free( name );
+
+  band->datatype = get_image_data( inBlock, &(band->data), &lAxes, &dss, &null, &has_null );
+  if ( ( NULL == band->data ) || ( lAxes[0] != ctx->xlen ) || ( lAxes[1] != ctx->ylen ) ) {
+    dmImageClose( inBlock );
+    pthread_mutex_unlock( &dm_lock );
+    err_msg("ERROR: Band image '%s' must be the same size as infile\n", infile );
+    if ( lAxes ) free( lAxes );
+    if ( dss ) regFree( dss );
+    return(-1);
+  }
+  get_image_wcs( inBlock, &xdesc, &ydesc );
+  mask = get_image_mask( inBlock, band->data, band->datatype, lAxes, dss, null, has_null, 
+                         xdesc, ydesc );
+  dmImageClose( inBlock );
+  pthread_mutex_unlock( &dm_lock );
+  if ( lAxes ) free( lAxes );
+  if ( dss ) regFree( dss );
+
+  if ( mask && ctx->pixmask ) {
+    for (ii=0; ii<ctx->xlen*ctx->ylen; ii++ ) {
+      ctx->pixmask[ii] = ( ctx->pixmask[ii] && mask[ii] );
+    }
+  }
+  if ( mask ) free( mask );
+
+  return(0);
+}
+
+
+/* Make sure a work buffer is big enough, and is in memory or on disk as
+ * the current image needs.  The contents are not kept. */
+int get_buffer( dmnautilusContext *ctx, abinBuffer *buf, size_t nbytes )
+{
+  char *name;
+  int fd;
+
+  if ( buf->ptr && ( buf->nbytes >= nbytes ) && 
+       ( buf->mapped == ctx->map_buffers ) ) {
+    return(0);
+  }
+  free_buffer( buf );
+
+  if ( !ctx->map_buffers ) {
+    buf->ptr = malloc( nbytes );
+    if ( NULL == buf->ptr ) {
+      return(-1);
+    }
+    buf->nbytes = nbytes;
+    return(0);
+  }
+
+  name = (char*)malloc( strlen(ctx->tmpdir)+32 );
+  if ( NULL == name ) {
+    return(-1);
+  }
+  sprintf( name, "%s/dmnautilus.XXXXXX", ctx->tmpdir );
+  fd = mkstemp( name );
+  if ( fd < 0 ) {
+    err_msg("ERROR: Could not create temporary file in '%s'\n", ctx->tmpdir );
+    free( name );
+    return(-1);
+  }
+  unlink( name );  /* Goes away when unmapped */
+  free( name );
+
+  if ( 0 != ftruncate( fd, nbytes ) ) {
+    close( fd );
+    return(-1);
+  }
+  buf->ptr = mmap( NULL, nbytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( MAP_FAILED == buf->ptr ) {
+    buf->ptr = NULL;
+    return(-1);
+  }
+  buf->nbytes = nbytes;
+  buf->mapped = 1;
+  return(0);
+}
+
+
+void free_buffer( abinBuffer *buf )
+{
+  if ( buf->ptr ) {
+    if ( buf->mapped ) {
+      munmap( buf->ptr, buf->nbytes );
+    } else {
+      free( buf->ptr );
+    }
+  }
+  memset( buf, 0, sizeof(abinBuffer));
+}
+
+
+/* Do the work buffers for the current image need more than memlimit 
+ * MB?  Counts a variance image per band, summed-area tables and two
+ * output planes.  memlimit only decides where those go: the input
+ * images are read whole and the outputs written whole, so it does not
+ * bound the memory used. */
+short need_mapped_buffers( dmnautilusContext *ctx, long memlimit )
+{
+  double npix = (double)ctx->xlen*ctx->ylen;
+  double nsat = (double)(ctx->xlen+1)*(ctx->ylen+1);
+  double nbytes;
+
+  if ( memlimit <= 0 ) {
+    return(0);
+  }
+  nbytes = npix*( ctx->nbands*sizeof(float) + 2*sizeof(unsigned long) ) +
+           nsat*( ctx->nsat*2*sizeof(double) + sizeof(long) );
+  if ( ctx->tiled ) {
+    nbytes += npix*( ctx->nbands*sizeof(float) + sizeof(short) );
+  }
+  return( nbytes > memlimit*1024.0*1024.0 );
+}
+
+
+/* The name to open infile with.  An event list is binned by the DM
+ * library's virtual file binning, eg evt.fits[energy=500:7000][bin sky=4];
+ * the image is only ever made in memory, and has the WCS of the
+ * binning, so nothing needs to be written out and read back first.
+ * Returns a new string. */
+char *get_infile_name( const char *infile, const char *binspec )
+{
+  char *name;
+  const char *at;
+  short has_bin = 0;
+
+  for (at=infile; *at; at++ ) {
+    if ( 0 == strncasecmp( at, "[bin ", 5 ) ) {
+      has_bin = 1;
+      break;
+    }
+  }
+
+  name = (char*)malloc( strlen(infile) + ( binspec ? strlen(binspec) : 0 ) + 8 );
+  if ( NULL == name ) {
+    return(NULL);
+  }
+  if ( want_output( binspec ) && !has_bin ) {
+    sprintf( name, "%s[bin %s]", infile, binspec );
+  } else {
+    strcpy( name, infile );
+  }
+  return(name);
+}
@@ -0,0 +1,122 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include "dmn_kernels.h"
+
+
+/* load_row is branch free (select rather than if/continue) so the
+ * compiler can vectorize it.  sum_col selects the same way, and has one
+ * loop with a variance plane and one without so there is no test of dvar
+ * per pixel, but it is not vectorized: the float additions have to be
+ * done one at a time in the original order or the output values would
+ * change.  Adding 0 for a pixel that is not valid leaves the sums as
+ * they were.  to_tiles is only used w/ layout=tile. */
+#define DMN_PIXEL_KERNELS( SFX, TYPE )                                      \
+static void load_row_##SFX( const void *data, long first, long nn,         \
+                            const short *valid, double *row )              \
+{                                                                          \
+  const TYPE *img = ((const TYPE*)data) + first;                           \
+  const short *ok = valid + first;                                         \
+  long ii;                                                                 \
+  for (ii=0; ii<nn; ii++ ) {                                               \
+    row[ii] = ok[ii] ? (double)img[ii] : 0.0;                              \
+  }                                                                        \
+}                                                                          \
+                                                                           \
+static void sum_col_##SFX( const void *data, long first, long stride,      \
+                           long nn, const short *valid,                    \
+                           const float *dvar, float *val,                  \
+                           float *noise, long *area )                      \
+{                                                                          \
+  const TYPE *img = (const TYPE*)data;                                     \
+  float fval = *val;                                                       \
+  float fnoise = *noise;                                                   \
+  long npix = *area;                                                       \
+  long ii, pix;                                                            \
+  if ( dvar ) {                                                            \
+    for (ii=0, pix=first; ii<nn; ii++, pix+=stride ) {                     \
+      short ok = ( valid[pix] != 0 );                                      \
+      fval += ok ? (double)img[pix] : 0.0;                                 \
+      fnoise += ok ? dvar[pix] : 0.0f;                                     \
+      npix += ok;                                                          \
+    }                                                                      \
+  } else {                                                                 \
+    for (ii=0, pix=first; ii<nn; ii++, pix+=stride ) {                     \
+      short ok = ( valid[pix] != 0 );                                      \
+      double pixval = ok ? (double)img[pix] : 0.0;                         \
+      float err = sqrt(pixval);                                            \
+      fval += pixval;                                                      \
+      fnoise += ( err * err );                                             \
+      npix += ok;                                                          \
+    }                                                                      \
+  }                                                                        \
+  *val = fval;                                                             \
+  *noise = fnoise;                                                         \
+  *area = npix;                                                            \
+}                                                                          \
+                                                                           \
+static void to_tiles_##SFX( const void *data, long xlen, long ylen,        \
+                            void *tiles )                                  \
+{                                                                          \
+  const TYPE *img = (const TYPE*)data;                                     \
+  TYPE *out = (TYPE*)tiles;                                                \
+  long ntx = DMN_NUM_TILES( xlen );                                        \
+  long yy, x0;                                                             \
+  for (yy=0; yy<ylen; yy++ ) {                                             \
+    const TYPE *row = img + yy*xlen;                                       \
+    for (x0=0; x0<xlen; x0+=DMN_TILE ) {                                   \
+      long nx = ( x0+DMN_TILE > xlen ) ? xlen-x0 : DMN_TILE;               \
+      memcpy( out + DMN_TILE_IDX(x0,yy,ntx), row+x0, nx*sizeof(TYPE));     \
+    }                                                                      \
+  }                                                                        \
+}
+
+DMN_PIXEL_KERNELS( ub, unsigned char )
+DMN_PIXEL_KERNELS( s,  short )
+DMN_PIXEL_KERNELS( us, unsigned short )
+DMN_PIXEL_KERNELS( l,  long )
+DMN_PIXEL_KERNELS( ul, unsigned long )
+DMN_PIXEL_KERNELS( f,  float )
+DMN_PIXEL_KERNELS( d,  double )
+
+
+#define DMN_SET_KERNELS( SFX, TYPE )                                        \
+  kern->load_row = load_row_##SFX; kern->sum_col = sum_col_##SFX;          \
+  kern->to_tiles = to_tiles_##SFX; kern->size = sizeof(TYPE)
+
+/* The types here are the ones get_image_data() stores the pixels as */
+int get_pixel_kernels( dmDataType dt, dmnPixelKernels *kern )
+{
+  switch ( dt ) {
+    case dmBYTE:   DMN_SET_KERNELS( ub, unsigned char );  break;
+    case dmSHORT:  DMN_SET_KERNELS( s,  short );          break;
+    case dmUSHORT: DMN_SET_KERNELS( us, unsigned short ); break;
+    case dmLONG:   DMN_SET_KERNELS( l,  long );           break;
+    case dmULONG:  DMN_SET_KERNELS( ul, unsigned long );  break;
+    case dmFLOAT:  DMN_SET_KERNELS( f,  float );          break;
+    case dmDOUBLE: DMN_SET_KERNELS( d,  double );         break;
+    default:
+      return(-1);
+  }
+  return(0);
+}
@@ -0,0 +1,72 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#ifndef DMN_KERNELS_H
+#define DMN_KERNELS_H
+
+#include <ascdm.h>
+
+/* Pixel kernels, one set per dmDataType.  The kernel is picked once
+ * per image so none of the per-pixel loops have to switch on the
+ * datatype.  The valid[] plane is the dmimgio pixel mask: 0 for pixels
+ * outside the subspace or that are NULL/NaN. */
+
+/* row[ii] = data[first+ii], or 0 if the pixel is not valid */
+typedef void (*dmnLoadRowFunc)( const void *data, long first, long nn,
+                                const short *valid, double *row );
+
+/* Add up nn pixels starting at first, stepping by stride, the same way
+ * (float accumulators, same order) the original get_snr() did.  dvar is
+ * the variance of each pixel, or NULL for Poisson errors: the variance is
+ * then the square of the float sqrt(pixel), as the error image used to
+ * hold, so the sums do not change. */
+typedef void (*dmnSumColFunc)( const void *data, long first, long stride,
+                               long nn, const short *valid, 
+                               const float *dvar, float *val, 
+                               float *noise, long *area );
+
+/* Copy an xlen x ylen image into tiles (see DMN_TILE_IDX) */
+typedef void (*dmnToTilesFunc)( const void *data, long xlen, long ylen,
+                                void *tiles );
+
+typedef struct {
+  dmnLoadRowFunc load_row;
+  dmnSumColFunc sum_col;
+  dmnToTilesFunc to_tiles;
+  size_t size;            /* bytes per pixel */
+} dmnPixelKernels;
+
+/* The tiled layout: DMN_TILE x DMN_TILE tiles in row order, each one
+ * stored a row at a time.  The part of a column of a sub-image that is
+ * in one tile is then a few kB apart rather than the width of the image,
+ * and the columns next to it are in the same cache lines.  The tiles on
+ * the top and right edges are padded out to the full size. */
+#define DMN_TILE_BITS  6
+#define DMN_TILE       (1L<<DMN_TILE_BITS)
+#define DMN_NUM_TILES(nn)  ( ( (nn) + DMN_TILE - 1 ) >> DMN_TILE_BITS )
+#define DMN_TILE_IDX(xx,yy,ntx)                                            \
+  ( ( ( ( ( ((yy)>>DMN_TILE_BITS)*(ntx) + ((xx)>>DMN_TILE_BITS) )          \
+          << DMN_TILE_BITS ) + ((yy)&(DMN_TILE-1)) ) << DMN_TILE_BITS ) +  \
+    ((xx)&(DMN_TILE-1)) )
+
+/* Returns 0 and fills in kern, or -1 if there is no kernel for dt */
+int get_pixel_kernels( dmDataType dt, dmnPixelKernels *kern );
+
+#endif
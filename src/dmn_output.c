@@ -0,0 +1,894 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <histlib.h>
+#include <fitsio.h>
+
+#include "dmn_private.h"
+
+
+/* The output products: the images, the regions of the mask file, and
+ * the table of bins, which is also read back w/ inbinfile. */
+
+
+/* ------Prototypes ----------------------- */
+
+static short get_linear_coords( dmnautilusContext *ctx, double *coef );
+static int write_regions( dmDataset *ds, abinCorners *corners );
+static void *run_writer( void *arg );
+static int write_output( dmBlock *inBlock, const char *outfile, dmDataType dt, void *vals, long *lAxes, const char *unit, abinCorners *corners, short clobber );
+static int compress_output( const char *outfile, abinProduct product, dmnautilusCompress compress );
+static int convert_coords( dmDescriptor *xdesc, dmDescriptor *ydesc, double xx, double yy, double *xat, double *yat);
+
+
+/* ----------------------------- */
+
+
+static int convert_coords( dmDescriptor *xdesc,
+                    dmDescriptor *ydesc,
+                    double xx,  /*Note: Using double rather than long here! */
+                    double yy, /* */
+                    double *xat,
+                    double *yat
+                    )
+{
+  if ( xdesc ) {
+    double lgc[2];
+    double phy[2];
+    lgc[0] = xx+1;
+    lgc[1] = yy+1;
+    dmCoordCalc_d( xdesc, lgc, phy );
+    if ( ydesc ) {
+      dmCoordCalc_d( ydesc, lgc+1, phy+1 );
+    }
+    *xat = phy[0];
+    *yat = phy[1];
+  } else {
+    *xat = xx;
+    *yat = yy;
+  }
+  return(0);
+}
+
+
+/* Store the values of the current output (ctx->product) for all the
+ * leaves in one task */
+void run_fill_task( dmnautilusContext *ctx, abinTask *task )
+{
+  long nn;
+
+  for (nn=0; nn<task->leaves.nleaves; nn++ ) {
+    abinLeaf *leaf = &(task->leaves.leaf[nn]);
+    long xe, ye;
+    long ii,jj;
+    long nvalid;
+    short mixed;
+
+    /* shouldn't be needed anymore */
+    xe = ( (leaf->xs+leaf->xl) > ctx->xlen ) ? ctx->xlen : leaf->xs+leaf->xl;
+    ye = ( (leaf->ys+leaf->yl) > ctx->ylen ) ? ctx->ylen : leaf->ys+leaf->yl;
+
+    /* Only a leaf w/ both valid and invalid pixels needs the mask; the
+     * rest (eg all of an empty corner) are filled w/ one value */
+    nvalid = count_valid( ctx, leaf->xs, leaf->ys, xe, ye );
+    mixed = ( nvalid != 0 ) && ( nvalid != (xe-leaf->xs)*(ye-leaf->ys) );
+
+    if ( OUT_MASK == ctx->product ) {
+      unsigned long mask_no = task->first_mask_no + nn;
+      unsigned long fill = ( nvalid > 0 ) ? mask_no : 0;
+
+#define FILL_MASK( TYPE )                                                   \
+      {                                                                     \
+        TYPE *mask = (TYPE*)ctx->plane;                                     \
+        for (jj=leaf->ys; jj<ye; jj++) {                                    \
+          long row = jj*ctx->xlen;                                          \
+          if ( mixed ) {                                                    \
+            for (ii=leaf->xs; ii<xe; ii++ ) {                               \
+              mask[ii+row] = ctx->pixmask[ii+row] ? mask_no : 0;            \
+            }                                                               \
+          } else {                                                          \
+            for (ii=leaf->xs; ii<xe; ii++ ) {                               \
+              mask[ii+row] = fill;                                          \
+            }                                                               \
+          }                                                                 \
+        }                                                                   \
+      }
+
+      switch ( ctx->mask_type ) {
+        case dmBYTE:   FILL_MASK( unsigned char );  break;
+        case dmUSHORT: FILL_MASK( unsigned short ); break;
+        default:       FILL_MASK( unsigned long );  break;
+      }
+#undef FILL_MASK
+
+    } else {
+      float *out = (float*)ctx->plane;
+      float val, fill;
+
+      switch ( ctx->product ) {
+        case OUT_AREA: val = leaf->area; break;
+        case OUT_SNR: val = leaf->snr; break;
+        default: 
+          if ( ctx->nbands > 1 ) {
+            val = task->leaves.bandsum[nn*ctx->nbands+ctx->fill_band] / leaf->area;
+          } else {
+            val = leaf->val;
+          }
+          break;
+      }
+
+      fill = ( nvalid > 0 ) ? val : NAN;
+      for (jj=leaf->ys; jj<ye; jj++) {
+        long row = jj*ctx->xlen;
+        if ( mixed ) {
+          for (ii=leaf->xs; ii<xe; ii++ ) {
+            out[ii+row] = ctx->pixmask[ii+row] ? val : NAN;
+          } // end for ii
+        } else {
+          for (ii=leaf->xs; ii<xe; ii++ ) {
+            out[ii+row] = fill;
+          }
+        }
+      } // end for jj
+    }
+  } // end for nn
+}
+
+
+/* How far the linear transform may be from the WCS library at the
+ * probe points, in pixels.  The two round differently, so asking for
+ * the same bits would almost never use it.  The corners are doubles but
+ * regions are printed and used to a few decimal places of a pixel at
+ * most, so 1e-9 pixel does not change any region that is looked at. */
+#define ABIN_LINEAR_TOL  1.0e-9
+
+
+/* The physical coordinates are (almost always) a linear function of
+ * the image pixel.  Find the transform from three points; it is only
+ * used if it is within ABIN_LINEAR_TOL of what the WCS library gives at
+ * the corners and middle of the image.  Returns 1 if it can be used. */
+static short get_linear_coords( dmnautilusContext *ctx, double *coef )
+{
+  double probe[5][2] = { { -0.5, -0.5 }, 
+                         { ctx->xlen-0.5, -0.5 }, 
+                         { -0.5, ctx->ylen-0.5 },
+                         { ctx->xlen-0.5, ctx->ylen-0.5 },
+                         { (ctx->xlen/2)-0.5, (ctx->ylen/3)-0.5 } };
+  double xx[3], yy[3];
+  double xtol, ytol;
+  short ii;
+
+  convert_coords( ctx->xdesc, ctx->ydesc, 0, 0, xx+0, yy+0 );
+  convert_coords( ctx->xdesc, ctx->ydesc, 1, 0, xx+1, yy+1 );
+  convert_coords( ctx->xdesc, ctx->ydesc, 0, 1, xx+2, yy+2 );
+  coef[0] = xx[0];
+  coef[1] = xx[1]-xx[0];
+  coef[2] = xx[2]-xx[0];
+  coef[3] = yy[0];
+  coef[4] = yy[1]-yy[0];
+  coef[5] = yy[2]-yy[0];
+
+  /* Physical units per pixel */
+  xtol = ABIN_LINEAR_TOL * ( fabs(coef[1]) + fabs(coef[2]) );
+  ytol = ABIN_LINEAR_TOL * ( fabs(coef[4]) + fabs(coef[5]) );
+
+  for (ii=0; ii<5; ii++ ) {
+    double px, py;
+    convert_coords( ctx->xdesc, ctx->ydesc, probe[ii][0], probe[ii][1], &px, &py );
+    if ( !( fabs( px - ( coef[0] + coef[1]*probe[ii][0] + coef[2]*probe[ii][1] )) <= xtol ) ||
+         !( fabs( py - ( coef[3] + coef[4]*probe[ii][0] + coef[5]*probe[ii][1] )) <= ytol ) ) {
+      return(0);
+    }
+  }
+  return(1);
+}
+
+
+/* Compute the corners of all the leaves in one pass; only goes through
+ * the WCS library per corner if the transform is not linear. */
+int make_corners( dmnautilusContext *ctx, abinTaskList *tasks, abinCorners *corners )
+{
+  double coef[6];
+  short linear;
+  long ii, nn, kk;
+
+  memset( corners, 0, sizeof(abinCorners));
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    corners->nleaves += tasks->task[ii].leaves.nleaves;
+  }
+  corners->xx = (double*)malloc( (2*corners->nleaves+1)*sizeof(double));
+  corners->yy = (double*)malloc( (2*corners->nleaves+1)*sizeof(double));
+  if ( ( NULL == corners->xx ) || ( NULL == corners->yy ) ) {
+    free_corners( corners );
+    err_msg("ERROR: Could not allocate memory for regions\n");
+    return(-1);
+  }
+
+  pthread_mutex_lock( &dm_lock );
+  linear = get_linear_coords( ctx, coef );
+  if ( linear ) {
+    pthread_mutex_unlock( &dm_lock );
+  }
+
+  kk = 0;
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    for (nn=0; nn<tasks->task[ii].leaves.nleaves; nn++) {
+      abinLeaf *leaf = &(tasks->task[ii].leaves.leaf[nn]);
+
+      /*   
+       * The original hacky way to use the Cdelt[]'s doesn't work. There are 
+       * cases where the regions overlap which is bad.
+       * 
+       * So instead of using a box, we use a rectangle since the
+       * edge points are explicitly specified.
+       * 
+      */
+
+      /* Need the minus 0.5 since pixels are assumed to be cenetered on integer values */
+      double xa = leaf->xs-0.5;
+      double ya = leaf->ys-0.5;
+      double xb = leaf->xs+leaf->xl-0.5;
+      double yb = leaf->ys+leaf->yl-0.5;
+
+      if ( linear ) {
+        corners->xx[kk] = coef[0] + coef[1]*xa + coef[2]*ya;
+        corners->yy[kk] = coef[3] + coef[4]*xa + coef[5]*ya;
+        corners->xx[kk+1] = coef[0] + coef[1]*xb + coef[2]*yb;
+        corners->yy[kk+1] = coef[3] + coef[4]*xb + coef[5]*yb;
+      } else {
+        convert_coords( ctx->xdesc,ctx->ydesc, xa, ya, corners->xx+kk, corners->yy+kk );
+        convert_coords( ctx->xdesc,ctx->ydesc, xb, yb, corners->xx+kk+1, corners->yy+kk+1 );
+      }
+      kk += 2;
+    }
+  }
+
+  if ( !linear ) {
+    pthread_mutex_unlock( &dm_lock );
+  }
+  return(0);
+}
+
+
+void free_corners( abinCorners *corners )
+{
+  if ( corners->xx ) free( corners->xx );
+  if ( corners->yy ) free( corners->yy );
+  memset( corners, 0, sizeof(abinCorners));
+}
+
+
+/* Write one output image; runs in its own thread */
+static void *run_writer( void *arg )
+{
+  abinWriter *writer = (abinWriter*)arg;
+
+  pthread_mutex_lock( &dm_lock );
+  writer->status = write_output( writer->inBlock, writer->outfile, writer->dt,
+                                 writer->vals, writer->lAxes, writer->unit,
+                                 (abinCorners*)writer->corners, writer->clobber );
+  if ( ( 0 == writer->status ) && ( COMPRESS_NONE != writer->compress ) ) {
+    writer->status = compress_output( writer->outfile, writer->product, 
+                                      writer->compress );
+  }
+  pthread_mutex_unlock( &dm_lock );
+  return(NULL);
+}
+
+
+/* Wait for the output being written, if any; returns its status */
+int finish_output( dmnautilusContext *ctx )
+{
+  int status;
+
+  if ( ctx->writer.running ) {
+    pthread_join( ctx->writer.thread, NULL );
+    ctx->writer.running = 0;
+  }
+  status = ctx->writer.status;
+  ctx->writer.status = 0;
+  return(status);
+}
+
+
+/* Fill a plane with one output image from the leaves and start writing
+ * it.  The write goes on in the background while the next image is
+ * filled into the other plane, so at most two output images are ever
+ * held in memory.  finish_output() must be called before the input 
+ * block is closed. */
+int make_output( dmnautilusContext *ctx, abinTaskList *tasks, short nthreads,
+                 abinProduct product, dmBlock *inBlock, const char *outfile,
+                 const char *unit, abinCorners *corners, short clobber )
+{
+  long npix = ctx->xlen*ctx->ylen;
+  long nbytes;
+  short pp = ctx->next_plane;
+  abinWriter *writer = &(ctx->writer);
+  dmDataType dt;
+
+  if ( OUT_MASK == product ) {
+    /* The mask numbers go up to the number of leaves */
+    unsigned long nleaves = 0;
+    long ii;
+    for (ii=0; ii<tasks->ntasks; ii++ ) {
+      nleaves += tasks->task[ii].leaves.nleaves;
+    }
+    if ( MASK_ULONG == ctx->masktype ) {
+      nbytes = npix*sizeof(unsigned long);
+      dt = dmULONG;
+    } else if ( nleaves <= UCHAR_MAX ) {
+      nbytes = npix*sizeof(unsigned char);
+      dt = dmBYTE;
+    } else if ( nleaves <= USHRT_MAX ) {
+      nbytes = npix*sizeof(unsigned short);
+      dt = dmUSHORT;
+    } else {
+      nbytes = npix*sizeof(unsigned long);
+      dt = dmULONG;
+    }
+    ctx->mask_type = dt;
+  } else {
+    nbytes = npix*sizeof(float);
+    dt = dmFLOAT;
+  }
+
+  if ( 0 != get_buffer( ctx, &(ctx->planes[pp]), nbytes ) ) {
+    err_msg("ERROR: Could not allocate memory for output image\n");
+    return(-1);
+  }
+
+  ctx->plane = ctx->planes[pp].ptr;
+  ctx->product = product;
+  run_tasks( ctx, tasks, run_fill_task, nthreads );
+
+  /* One write at a time: the DM library is not thread safe */
+  if ( 0 != finish_output( ctx ) ) {
+    return(-1);
+  }
+
+  writer->inBlock = inBlock;
+  writer->outfile = outfile;
+  writer->dt = dt;
+  writer->vals = ctx->plane;
+  writer->lAxes = ctx->lAxes;
+  writer->unit = unit;
+  writer->corners = corners;
+  writer->clobber = clobber;
+  writer->product = product;
+  writer->compress = ctx->compress;
+  writer->status = 0;
+  if ( 0 != pthread_create( &(writer->thread), NULL, run_writer, writer ) ) {
+    run_writer( writer );   /* Just write it here */
+    return( finish_output( ctx ) );
+  }
+  writer->running = 1;
+  ctx->next_plane = 1 - pp;
+
+  return(0);
+}
+
+
+/* Is an optional file name set? */
+short want_output( const char *name )
+{
+  return ( name && (strlen(name)>0) && (ds_strcmp_cis(name,"none")!=0) );
+}
+
+
+/* Write one output image; copies the header and WCS from the input. */
+static int write_output( dmBlock *inBlock, const char *outfile, dmDataType dt, 
+                  void *vals, long *lAxes, const char *unit, 
+                  abinCorners *corners, short clobber )
+{
+  dmBlock *outBlock;
+  dmDescriptor *outDes;
+  long npix = lAxes[0]*lAxes[1];
+
+  if ( ds_clobber( (char*)outfile, clobber, NULL) != 0 ) {
+    return(-1);
+  }
+
+  outBlock = dmImageCreate(outfile, dt, lAxes, 2 );
+  if ( outBlock == NULL ) {
+    err_msg("ERROR: Could not create output '%s'\n", outfile);
+    return(-1);
+  }
+  outDes = dmImageGetDataDescriptor( outBlock );
+  dmBlockCopy( inBlock, outBlock, "HEADER"); 
+  ds_copy_full_header( inBlock, outBlock, "dmnautilus", 0 );
+  put_param_hist_info( outBlock, "dmnautilus", NULL, 0 );
+  if ( unit ) {
+    dmSetUnit( outDes, unit );
+  }
+  dmBlockCopyWCS( inBlock, outBlock);
+
+  switch ( dt ) {
+    case dmBYTE:   dmSetArray_ub( outDes, (unsigned char*)vals, npix ); break;
+    case dmUSHORT: dmSetArray_us( outDes, (unsigned short*)vals, npix ); break;
+    case dmULONG:  dmSetArray_ul( outDes, (unsigned long*)vals, npix ); break;
+    default:       dmSetArray_f( outDes, (float*)vals, npix ); break;
+  }
+
+  if ( corners && ( 0 != write_regions( dmBlockGetDataset( outBlock ), corners ))) {
+    dmImageClose( outBlock );
+    return(-1);
+  }
+
+  dmImageClose( outBlock );
+  return(0);
+}
+
+
+/* Rewrite an output image as a tile-compressed FITS image; the blocks
+ * after it (the regions of the mask) are copied as they are.  The DM
+ * library cannot write compressed images, so this goes through cfitsio
+ * once the file is closed.  The mask is integer and the area is a 
+ * pixel count, so both are always lossless; with rice the other float
+ * images are quantized (w/ dithering that keeps zeros exact). */
+static int compress_output( const char *outfile, abinProduct product, 
+                            dmnautilusCompress compress )
+{
+  fitsfile *infptr = NULL;
+  fitsfile *outfptr = NULL;
+  char *tmpname;
+  int status = 0;
+  int close_status = 0;
+  int nhdu = 0;
+  int hdutype;
+  int ii;
+
+  tmpname = (char*)malloc( strlen(outfile)+8 );
+  if ( NULL == tmpname ) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+  sprintf( tmpname, "!%s.tmp", outfile );  /* ! to overwrite */
+
+  fits_open_file( &infptr, outfile, READONLY, &status );
+  fits_create_file( &outfptr, tmpname, &status );
+  if ( ( COMPRESS_RICE == compress ) && ( OUT_AREA != product ) ) {
+    fits_set_compression_type( outfptr, RICE_1, &status );
+    if ( OUT_MASK != product ) {
+      fits_set_quantize_level( outfptr, 16.0, &status );
+      fits_set_quantize_method( outfptr, SUBTRACTIVE_DITHER_2, &status );
+    }
+  } else {
+    fits_set_compression_type( outfptr, GZIP_2, &status );
+    fits_set_quantize_level( outfptr, 0.0, &status );  /* lossless */
+  }
+  fits_img_compress( infptr, outfptr, &status );
+
+  fits_get_num_hdus( infptr, &nhdu, &status );
+  for (ii=2; ( 0 == status ) && ( ii<=nhdu ); ii++ ) {
+    fits_movabs_hdu( infptr, ii, &hdutype, &status );
+    fits_copy_hdu( infptr, outfptr, 0, &status );
+  }
+
+  if ( outfptr ) fits_close_file( outfptr, &close_status );
+  if ( 0 == status ) status = close_status;
+  close_status = 0;
+  if ( infptr ) fits_close_file( infptr, &close_status );
+
+  if ( ( 0 == status ) && ( 0 != rename( tmpname+1, outfile ) ) ) {
+    err_msg("ERROR: Could not replace '%s' with the compressed image\n", outfile );
+    unlink( tmpname+1 );
+    free( tmpname );
+    return(-1);
+  }
+  if ( 0 != status ) {
+    char msg[FLEN_STATUS];
+    fits_get_errstatus( status, msg );
+    err_msg("ERROR: Could not compress '%s': %s\n", outfile, msg );
+    unlink( tmpname+1 );
+    free( tmpname );
+    return(-1);
+  }
+  free( tmpname );
+  return(0);
+}
+
+
+/* Write a rectangle for each leaf to the REGION extension.  This is the
+ * table dmTableWriteRegion() writes (the same columns, units, keywords,
+ * and unused values as in the mask files saved for the regression
+ * tests), but made directly from the corners w/o building a regRegion
+ * first: appending a shape to a regRegion walks the list of shapes,
+ * which made writing the regions quadratic in the number of leaves.
+ * COMPONENT is a short, as there, unless there are too many leaves.
+ *
+ * The columns are written ABIN_REG_CHUNK rows at a time; the corners
+ * are already in row order so POS is written straight from them.  If
+ * any column or row cannot be written the output fails. */
+#define ABIN_REG_CHUNK  4096
+
+
+static int write_regions( dmDataset *ds, abinCorners *corners )
+{
+  dmBlock *regBlock;
+  dmDescriptor *pos, *xcpt=NULL, *ycpt=NULL, *shape, *rcol, *acol, *comp;
+  char *pos_names[2] = { "X", "Y" };
+  short short_comp = ( corners->nleaves <= SHRT_MAX );
+  long nchunk = ( corners->nleaves < ABIN_REG_CHUNK ) ? corners->nleaves : ABIN_REG_CHUNK;
+  double *radius = NULL;
+  double *angle = NULL;
+  char **shapes = NULL;
+  short *scomp = NULL;
+  long *lcomp = NULL;
+  long first, nn;
+  int retval = 0;
+
+  regBlock = dmDatasetCreateTable( ds, "REGION" );
+  if ( NULL == regBlock ) {
+    err_msg("ERROR: Could not create REGION extension\n");
+    return(-1);
+  }
+
+  pos = dmColumnCreateVectorArray( regBlock, "POS", dmDOUBLE, 0, "pixel",
+                                   "Position", pos_names, 2, 2 );
+  if ( pos ) {
+    xcpt = dmGetCpt( pos, 1 );
+    ycpt = dmGetCpt( pos, 2 );
+  }
+  shape = dmColumnCreate( regBlock, "SHAPE", dmTEXT, 16, "", "Region shape type" );
+  rcol = dmColumnCreateArray( regBlock, "R", dmDOUBLE, 0, "pixel", "Radius", 2 );
+  acol = dmColumnCreateArray( regBlock, "ROTANG", dmDOUBLE, 0, "deg", "Angle", 2 );
+  comp = dmColumnCreate( regBlock, "COMPONENT", short_comp ? dmSHORT : dmLONG, 0,
+                         NULL, "Component number" );
+
+  if ( ( NULL == xcpt ) || ( NULL == ycpt ) || ( NULL == shape ) || 
+       ( NULL == rcol ) || ( NULL == acol ) || ( NULL == comp ) ||
+       ( NULL == dmKeyWrite_c( regBlock, "HDUCLASS", "ASC", NULL, "Region extension" )) ||
+       ( NULL == dmKeyWrite_c( regBlock, "HDUCLAS1", "REGION", NULL, "Region extension" )) ||
+       ( NULL == dmKeyWrite_c( regBlock, "HDUCLAS2", "STANDARD", NULL, "Region extension" )) ||
+       ( NULL == dmKeyWrite_c( regBlock, "CONTENT", "REGION", NULL, "CXC Content key" )) ) {
+    err_msg("ERROR: Could not create REGION extension\n");
+    dmTableClose( regBlock );
+    return(-1);
+  }
+
+  /* The same for every row but COMPONENT */
+  radius = (double*)malloc( 2*(nchunk+1)*sizeof(double));
+  angle = (double*)malloc( 2*(nchunk+1)*sizeof(double));
+  shapes = (char**)malloc( (nchunk+1)*sizeof(char*));
+  if ( short_comp ) {
+    scomp = (short*)malloc( (nchunk+1)*sizeof(short));
+  } else {
+    lcomp = (long*)malloc( (nchunk+1)*sizeof(long));
+  }
+  if ( ( NULL == radius ) || ( NULL == angle ) || ( NULL == shapes ) ||
+       ( ( NULL == scomp ) && ( NULL == lcomp ) ) ) {
+    err_msg("ERROR: Could not allocate memory for regions\n");
+    retval = -1;
+  } else {
+    for (nn=0; nn<nchunk; nn++ ) {
+      radius[2*nn] = radius[2*nn+1] = angle[2*nn+1] = NAN;
+      angle[2*nn] = 0;
+      shapes[nn] = "Rectangle";
+    }
+  }
+
+  for (first=0; ( 0 == retval ) && ( first<corners->nleaves ); first+=nchunk ) {
+    long nrows = ( first+nchunk > corners->nleaves ) ? corners->nleaves-first : nchunk;
+    long row = first+1;   /* 1-based */
+    long ncomp;
+
+    for (nn=0; nn<nrows; nn++ ) {
+      if ( short_comp ) {
+        scomp[nn] = (short)(first+nn+1);
+      } else {
+        lcomp[nn] = first+nn+1;
+      }
+    }
+    ncomp = short_comp ? dmSetScalars_s( comp, scomp, row, nrows ) :
+                         dmSetScalars_l( comp, lcomp, row, nrows );
+    if ( ( nrows != dmSetArrays_d( xcpt, corners->xx+2*first, row, nrows, 2 )) ||
+         ( nrows != dmSetArrays_d( ycpt, corners->yy+2*first, row, nrows, 2 )) ||
+         ( nrows != dmSetScalars_c( shape, shapes, row, nrows )) ||
+         ( nrows != dmSetArrays_d( rcol, radius, row, nrows, 2 )) ||
+         ( nrows != dmSetArrays_d( acol, angle, row, nrows, 2 )) ||
+         ( nrows != ncomp ) ) {
+      err_msg("ERROR: Could not write rows %ld-%ld of the regions\n", row, row+nrows-1 );
+      retval = -1;
+    }
+  }
+
+  dmTableClose( regBlock );
+  if ( radius ) free( radius );
+  if ( angle ) free( angle );
+  if ( shapes ) free( shapes );
+  if ( scomp ) free( scomp );
+  if ( lcomp ) free( lcomp );
+  return(retval);
+}
+
+
+/* The columns of the table of bins.  XS, YS are the (1-based) image
+ * pixel of the lower-left corner; X_LL .. Y_UR are the physical 
+ * coordinates of the lower-left and upper-right corners, same as the
+ * regions in the mask file. */
+static const char *bin_columns[] = { "MASK_NO", "XS", "YS", "XL", "YL", 
+   "SUM", "AREA", "SNR", "X_LL", "Y_LL", "X_UR", "Y_UR" };
+#define NUM_BIN_COLUMNS  (sizeof(bin_columns)/sizeof(bin_columns[0]))
+#define NUM_BIN_INPUT    8   /* columns needed to expand the table */
+
+
+/* Write one row per leaf, in mask number order.  For the hierarchy of
+ * an SNR sweep range has the lowest and highest snr each row is a bin
+ * for (see abinHierNode), and the SNR keyword is the lowest of all.
+ * EXACTSUM is whether the summed-area tables were exact (it is only
+ * checked when the table is written or binning is incremental). */
+int write_bin_table( dmnautilusContext *ctx, dmBlock *inBlock, abinTaskList *tasks, 
+                     abinCorners *corners, const char *binfile, const char *unit, 
+                     const float *range, short clobber )
+{
+  dmBlock *outBlock;
+  dmDescriptor *cols[NUM_BIN_COLUMNS];
+  dmDescriptor *bandcol = NULL;
+  dmDescriptor *locol = NULL;
+  dmDescriptor *hicol = NULL;
+  double snr;
+  long method;
+  long exact;
+  long ii, nn, kk;
+
+  pthread_mutex_lock( &dm_lock );
+
+  if ( ds_clobber( (char*)binfile, clobber, NULL) != 0 ) {
+    pthread_mutex_unlock( &dm_lock );
+    return(-1);
+  }
+
+  outBlock = dmTableCreate( binfile );
+  if ( outBlock == NULL ) {
+    pthread_mutex_unlock( &dm_lock );
+    err_msg("ERROR: Could not create output '%s'\n", binfile);
+    return(-1);
+  }
+  dmBlockCopy( inBlock, outBlock, "HEADER"); 
+  ds_copy_full_header( inBlock, outBlock, "dmnautilus", 0 );
+  put_param_hist_info( outBlock, "dmnautilus", NULL, 0 );
+  dmKeyWrite_l( outBlock, "XLEN", &(ctx->xlen), "pixels", "Length of image x-axis" );
+  dmKeyWrite_l( outBlock, "YLEN", &(ctx->ylen), "pixels", "Length of image y-axis" );
+  snr = ctx->snr_thresh;
+  method = ctx->criteria;
+  dmKeyWrite_d( outBlock, "SNR", &snr, NULL, "SNR threshold" );
+  dmKeyWrite_l( outBlock, "METHOD", &method, NULL, "Sub-images required above threshold" );
+  exact = ctx->exact_sums;
+  dmKeyWrite_l( outBlock, "EXACTSUM", &exact, NULL, "Summed-area tables were exact" );
+
+  cols[0] = dmColumnCreate( outBlock, bin_columns[0], dmLONG, 0, NULL, "Mask (group) number" );
+  cols[1] = dmColumnCreate( outBlock, bin_columns[1], dmLONG, 0, "pixel", "Start of x-axis" );
+  cols[2] = dmColumnCreate( outBlock, bin_columns[2], dmLONG, 0, "pixel", "Start of y-axis" );
+  cols[3] = dmColumnCreate( outBlock, bin_columns[3], dmLONG, 0, "pixel", "Length of x-axis" );
+  cols[4] = dmColumnCreate( outBlock, bin_columns[4], dmLONG, 0, "pixel", "Length of y-axis" );
+  cols[5] = dmColumnCreate( outBlock, bin_columns[5], dmFLOAT, 0, ( unit && *unit ) ? unit : NULL, "Sum of pixel values" );
+  cols[6] = dmColumnCreate( outBlock, bin_columns[6], dmLONG, 0, "pixels", "Number of valid pixels" );
+  cols[7] = dmColumnCreate( outBlock, bin_columns[7], dmFLOAT, 0, NULL, "Signal to noise ratio" );
+  cols[8] = dmColumnCreate( outBlock, bin_columns[8], dmDOUBLE, 0, NULL, "Lower-left x (physical)" );
+  cols[9] = dmColumnCreate( outBlock, bin_columns[9], dmDOUBLE, 0, NULL, "Lower-left y (physical)" );
+  cols[10] = dmColumnCreate( outBlock, bin_columns[10], dmDOUBLE, 0, NULL, "Upper-right x (physical)" );
+  cols[11] = dmColumnCreate( outBlock, bin_columns[11], dmDOUBLE, 0, NULL, "Upper-right y (physical)" );
+  if ( ctx->nbands > 1 ) {
+    bandcol = dmColumnCreateArray( outBlock, "BAND_SUM", dmFLOAT, 0, 
+                                   ( unit && *unit ) ? unit : NULL, 
+                                   "Sum of pixel values in each band", ctx->nbands );
+  }
+  if ( range ) {
+    locol = dmColumnCreate( outBlock, "SNR_LO", dmFLOAT, 0, NULL, "Bin for snr from" );
+    hicol = dmColumnCreate( outBlock, "SNR_HI", dmFLOAT, 0, NULL, "Bin for snr below" );
+  }
+
+  kk = 0;
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    for (nn=0; nn<tasks->task[ii].leaves.nleaves; nn++) {
+      abinLeaf *leaf = &(tasks->task[ii].leaves.leaf[nn]);
+
+      dmSetScalar_l( cols[0], tasks->task[ii].first_mask_no + nn );
+      dmSetScalar_l( cols[1], leaf->xs+1 );
+      dmSetScalar_l( cols[2], leaf->ys+1 );
+      dmSetScalar_l( cols[3], leaf->xl );
+      dmSetScalar_l( cols[4], leaf->yl );
+      dmSetScalar_f( cols[5], leaf->sum );
+      dmSetScalar_l( cols[6], leaf->area );
+      dmSetScalar_f( cols[7], leaf->snr );
+      dmSetScalar_d( cols[8], corners->xx[kk] );
+      dmSetScalar_d( cols[9], corners->yy[kk] );
+      dmSetScalar_d( cols[10], corners->xx[kk+1] );
+      dmSetScalar_d( cols[11], corners->yy[kk+1] );
+      if ( bandcol ) {
+        dmSetArray_f( bandcol, tasks->task[ii].leaves.bandsum + nn*ctx->nbands, ctx->nbands );
+      }
+      if ( range ) {
+        dmSetScalar_f( locol, range[kk] );
+        dmSetScalar_f( hicol, range[kk+1] );
+      }
+      dmTableNextRow( outBlock );
+      kk += 2;
+    }
+  }
+
+  dmTableClose( outBlock );
+  pthread_mutex_unlock( &dm_lock );
+  return(0);
+}
+
+
+/* Read the leaves back from a table of bins.  The output values are
+ * computed the same way as add_leaf() does so expanding the table gives
+ * the same images as binning did.  If params is given the table must
+ * have been made with the same snr and method.  A hierarchy from an 
+ * SNR sweep holds the bins for a range of snr; only the rows for this
+ * snr (params, or the context's threshold) are kept.  The SUM of a 
+ * table made from several bands (joint) is the sum of all of them, so 
+ * expanding it for one band sums that band's pixels in each bin again;
+ * the bins and their (joint) SNR are the table's.  exact, if not NULL,
+ * is set if the run that made the table had exact summed-area tables. */
+int read_bin_table( dmnautilusContext *ctx, const char *binfile, short nthreads,
+                    const dmnautilusParams *params, abinTaskList *tasks,
+                    short *exact )
+{
+  dmBlock *tab;
+  dmDescriptor *cols[NUM_BIN_INPUT];
+  dmDescriptor *locol, *hicol;
+  dmDescriptor *bandcol;
+  long xlen, ylen;
+  double snr;
+  long method;
+  long exactsum;
+  float thresh;
+  long nrows, nper, ntasks, nn, ii;
+  long nkept = 0;
+  int retval = 0;
+
+  memset( tasks, 0, sizeof(abinTaskList));
+
+  pthread_mutex_lock( &dm_lock );
+  tab = dmTableOpen( binfile );
+  if ( NULL == tab ) {
+    pthread_mutex_unlock( &dm_lock );
+    err_msg("ERROR: Could not open table of bins '%s'\n", binfile );
+    return(-1);
+  }
+
+  if ( ( NULL == dmKeyRead_l( tab, "XLEN", &xlen ) ) ||
+       ( NULL == dmKeyRead_l( tab, "YLEN", &ylen ) ) ||
+       ( xlen != ctx->xlen ) || ( ylen != ctx->ylen ) ) {
+    err_msg("ERROR: Table of bins '%s' was not made from an image the size of infile\n", binfile );
+    retval = -1;
+  }
+  locol = dmTableOpenColumn( tab, "SNR_LO" );
+  hicol = dmTableOpenColumn( tab, "SNR_HI" );
+  if ( ( NULL == locol ) || ( NULL == hicol ) ) {
+    locol = hicol = NULL;
+  }
+  if ( exact ) {
+    /* Tables from before the keyword was written are not trusted */
+    *exact = ( NULL != dmKeyRead_l( tab, "EXACTSUM", &exactsum ) ) && ( 0 != exactsum );
+  }
+  bandcol = dmTableOpenColumn( tab, "BAND_SUM" );
+  if ( ( 0 == retval ) && bandcol && params ) {
+    err_msg("ERROR: Table of bins '%s' was made from several bands\n", binfile );
+    retval = -1;
+  }
+  thresh = params ? params->snr : ctx->snr_thresh;
+  if ( ( 0 == retval ) && params && !locol &&
+       ( ( NULL == dmKeyRead_d( tab, "SNR", &snr ) ) ||
+         ( NULL == dmKeyRead_l( tab, "METHOD", &method ) ) ||
+         ( (float)snr != thresh ) || ( method != (long)params->method ) ) ) {
+    err_msg("ERROR: Table of bins '%s' was not made with the same snr and method\n", binfile );
+    retval = -1;
+  }
+  if ( ( 0 == retval ) && locol &&
+       ( ( NULL == dmKeyRead_d( tab, "SNR", &snr ) ) ||
+         ( NULL == dmKeyRead_l( tab, "METHOD", &method ) ) ||
+         ( thresh < (float)snr ) ||
+         ( method != (long)( params ? params->method : ctx->criteria ) ) ) ) {
+    err_msg("ERROR: Hierarchy '%s' is only for method=%ld and snr>=%g\n", binfile, 
+            method, snr );
+    retval = -1;
+  }
+
+  for (ii=0; ( 0 == retval ) && ( ii<NUM_BIN_INPUT ); ii++ ) {
+    cols[ii] = dmTableOpenColumn( tab, bin_columns[ii] );
+    if ( NULL == cols[ii] ) {
+      err_msg("ERROR: Could not find column '%s' in '%s'\n", bin_columns[ii], binfile );
+      retval = -1;
+    }
+  }
+
+  nrows = ( 0 == retval ) ? dmTableGetNoRows( tab ) : 0;
+  ntasks = ( nthreads > 1 ) ? 16*nthreads : 1;
+  if ( ntasks > nrows ) {
+    ntasks = ( nrows > 0 ) ? nrows : 1;
+  }
+  nper = ( nrows + ntasks - 1 ) / ntasks;
+
+  if ( 0 == retval ) {
+    tasks->task = (abinTask*)calloc( ntasks, sizeof(abinTask));
+    if ( NULL == tasks->task ) {
+      err_msg("ERROR: Could not allocate memory\n");
+      retval = -1;
+    }
+    tasks->maxtasks = ntasks;
+  }
+
+  for (nn=0; ( 0 == retval ) && ( nn<nrows ); nn++ ) {
+    abinTask *task = &(tasks->task[nkept/nper]);
+    abinLeaf *leaf;
+
+    if ( locol ) {
+      float lo = dmGetScalar_f( locol );
+      float hi = dmGetScalar_f( hicol );
+      if ( ( thresh < lo ) || !( thresh < hi ) ) {
+        dmTableNextRow( tab );
+        continue;
+      }
+    }
+    if ( 0 == task->leaves.nleaves ) {
+      task->first_mask_no = nkept+1;
+      tasks->ntasks = nkept/nper + 1;
+    }
+    nkept++;
+
+    if ( NULL == ( leaf = new_leaf( ctx, &(task->leaves) ))) {
+      err_msg("ERROR: Could not allocate memory\n");
+      retval = -1;
+      break;
+    }
+    leaf->xs = dmGetScalar_l( cols[1] ) - 1;
+    leaf->ys = dmGetScalar_l( cols[2] ) - 1;
+    leaf->xl = dmGetScalar_l( cols[3] );
+    leaf->yl = dmGetScalar_l( cols[4] );
+    leaf->sum = dmGetScalar_f( cols[5] );
+    leaf->area = dmGetScalar_l( cols[6] );
+    leaf->snr = dmGetScalar_f( cols[7] );
+    leaf->level = 0;  /* not known */
+
+    /* Mask numbers come from the row order */
+    if ( dmGetScalar_l( cols[0] ) != (long)(nn+1) ) {
+      err_msg("ERROR: Rows in '%s' must be in %s order\n", binfile, bin_columns[0] );
+      retval = -1;
+    } else if ( ( leaf->xs < 0 ) || ( leaf->ys < 0 ) || 
+                ( leaf->xl < 1 ) || ( leaf->yl < 1 ) ||
+                ( leaf->xs+leaf->xl > ctx->xlen ) || ( leaf->ys+leaf->yl > ctx->ylen ) ) {
+      err_msg("ERROR: Bin %ld in '%s' is outside the image\n", nn+1, binfile );
+      retval = -1;
+    } else if ( bandcol ) {
+      float noise;
+      get_leaf_sums( ctx, &(ctx->count), ctx->band, leaf->xs, leaf->ys, leaf->xl, leaf->yl, 
+                     &(leaf->sum), &noise, &(leaf->area) );
+    }
+    leaf->val = leaf->sum / leaf->area;
+
+    dmTableNextRow( tab );
+  }
+
+  dmTableClose( tab );
+  pthread_mutex_unlock( &dm_lock );
+  return(retval);
+}
@@ -0,0 +1,427 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#ifndef DMN_PRIVATE_H
+#define DMN_PRIVATE_H
+
+#include <pthread.h>
+#include <dslib.h>
+#include <ascdm.h>
+
+/* Using the dmtools/dmimgio routines removes lots of duplicate code that was
+ * originally here.  Also allow us to keep track of NULL/NaN value pixels
+ * more easily
+ */
+#include "dmimgio.h"
+
+#include "dmnautilus.h"
+#include "dmn_kernels.h"
+
+/* The parts of libdmnautilus that its modules share.  Not installed;
+ * the API is dmnautilus.h. */
+
+#define FLOOR(x)  floor((x))
+#define CEIL(x)   ceil((x))
+
+
+/* The DM, region, and WCS libraries are not thread safe; every call
+ * into them holds this lock (see dmnautilus.c) */
+extern pthread_mutex_t dm_lock;
+
+
+/* The output images */
+typedef enum {
+  OUT_VALUE, OUT_AREA, OUT_SNR, OUT_MASK
+} abinProduct;
+
+/* A work buffer that is kept between runs.  It is on the heap unless
+ * the image needs more than the memory limit; then it is a shared map of
+ * an (unlinked) temporary file, so the OS can write its pages out and
+ * drop them rather than needing the memory or swap. */
+typedef struct {
+  void *ptr;
+  size_t nbytes;          /* bytes allocated */
+  short mapped;           /* ptr is a file map */
+} abinBuffer;
+
+/* An output image being written in the background while the next one
+ * is filled in.  There is only ever one: the writes go through dm_lock,
+ * and each copies the header and WCS from inBlock itself. */
+typedef struct {
+  pthread_t thread;
+  short running;          /* thread has been started and not joined */
+  int status;             /* write_output() return value */
+  dmBlock *inBlock;
+  const char *outfile;
+  dmDataType dt;
+  void *vals;
+  long *lAxes;
+  const char *unit;
+  void *corners;          /* abinCorners, for the mask */
+  short clobber;
+  abinProduct product;
+  dmnautilusCompress compress;
+} abinWriter;
+
+
+/* One input image.  Usually there is only one band; several bands of
+ * the same field share the tree, the validity plane, and the outputs
+ * other than the binned image. */
+typedef struct {
+  void  *data;            /* i: data array */
+  dmDataType datatype;
+  float *dvar;            /* i: variance array; NULL for Poisson errors,
+                                  where the variance comes from the data */
+  short var_is_sigma;     /* i: dvar holds the error, not yet squared */
+  abinBuffer varbuf;      /*    dvar */
+
+  /* Pixel kernels for the datatype, and the data they run on.  kdata is
+   * the same as data unless there is no kernel for the datatype, then
+   * the image is converted to double once. */
+  dmnPixelKernels kern;
+  void *kdata;
+  double *dplane;
+  abinBuffer tilebuf[2];  /* layout=tile: kdata and dvar in tiles */
+} abinBand;
+
+/* Summed-area (integral image) tables of the signal and the variance.
+ * They are (xlen+1)*(ylen+1) with a row and column of zeros in front so
+ * that the sum over any rectangle is just four lookups.  Accumulate in
+ * double so that large images do not lose precision.  There is one set
+ * for all the bands summed, or one per band when they are tested 
+ * separately. */
+typedef struct {
+  double *sumval;
+  double *sumvar;
+  abinBuffer buf[2];
+} abinSat;
+
+
+/* Work done, for the stats: get_snr() calls and pixel values read.  A
+ * task is only ever run by one thread at a time, so each task counts
+ * into its own and the serial parts into the context's; they are added
+ * up once the tasks are done. */
+typedef struct {
+  long snr_calls;
+  long pixels;
+} abinCount;
+
+
+/* All the data used by the recursion.  This used to be a pile of
+ * Global* variables; keeping it in one struct lets several images be
+ * binned in the same process.  A pointer is passed down the recursion
+ * rather than the data itself so the stack stays small.
+ *
+ * The work buffers (error image, summed-area tables, and output plane)
+ * are kept between runs and are only re-allocated when an image needs
+ * more pixels than the last one did. */
+struct dmnautilusContext {
+  abinBand *band;         /* i: the images being binned */
+  short nbands;
+  short maxbands;         /*    allocated; kept between runs */
+  dmnautilusJoint joint;
+
+  /* Work buffers are file maps in tmpdir when they would need more
+   * than memlimit.  Only they are; the input is always read whole */
+  short map_buffers;
+  const char *tmpdir;
+
+  /* The outputs are made one at a time from the list of leaves; only
+   * the ones asked for are made at all.  There are two planes so the
+   * next output can be filled in while the last one is being written. */
+  abinProduct product;    /* o: which output is in the plane */
+  void *plane;            /* o: float, or the mask in mask_type */
+  dmDataType mask_type;   /*    data type of the mask plane */
+  dmnautilusMaskType masktype;  /* o: ulong, or the smallest type for the last mask_no */
+  dmnautilusCompress compress;  /* o: tile compression of the images */
+  abinBuffer planes[2];   /* o: the plane is one of these */
+  short next_plane;       /* plane to fill next */
+  abinWriter writer;      /* o: output being written */
+  long xlen;              /* i: length of x-axis (full img) */
+  long ylen;              /* i: length of y-axis (full img) */
+  long lAxes[2];          /* X,Y lens togeether */
+  float snr_thresh;       /* i: SNR threshold */
+  dmnautilusCriteria criteria;
+  dmDescriptor *xdesc;
+  dmDescriptor *ydesc;
+  short *pixmask;         /* i: validity plane (0 = NULL/NaN/outside subspace),
+                                  the same for all the bands */
+  short borrowed;         /* band data is the caller's array, not freed */
+  short borrowed_mask;    /*    and so is pixmask */
+  long vbox[4];           /* bounding box of the valid pixels: x0, y0, x1, y1
+                             (exclusive); nothing outside it has to be read */
+  short tiled;            /* layout=tile: the leaves are summed from tiles */
+  short *tilemask;        /*    pixmask in tiles, for the leaf sums */
+  abinBuffer tilemaskbuf; /*    tilemask */
+  double *row;            /* one row of pixel values, and a second for */
+  float *vrow;            /* the next band; and their variances */
+
+  /* Summed-area tables; see abinSat.  The number of valid pixels is
+   * the same for all the bands. */
+  abinSat *sat;           /* one per band, only nsat are used */
+  short nsat;
+  long   *sumpix;
+  abinBuffer pixbuf;      /* sumpix */
+  short have_counts;      /* sumpix is of the current pixmask */
+  short fill_band;        /* o: band of the binned image being filled */
+
+  /* Incremental binning: make_sum_tables() checks whether the tables
+   * are exact.  Then the statistics of a sub-image only depend on its
+   * own pixels, not on rounding in the sums over the rest of the image.
+   * The table of bins records it for the next incremental run. */
+  short check_exact;
+  short exact_sums;
+
+  long xlen_alloc;        /* pixels allocated in the row buffer */
+
+  /* Between dmnautilus_load() and dmnautilus_unload() the image, its
+   * summed-area tables, and the input block (for the output headers)
+   * are kept so it can be binned again w/ another snr and method */
+  short loaded;
+  dmBlock *inBlock;
+  char unit[DS_SZ_KEYWORD];
+
+  abinCount count;        /* the serial parts of the last run */
+  dmnautilusStats stats;  /* of the last run */
+};
+
+#define SAT_IDX(xx,yy)  ((xx)+((yy)*(ctx->xlen+1)))
+
+
+
+/* Statistics of a sub-image from the summed-area tables.  Each node's
+ * statistics are computed once, where they are first needed, and are
+ * passed down the tree rather than being looked up again. */
+typedef struct {
+  float snr;    /* signal to noise ratio */
+  float val;    /* sum of pixel values */
+  long npix;    /* number of valid pixels */
+} abinStats;
+
+/* A leaf of the quad-tree: the sub-image and its output values */
+typedef struct {
+  long xs;      /* start of x-axis (sub img) */
+  long ys;      /* start of y-axis (sub img) */
+  long xl;      /* length of x-axis (sub img) */
+  long yl;      /* length of y-axis (sub img) */
+  float sum;    /* sum of pixel values */
+  float val;    /* average pixel value */
+  long area;    /* number of valid pixels */
+  float snr;    /* signal to noise ratio */
+  short level;  /* depth in the tree; the whole image is 0 */
+} abinLeaf;
+
+typedef struct {
+  abinLeaf *leaf;
+  float *bandsum;  /* sum of pixel values in each band, nbands per leaf;
+                      only with more than one band */
+  long nleaves;
+  long maxleaves;
+  short status;  /* non-zero if something went wrong */
+} abinLeafList;
+
+/* A sub-image in the level-synchronous engine.  path has 2 bits per
+ * level for which quadrant (ll, lr, ul, ur) was taken, starting at the
+ * most significant bits; sorting on it gives depth-first order. */
+typedef struct {
+  long xs;
+  long ys;
+  long xl;
+  long yl;
+  abinStats stats;
+  unsigned long long path;
+  short level;
+  const abinLeaf *prev;  /* incremental: unchanged leaves to keep */
+  long nprev;
+  short subtree;         /* incremental: a new sub-tree to traverse */
+} abinNode;
+
+typedef struct {
+  abinNode *node;
+  long nnodes;
+  long maxnodes;
+} abinNodeList;
+
+/* The split decisions for one level of the level-synchronous engine:
+ * for each node of the frontier, the statistics of its 4 sub-images
+ * (only looked up if it can split) and whether it splits. */
+typedef struct {
+  abinStats *sub;        /* 4 per node */
+  unsigned char *check;  /* 1 to split */
+  long maxnodes;
+} abinLevel;
+
+#define ABIN_MAX_LEVEL  32   /* levels that fit in abinNode.path */
+
+/* A sub-tree that is traversed by one thread */
+typedef struct {
+  long xs;
+  long ys;
+  long xl;
+  long yl;
+  abinStats stats;               /* statistics of the sub-tree root */
+  short level;                   /* depth of the sub-tree root */
+  short is_leaf;                 /* root is already known to be a leaf */
+  abinNode *nodes;               /* level engine: leaves to be summed */
+  long nnodes;
+  abinLeafList leaves;           /* leaves in depth-first order */
+  unsigned long first_mask_no;   /* mask number of first leaf */
+  abinCount count;               /* work done by the thread running it */
+} abinTask;
+
+typedef struct {
+  abinTask *task;
+  long ntasks;
+  long maxtasks;
+} abinTaskList;
+
+/* The leaves of an earlier run on the same field, in mask number (so
+ * depth-first) order.  nchanged[nn] is the number of leaves before the
+ * nn-th that have a changed pixel, so the number in any run of leaves is
+ * a difference.  at is the next leaf the traversal has to match. */
+typedef struct {
+  abinTaskList tasks;     /* as read; all in one task */
+  abinLeaf *leaf;
+  long nleaves;
+  long *nchanged;         /* nleaves+1 */
+  long at;
+  short exact;            /* the earlier run's sums were exact */
+} abinPrevTree;
+
+/* SNR sweep: every node that the traversal at the lowest threshold 
+ * reaches, in depth-first order.  Whether a node splits only depends on
+ * the threshold through one number, lo (see get_split_limit()), so a 
+ * node is a leaf for lo <= snr < hi, where hi is the lowest lo of its
+ * ancestors.  The bins for any snr are then a walk over the array that
+ * skips the sub-tree of each leaf.  The tree is kept small since there
+ * can be more nodes than pixels; only the nodes that are a leaf for 
+ * some snr get a bin. */
+typedef struct {
+  float lo;                /* splits for snr below this */
+  float hi;                /* reached for snr below this */
+  long next;               /* index of the node after its sub-tree */
+  long bin;                /* index in abinHier.bins; -1 if never a leaf */
+} abinHierNode;
+
+typedef struct {
+  abinHierNode *node;
+  long nnodes;
+  long maxnodes;
+  abinLeafList bins;       /* area is the number of valid pixels until the
+                              bin is summed, -1 if it is not needed */
+} abinHier;
+
+/* outtreefile: every node of the quad-tree, the ones that split as well
+ * as the leaves, a level at a time.  Within a level the nodes are in
+ * traversal order, so the 4 children of the k-th node on a level that
+ * splits are nodes 4k..4k+3 of the next level, and the nodes down to any
+ * depth are the first levend[depth] of them. */
+typedef struct {
+  abinLeaf *node;          /* level order; a leaf has its summed values */
+  unsigned long *mask_no;  /* of a leaf, 0 for a node that split */
+  long nnodes;
+  long levend[ABIN_MAX_LEVEL+1];  /* nodes through each level */
+  short nlevels;
+} abinTree;
+
+/* The next leaf, in mask number order, while the tree is rebuilt */
+typedef struct {
+  const abinTaskList *tasks;
+  long task;
+  long leaf;
+  unsigned long mask_no;   /* of the last leaf used */
+} abinLeafCursor;
+
+/* Physical coordinates of the lower-left ([2n]) and upper-right ([2n+1])
+ * corners of every leaf, in mask number order.  Used for both the regions
+ * and the table of bins. */
+typedef struct {
+  double *xx;
+  double *yy;
+  long nleaves;
+} abinCorners;
+
+
+/* Wall and CPU clocks at the start of the current phase */
+typedef struct {
+  double wall;
+  double cpu;
+} abinClock;
+
+
+/* ------Prototypes ----------------------- */
+
+
+/* dmn_input.c */
+int load_error_image( dmnautilusContext *ctx, abinBand *band, const char *errimg, const char *varimg );
+int make_sum_tables( dmnautilusContext *ctx );
+void find_valid_box( dmnautilusContext *ctx );
+int tile_bands( dmnautilusContext *ctx );
+int alloc_buffers( dmnautilusContext *ctx );
+int alloc_bands( dmnautilusContext *ctx, short nbands );
+int load_band( dmnautilusContext *ctx, abinBand *band, const char *infile, const char *binspec );
+int get_buffer( dmnautilusContext *ctx, abinBuffer *buf, size_t nbytes );
+void free_buffer( abinBuffer *buf );
+short need_mapped_buffers( dmnautilusContext *ctx, long memlimit );
+int select_kernels( dmnautilusContext *ctx, abinBand *band );
+char *get_infile_name( const char *infile, const char *binspec );
+
+/* dmn_traverse.c */
+long count_valid( dmnautilusContext *ctx, long xs, long ys, long xe, long ye );
+void get_leaf_sums( dmnautilusContext *ctx, abinCount *count, abinBand *band, long xs, long ys, long xl ,long yl, float *oval, float *onoise, long *area);
+void get_stats( dmnautilusContext *ctx, abinCount *count, long xs, long ys, long xl, long yl, abinStats *stats );
+void get_sub_stats( dmnautilusContext *ctx, abinCount *count, long xs, long ys, long xl, long yl, abinStats *sub );
+short split_sub_image( dmnautilusContext *ctx, abinCount *count, long xs, long ys, long xl, long yl, const abinStats *stats, abinStats *sub );
+abinLeaf *new_leaf( dmnautilusContext *ctx, abinLeafList *leaves );
+int add_leaf( dmnautilusContext *ctx, abinCount *count, abinLeafList *leaves, long xs, long ys, long xl, long yl, short level, const abinStats *stats );
+void abin_rec ( dmnautilusContext *ctx, abinCount *count, long xs, long ys, long xl, long yl, short level, const abinStats *stats, abinLeafList *leaves);
+int add_node( abinNodeList *list, long xs, long ys, long xl, long yl, short level, const abinStats *stats, unsigned long long path );
+int run_tasks( dmnautilusContext *ctx, abinTaskList *tasks, void (*func)(dmnautilusContext *ctx, abinTask *task), short nthreads );
+int abin_tree( dmnautilusContext *ctx, short nthreads, dmnautilusEngine engine, abinPrevTree *prev, abinTaskList *tasks );
+void free_tasks( abinTaskList *tasks );
+void add_task_counts( dmnautilusContext *ctx, abinTaskList *tasks );
+
+/* dmn_incr.c */
+int add_incr_nodes( dmnautilusContext *ctx, abinPrevTree *prev, long xs, long ys, long xl, long yl, short level, const abinStats *stats, abinNodeList *nodes );
+void run_incr_task( dmnautilusContext *ctx, abinTask *task );
+int load_prev_tree( dmnautilusContext *ctx, const char *binfile, const char *deltafile, const dmnautilusParams *params, abinPrevTree *prev );
+void free_prev_tree( abinPrevTree *prev );
+
+/* dmn_sweep.c */
+int add_hier_nodes( dmnautilusContext *ctx, abinHier *hier, long xs, long ys, long xl, long yl, short level, const abinStats *stats, float hi, float lowest );
+int sum_hier_leaves( dmnautilusContext *ctx, abinHier *hier, const float *snrs, long nsnr, short all, short nthreads );
+int make_cut_tasks( dmnautilusContext *ctx, abinHier *hier, float snr, long ntarget, abinTaskList *tasks );
+int write_hier_table( dmnautilusContext *ctx, abinHier *hier, const char *hierfile, short clobber );
+void free_hier( abinHier *hier );
+
+/* dmn_tree.c */
+int write_tree_table( dmnautilusContext *ctx, dmBlock *inBlock, abinTaskList *tasks, const char *treefile, const char *unit, short clobber );
+
+/* dmn_output.c */
+void run_fill_task( dmnautilusContext *ctx, abinTask *task );
+int make_corners( dmnautilusContext *ctx, abinTaskList *tasks, abinCorners *corners );
+void free_corners( abinCorners *corners );
+int finish_output( dmnautilusContext *ctx );
+int make_output( dmnautilusContext *ctx, abinTaskList *tasks, short nthreads, abinProduct product, dmBlock *inBlock, const char *outfile, const char *unit, abinCorners *corners, short clobber );
+short want_output( const char *name );
+int write_bin_table( dmnautilusContext *ctx, dmBlock *inBlock, abinTaskList *tasks, abinCorners *corners, const char *binfile, const char *unit, const float *range, short clobber );
+int read_bin_table( dmnautilusContext *ctx, const char *binfile, short nthreads, const dmnautilusParams *params, abinTaskList *tasks, short *exact );
+
+#endif
@@ -0,0 +1,380 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "dmn_private.h"
+
+
+/* SNR sweep: one traversal at the lowest threshold gives the bins for
+ * every threshold (see abinHier). */
+
+
+/* ------Prototypes ----------------------- */
+
+static float get_split_limit( dmnautilusContext *ctx, long xs, long ys, long xl, long yl, const abinStats *stats, abinStats *sub, short *have_sub );
+static short is_cut_leaf( const abinHierNode *node, float snr );
+static void run_hier_task( dmnautilusContext *ctx, abinTask *task );
+
+
+/* ----------------------------- */
+
+
+/* split_sub_image() as a function of the threshold: the sub-image
+ * splits for snr < the returned limit.  With method=0 that is its own
+ * SNR.  Otherwise a sub-image that is OK at one threshold is OK at any
+ * lower one, so the split holds for snr <= the SNR of the k-th best
+ * sub-image (of the best side-by-side pair for method=2); < the next
+ * float up from it is the same test.  A sub-image w/o valid pixels is
+ * always OK and a NaN SNR never is.  The sub-image statistics are
+ * returned when they had to be looked up (*have_sub). */
+static float get_split_limit( dmnautilusContext *ctx, long xs, long ys, long xl, long yl,
+                              const abinStats *stats, abinStats *sub, short *have_sub )
+{
+  float ok[4];
+  float best, tmp;
+  short ii, jj;
+
+  *have_sub = 0;
+  if ( ( xl <= 1 ) || ( yl <= 1 ) ) {
+    return( -INFINITY );
+  }
+  if ( ZERO_ABOVE == ctx->criteria ) {
+    return( isnan( stats->snr ) ? -INFINITY : stats->snr );
+  }
+
+  get_sub_stats( ctx, &(ctx->count), xs, ys, xl, yl, sub );
+  *have_sub = 1;
+  if ( ( sub[0].npix+sub[1].npix+sub[2].npix+sub[3].npix ) == 0 ) {
+    return( -INFINITY );
+  }
+  for (ii=0; ii<4; ii++ ) {
+    if ( 0 == sub[ii].npix ) {
+      ok[ii] = INFINITY;
+    } else {
+      ok[ii] = isnan( sub[ii].snr ) ? -INFINITY : sub[ii].snr;
+    }
+  }
+
+  if ( TWO_ABOVE == ctx->criteria ) {
+    /* ll-lr, lr-ur, ur-ul, ul-ll */
+    const short pair[4][2] = { {0,1}, {1,3}, {3,2}, {2,0} };
+    best = -INFINITY;
+    for (ii=0; ii<4; ii++ ) {
+      float both = ( ok[pair[ii][0]] < ok[pair[ii][1]] ) ? ok[pair[ii][0]] : ok[pair[ii][1]];
+      if ( both > best ) {
+        best = both;
+      }
+    }
+  } else {
+    /* Highest first; the k-th is the limit for k above */
+    for (ii=1; ii<4; ii++ ) {
+      for (jj=ii; ( jj > 0 ) && ( ok[jj-1] < ok[jj] ); jj-- ) {
+        tmp = ok[jj];
+        ok[jj] = ok[jj-1];
+        ok[jj-1] = tmp;
+      }
+    }
+    best = ok[ ( ONE_ABOVE == ctx->criteria ) ? 0 : 
+                ( THREE_ABOVE == ctx->criteria ) ? 2 : 3 ];
+  }
+
+  if ( isinf( best ) ) {
+    return( best );
+  }
+  return( nextafterf( best, INFINITY ) );
+}
+
+
+/* Depth-first traversal at the lowest threshold, keeping every node and
+ * the range of thresholds it is a leaf for */
+int add_hier_nodes( dmnautilusContext *ctx, abinHier *hier, 
+                    long xs, long ys, long xl, long yl, short level, 
+                    const abinStats *stats, float hi, float lowest )
+{
+  abinHierNode *node;
+  abinStats sub[4];
+  short have_sub;
+  float lo;
+  long at;
+
+  if ( hier->nnodes == hier->maxnodes ) {
+    long nmax = ( hier->maxnodes == 0 ) ? 1024 : 2*hier->maxnodes;
+    abinHierNode *more = (abinHierNode*)realloc( hier->node, nmax*sizeof(abinHierNode));
+    if ( NULL == more ) {
+      return(-1);
+    }
+    hier->node = more;
+    hier->maxnodes = nmax;
+  }
+  at = hier->nnodes++;
+
+  lo = get_split_limit( ctx, xs, ys, xl, yl, stats, sub, &have_sub );
+
+  node = &(hier->node[at]);
+  node->lo = lo;
+  node->hi = hi;
+  node->bin = -1;
+  if ( lo < hi ) {
+    abinLeaf *leaf = new_leaf( ctx, &(hier->bins) );
+    if ( NULL == leaf ) {
+      return(-1);
+    }
+    memset( leaf, 0, sizeof(abinLeaf));
+    leaf->xs = xs;
+    leaf->ys = ys;
+    leaf->xl = xl;
+    leaf->yl = yl;
+    leaf->level = level;
+    leaf->area = stats->npix;
+    node->bin = hier->bins.nleaves-1;
+  }
+
+  if ( lowest < lo ) {
+    long hx = FLOOR(xl/2.0);
+    long hy = FLOOR(yl/2.0);
+    long cx = CEIL(xl/2.0);
+    long cy = CEIL(yl/2.0);
+    if ( lo < hi ) {
+      hi = lo;
+    }
+    if ( !have_sub ) {
+      get_sub_stats( ctx, &(ctx->count), xs, ys, xl, yl, sub );
+    }
+    if ( ( 0 != add_hier_nodes( ctx, hier, xs, ys, hx, hy, level+1, sub+0, hi, lowest )) || /* low-left */
+         ( 0 != add_hier_nodes( ctx, hier, xs+hx, ys, cx, hy, level+1, sub+1, hi, lowest )) || /* low-rite*/
+         ( 0 != add_hier_nodes( ctx, hier, xs, ys+hy, hx, cy, level+1, sub+2, hi, lowest )) || /* up-left */
+         ( 0 != add_hier_nodes( ctx, hier, xs+hx, ys+hy, cx, cy, level+1, sub+3, hi, lowest ))) { /* up-rite */
+      return(-1);
+    }
+  }
+
+  hier->node[at].next = hier->nnodes;
+  return(0);
+}
+
+
+static short is_cut_leaf( const abinHierNode *node, float snr )
+{
+  return( ( node->bin >= 0 ) && !( snr < node->lo ) && ( snr < node->hi ) );
+}
+
+
+/* Sum the bins of one task in place; the task's leaves are a slice of
+ * abinHier.bins */
+static void run_hier_task( dmnautilusContext *ctx, abinTask *task )
+{
+  abinLeafList one;
+  abinStats stats;
+  long nn;
+
+  memset( &one, 0, sizeof(abinLeafList));
+  memset( &stats, 0, sizeof(abinStats));
+  for (nn=0; nn<task->leaves.nleaves; nn++ ) {
+    abinLeaf *leaf = &(task->leaves.leaf[nn]);
+    if ( leaf->area < 0 ) {
+      continue;
+    }
+    stats.npix = leaf->area;
+    one.nleaves = 0;
+    if ( 0 != add_leaf( ctx, &(task->count), &one, leaf->xs, leaf->ys, leaf->xl, leaf->yl, leaf->level, 
+                        &stats )) {
+      task->leaves.status = -1;
+      break;
+    }
+    *leaf = one.leaf[0];
+    if ( one.bandsum ) {
+      memcpy( task->leaves.bandsum + nn*ctx->nbands, one.bandsum, ctx->nbands*sizeof(float));
+    }
+  }
+  if ( one.leaf ) free( one.leaf );
+  if ( one.bandsum ) free( one.bandsum );
+}
+
+
+/* Sum the pixels of every bin that is a leaf for one of the thresholds
+ * (or for any threshold with all set), once, in parallel */
+int sum_hier_leaves( dmnautilusContext *ctx, abinHier *hier, const float *snrs, 
+                     long nsnr, short all, short nthreads )
+{
+  abinTaskList tasks;
+  long nbins = hier->bins.nleaves;
+  long ntasks = ( nthreads > 1 ) ? 16*nthreads : 1;
+  long nper, ii, kk, nn;
+  int retval = 0;
+
+  for (nn=0; nn<hier->nnodes; nn++ ) {
+    abinHierNode *node = &(hier->node[nn]);
+    short need = all;
+    if ( node->bin < 0 ) {
+      continue;
+    }
+    for (kk=0; ( !need ) && ( kk<nsnr ); kk++ ) {
+      need = is_cut_leaf( node, snrs[kk] );
+    }
+    if ( !need ) {
+      hier->bins.leaf[node->bin].area = -1;
+    }
+  }
+
+  if ( ntasks > nbins ) {
+    ntasks = ( nbins > 0 ) ? nbins : 1;
+  }
+  nper = ( nbins + ntasks - 1 ) / ntasks;
+  memset( &tasks, 0, sizeof(abinTaskList));
+  if ( NULL == ( tasks.task = (abinTask*)calloc( ntasks, sizeof(abinTask)))) {
+    return(-1);
+  }
+  tasks.maxtasks = ntasks;
+  for (ii=0; ( ii<ntasks ) && ( ii*nper < nbins ); ii++ ) {
+    abinTask *task = &(tasks.task[ii]);
+    long start = ii*nper;
+    task->leaves.leaf = hier->bins.leaf + start;
+    task->leaves.bandsum = hier->bins.bandsum ? hier->bins.bandsum + start*ctx->nbands : NULL;
+    task->leaves.nleaves = ( start+nper < nbins ) ? nper : nbins-start;
+    task->leaves.maxleaves = task->leaves.nleaves;
+    tasks.ntasks = ii+1;
+  }
+
+  run_tasks( ctx, &tasks, run_hier_task, nthreads );
+  add_task_counts( ctx, &tasks );
+
+  for (ii=0; ii<tasks.ntasks; ii++ ) {
+    if ( 0 != tasks.task[ii].leaves.status ) {
+      retval = -1;
+    }
+    memset( &(tasks.task[ii].leaves), 0, sizeof(abinLeafList));  /* not theirs */
+  }
+  free_tasks( &tasks );
+  return(retval);
+}
+
+
+/* The bins for one threshold, in mask number order, split into tasks so
+ * the outputs can be filled in parallel */
+int make_cut_tasks( dmnautilusContext *ctx, abinHier *hier, float snr, long ntarget,
+                    abinTaskList *tasks )
+{
+  long ncut = 0;
+  long nper, nn;
+
+  memset( tasks, 0, sizeof(abinTaskList));
+  for (nn=0; nn<hier->nnodes; ) {
+    if ( is_cut_leaf( &(hier->node[nn]), snr ) ) {
+      ncut++;
+      nn = hier->node[nn].next;
+    } else {
+      nn++;
+    }
+  }
+
+  if ( ntarget > ncut ) {
+    ntarget = ( ncut > 0 ) ? ncut : 1;
+  }
+  nper = ( ncut + ntarget - 1 ) / ntarget;
+  tasks->task = (abinTask*)calloc( ntarget, sizeof(abinTask));
+  if ( NULL == tasks->task ) {
+    return(-1);
+  }
+  tasks->maxtasks = ntarget;
+
+  ncut = 0;
+  for (nn=0; nn<hier->nnodes; ) {
+    abinHierNode *node = &(hier->node[nn]);
+    abinTask *task;
+    abinLeaf *leaf;
+
+    if ( !is_cut_leaf( node, snr ) ) {
+      nn++;
+      continue;
+    }
+    task = &(tasks->task[ncut/nper]);
+    if ( 0 == task->leaves.nleaves ) {
+      task->first_mask_no = ncut+1;
+      tasks->ntasks = ncut/nper + 1;
+    }
+    if ( NULL == ( leaf = new_leaf( ctx, &(task->leaves) ))) {
+      return(-1);
+    }
+    *leaf = hier->bins.leaf[node->bin];
+    if ( hier->bins.bandsum ) {
+      memcpy( task->leaves.bandsum + (task->leaves.nleaves-1)*ctx->nbands, 
+              hier->bins.bandsum + node->bin*ctx->nbands, ctx->nbands*sizeof(float));
+    }
+    ncut++;
+    nn = node->next;
+  }
+
+  return(0);
+}
+
+
+/* Write the hierarchy: every bin, as a table of bins with the range of
+ * snr it is a leaf for.  All of the bins must have been summed. */
+int write_hier_table( dmnautilusContext *ctx, abinHier *hier, const char *hierfile,
+                      short clobber )
+{
+  abinTaskList all;
+  abinTask one;
+  abinCorners corners;
+  float *range;
+  long nn;
+  int retval = 0;
+
+  memset( &corners, 0, sizeof(abinCorners));
+  if ( NULL == ( range = (float*)calloc( 2*hier->bins.nleaves+1, sizeof(float)))) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+  for (nn=0; nn<hier->nnodes; nn++ ) {
+    if ( hier->node[nn].bin >= 0 ) {
+      range[2*hier->node[nn].bin] = hier->node[nn].lo;
+      range[2*hier->node[nn].bin+1] = hier->node[nn].hi;
+    }
+  }
+
+  /* One task that is all of the bins; nothing to free */
+  memset( &one, 0, sizeof(abinTask));
+  one.leaves = hier->bins;
+  one.first_mask_no = 1;
+  all.task = &one;
+  all.ntasks = 1;
+  all.maxtasks = 1;
+
+  if ( ( 0 != make_corners( ctx, &all, &corners ) ) ||
+       ( 0 != write_bin_table( ctx, ctx->inBlock, &all, &corners, hierfile, 
+                               ctx->unit, range, clobber ) ) ) {
+    retval = -1;
+  }
+  free_corners( &corners );
+  free( range );
+  return(retval);
+}
+
+
+void free_hier( abinHier *hier )
+{
+  if ( hier->bins.leaf ) free( hier->bins.leaf );
+  if ( hier->bins.bandsum ) free( hier->bins.bandsum );
+  if ( hier->node ) free( hier->node );
+  memset( hier, 0, sizeof(abinHier));
+}
@@ -0,0 +1,951 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "dmn_private.h"
+
+
+/* The quad-tree traversal: the statistics of a sub-image, the depth-
+ * first and level-synchronous engines, and the tasks they are run in. */
+
+
+/* ------Prototypes ----------------------- */
+
+static double get_snr( dmnautilusContext *ctx, abinCount *count, const abinSat *sat, long xs, long ys, long xl ,long yl, float *oval, long *area);
+static float get_joint_snr( dmnautilusContext *ctx, float snr, float band_snr );
+static int make_tasks( dmnautilusContext *ctx, long xs, long ys, long xl, long yl, short level, const abinStats *stats, short depth, abinTaskList *tasks );
+static int compare_node_path( const void *aa, const void *bb );
+static int make_split_table( dmnautilusContext *ctx, unsigned char *table );
+static int split_level( dmnautilusContext *ctx, const abinNodeList *cur, const unsigned char *table, abinLevel *lev );
+static int make_level_tasks( dmnautilusContext *ctx, const abinStats *root, long ntarget, abinTaskList *tasks, abinNodeList *leaves );
+static int split_node_tasks( abinNodeList *nodes, long ntarget, abinTaskList *tasks );
+static void run_tree_task( dmnautilusContext *ctx, abinTask *task );
+static void run_leaf_task( dmnautilusContext *ctx, abinTask *task );
+static void *run_task_queue( void *arg );
+
+
+/* ----------------------------- */
+
+
+/* Compute the signal to noise ratio in the sub-image.  Also returns the
+ * sum of the pixel values and the area (number of non-null pixels).
+ * Uses the summed-area tables so the cost does not depend on the size
+ * of the sub-image. */
+static double get_snr( 
+        dmnautilusContext *ctx, /* i: context */
+        abinCount *count, /* i/o: work done */
+        const abinSat *sat, /* i: summed-area tables to use */
+        long   xs,     /* i: start of x-axis (sub img) */
+        long   ys,     /* i: start of y-axis (sub img) */
+        long   xl,     /* i: length of x-axis (sub img) */
+        long   yl,      /* i: length of y-axis (sub img) */
+        float  *oval,   /* o: sum of pixel values */
+        long   *area    /* o: number of pixels */
+  )
+{
+  
+  float val;
+  float noise;
+  float locsnr;
+  long xe, ye;
+  long ll, lr, ul, ur;
+
+  count->snr_calls += 1;
+
+  /* Clip sub-image to the image; same as skipping pixels past the edge */
+  xe = ( (xs+xl) > ctx->xlen ) ? ctx->xlen : xs+xl;
+  ye = ( (ys+yl) > ctx->ylen ) ? ctx->ylen : ys+yl;
+  if ( ( xe <= xs ) || ( ye <= ys ) ) {
+    xe = xs;
+    ye = ys;
+  }
+
+  ll = SAT_IDX(xs,ys);
+  lr = SAT_IDX(xe,ys);
+  ul = SAT_IDX(xs,ye);
+  ur = SAT_IDX(xe,ye);
+
+  val = sat->sumval[ur] - sat->sumval[lr] - sat->sumval[ul] + sat->sumval[ll];
+  noise = sat->sumvar[ur] - sat->sumvar[lr] - sat->sumvar[ul] + sat->sumvar[ll];
+  *area = ctx->sumpix[ur] - ctx->sumpix[lr] - ctx->sumpix[ul] + ctx->sumpix[ll];
+
+  locsnr = val / sqrt(noise);
+  *oval = val;
+
+  return locsnr;
+}
+
+
+void get_stats( 
+        dmnautilusContext *ctx, /* i: context */
+        abinCount *count, /* i/o: work done */
+        long   xs,     /* i: start of x-axis (sub img) */
+        long   ys,     /* i: start of y-axis (sub img) */
+        long   xl,     /* i: length of x-axis (sub img) */
+        long   yl,     /* i: length of y-axis (sub img) */
+        abinStats *stats  /* o: statistics */
+  )
+{
+  short ss;
+
+  stats->snr = get_snr( ctx, count, ctx->sat, xs, ys, xl, yl, &(stats->val), &(stats->npix) );
+
+  /* Bands tested separately */
+  for (ss=1; ss<ctx->nsat; ss++ ) {
+    float val;
+    float snr = get_snr( ctx, count, ctx->sat+ss, xs, ys, xl, yl, &val, &(stats->npix) );
+    stats->snr = get_joint_snr( ctx, stats->snr, snr );
+    stats->val += val;
+  }
+}
+
+
+/* Combine the SNR of one more band with the bands so far.  For
+ * JOINT_ALL it is the lowest (all are above the threshold if it is),
+ * and NaN if any band is, since NaN is never above the threshold; for
+ * JOINT_ANY it is the highest. */
+static float get_joint_snr( dmnautilusContext *ctx, float snr, float band_snr )
+{
+  if ( JOINT_ALL == ctx->joint ) {
+    if ( isnan( band_snr ) || ( band_snr < snr ) ) {
+      return( band_snr );
+    }
+  } else {
+    if ( isnan( snr ) || ( band_snr > snr ) ) {
+      return( band_snr );
+    }
+  }
+  return( snr );
+}
+
+
+/* Statistics of the 2x2 sub-images, in the same order as the recursion.
+ *
+ * need to use floor() and ceil() because input image may
+ * not be square, or 2^n.  This will bias the left-upper image w/ 1 more 
+ * pixel per bin; but that's a limit of not using square images.
+ * The alternative is only use square smallest sub-image or pad image to 2**N.*/
+void get_sub_stats( 
+        dmnautilusContext *ctx, /* i: context */
+        abinCount *count, /* i/o: work done */
+        long   xs,     /* i: start of x-axis (sub img) */
+        long   ys,     /* i: start of y-axis (sub img) */
+        long   xl,     /* i: length of x-axis (sub img) */
+        long   yl,     /* i: length of y-axis (sub img) */
+        abinStats *sub /* o: statistics of the 4 sub-images */
+  )
+{
+  get_stats( ctx, count, xs, ys, FLOOR(xl/2.0), FLOOR(yl/2.0), sub+0 ); /* low-left */
+  get_stats( ctx, count, xs+FLOOR(xl/2.0), ys, CEIL(xl/2.0), FLOOR(yl/2.0), sub+1 ); /* low-rite*/
+  get_stats( ctx, count, xs, ys+FLOOR(yl/2.0), FLOOR(xl/2.0), CEIL(yl/2.0), sub+2 ); /* up-left */
+  get_stats( ctx, count, xs+FLOOR(xl/2.0), ys+FLOOR(yl/2.0), CEIL(xl/2.0), CEIL(yl/2.0), sub+3 ); /* up-rite */
+}
+
+
+/* Sum up the pixels of one band in a leaf sub-image.  This is the
+ * original pixel by pixel get_snr(); it is only used once per leaf (so
+ * each pixel is only visited once) and keeps the float accumulation of
+ * the original so the output values do not change. */
+void get_leaf_sums( 
+        dmnautilusContext *ctx, /* i: context */
+        abinCount *count, /* i/o: work done */
+        abinBand *band, /* i: band to sum */
+        long   xs,     /* i: start of x-axis (sub img) */
+        long   ys,     /* i: start of y-axis (sub img) */
+        long   xl,     /* i: length of x-axis (sub img) */
+        long   yl,      /* i: length of y-axis (sub img) */
+        float  *oval,   /* o: sum of pixel values */
+        float  *onoise, /* o: sum of variances */
+        long   *area    /* o: number of pixels */
+  )
+{
+  
+  float val;
+  float noise;
+  long ii;
+
+  long xe, ye;
+
+  val = 0.0;
+  noise = 0.0;
+  *area = 0;
+
+  /* Only the part inside the box of valid pixels; the rest would be
+   * skipped pixel by pixel anyway, so the order of the sums is the same */
+  xe = ( (xs+xl) > ctx->vbox[2] ) ? ctx->vbox[2] : xs+xl;
+  ye = ( (ys+yl) > ctx->vbox[3] ) ? ctx->vbox[3] : ys+yl;
+  if ( xs < ctx->vbox[0] ) xs = ctx->vbox[0];
+  if ( ys < ctx->vbox[1] ) ys = ctx->vbox[1];
+  if ( ye <= ys ) {
+    xe = xs;
+  }
+  if ( xe > xs ) {
+    count->pixels += (xe-xs)*(ye-ys);
+  }
+
+  if ( ctx->tiled ) {
+    /* Same order, a column at a time, one tile at a time */
+    long ntx = DMN_NUM_TILES( ctx->xlen );
+    for (ii=xs; ii<xe; ii++ ) {
+      long jj, jnext;
+      for (jj=ys; jj<ye; jj=jnext ) {
+        jnext = ( ( jj >> DMN_TILE_BITS ) + 1 ) << DMN_TILE_BITS;
+        if ( jnext > ye ) jnext = ye;
+        band->kern.sum_col( band->kdata, DMN_TILE_IDX(ii,jj,ntx), DMN_TILE, jnext-jj,
+                            ctx->tilemask, band->dvar, &val, &noise, area );
+      }
+    }
+  } else {
+    for (ii=xs; ii<xe; ii++ ) {
+      band->kern.sum_col( band->kdata, ii+(ys*ctx->xlen), ctx->xlen, ye-ys, 
+                          ctx->pixmask, band->dvar, &val, &noise, area );
+    }
+  }
+  *oval = val;
+  *onoise = noise;
+}
+
+
+/* Decide whether to split the sub-image into 2x2 sub-images.  Returns
+ * 1 to split, 0 to keep it as a leaf, and -1 if something went wrong.
+ * When it splits, the statistics of the sub-images are returned so they
+ * do not have to be computed again. */
+short split_sub_image ( 
+        dmnautilusContext *ctx, /* i: context */
+        abinCount *count, /* i/o: work done */
+        long   xs,     /* i: start of x-axis (sub img) */
+        long   ys,     /* i: start of y-axis (sub img) */
+        long   xl,     /* i: length of x-axis (sub img) */
+        long   yl,     /* i: length of y-axis (sub img) */
+        const abinStats *stats, /* i: statistics of the sub-image */
+        abinStats *sub /* o: statistics of the 4 sub-images */
+       )   
+{
+  short check = 0;
+
+  if ( ZERO_ABOVE == ctx->criteria ) {
+      /* This is the original method -- if the current block is above SNR
+       * then split it. */
+      check = ( stats->snr > ctx->snr_thresh );
+
+  } else {
+      /* Determine SNR for current sub-image */
+
+      /* This new method will only split the 2x2 if when the sub images
+       * are created, some/all of them will remain above the SNR limit.
+       * 
+       */
+      
+      short ill, ilr, iul, iur;
+
+      get_sub_stats( ctx, count, xs, ys, xl, yl, sub );
+
+      /*
+       * It is OK to split if sub-cell has no valid pixel; but not all of them.
+       */       
+      ill = ( sub[0].snr >= ctx->snr_thresh) || ( sub[0].npix == 0);  
+      ilr = ( sub[1].snr >= ctx->snr_thresh) || ( sub[1].npix == 0);
+      iul = ( sub[2].snr >= ctx->snr_thresh) || ( sub[2].npix == 0);
+      iur = ( sub[3].snr >= ctx->snr_thresh) || ( sub[3].npix == 0);
+
+      /* If there are no pixels, no reason to recurse */
+      if ((sub[0].npix+sub[1].npix+sub[2].npix+sub[3].npix) ==0 ) {
+          check =0; 
+
+      } else if ( ONE_ABOVE == ctx->criteria ) {
+          /* If any one of the sub images is above snr, then split */
+          check = ( ill + ilr + iul + iur  );            
+
+      } else if ( TWO_ABOVE == ctx->criteria ) {
+          /* If two, then they have to be side-by side, not diagonal */
+         check = ( (ill && ilr ) || 
+                   (ilr && iur ) ||
+                   (iur && iul ) ||
+                   (iul && ill )
+                  ); 
+
+      } else if ( THREE_ABOVE == ctx->criteria ) {
+          check = ( ill + ilr + iul + iur ) >= 3 ? 1 : 0;
+
+      } else if ( ALL_ABOVE == ctx->criteria ) {
+          check = ( ill + ilr + iul + iur ) == 4 ? 1 : 0;
+
+      } else {
+          err_msg("This should not have happened, something's amiss");
+          return(-1);
+      }
+
+  } // end else 
+
+  check = ( ( check ) && (xl>1) && (yl>1) ) ? 1 : 0;
+
+  /* The sub-images need their own statistics for the next level */
+  if ( check && ( ZERO_ABOVE == ctx->criteria ) ) {
+      get_sub_stats( ctx, count, xs, ys, xl, yl, sub );
+  }
+
+  return check;
+}
+
+
+/* Add a leaf to the list and compute its output values.  The values are
+ * summed from the pixels rather than taken from the summed-area tables
+ * (see get_leaf_sums); a leaf w/o any valid pixels does not need to be
+ * summed at all.  With several bands the value of each is kept, and the
+ * SNR is the joint one used to split. */
+int add_leaf( dmnautilusContext *ctx, abinCount *count, abinLeafList *leaves, 
+              long xs, long ys, long xl, long yl,
+              short level, const abinStats *stats )
+{
+  abinLeaf *leaf;
+  float val = 0.0;
+  float noise = 0.0;
+  float zero = 0.0;
+  long area = 0;
+
+  if ( NULL == ( leaf = new_leaf( ctx, leaves ))) {
+    return(-1);
+  }
+  leaf->xs = xs;
+  leaf->ys = ys;
+  leaf->xl = xl;
+  leaf->yl = yl;
+  leaf->level = level;
+  if ( 1 == ctx->nbands ) {
+    if ( stats->npix > 0 ) {
+      get_leaf_sums( ctx, count, ctx->band, xs, ys, xl, yl, &val, &noise, &area );
+      leaf->snr = val / sqrt(noise);
+    } else {
+      leaf->snr = val / sqrt(zero);   /* NaN, same as summing nothing */
+    }
+  } else {
+    float *bandsum = leaves->bandsum + (leaves->nleaves-1)*ctx->nbands;
+    float snr = 0.0;
+    short bb;
+
+    for (bb=0; bb<ctx->nbands; bb++ ) {
+      float bval = 0.0;
+      float bnoise = 0.0;
+      if ( stats->npix > 0 ) {
+        get_leaf_sums( ctx, count, ctx->band+bb, xs, ys, xl, yl, &bval, &bnoise, &area );
+      }
+      bandsum[bb] = bval;
+      val += bval;
+      noise += bnoise;
+      if ( JOINT_SUM != ctx->joint ) {
+        float bsnr = bval / sqrt(bnoise);
+        snr = ( 0 == bb ) ? bsnr : get_joint_snr( ctx, snr, bsnr );
+      }
+    }
+    leaf->snr = ( JOINT_SUM == ctx->joint ) ? val / sqrt(noise) : snr;
+  }
+  leaf->sum = val;
+  leaf->val = val / area;
+  leaf->area = area;
+
+  return(0);
+}
+
+
+/* Make room for one more leaf at the end of the list */
+abinLeaf *new_leaf( dmnautilusContext *ctx, abinLeafList *leaves )
+{
+  if ( leaves->nleaves == leaves->maxleaves ) {
+    long nmax = ( leaves->maxleaves == 0 ) ? 64 : 2*leaves->maxleaves;
+    abinLeaf *more = (abinLeaf*)realloc( leaves->leaf, nmax*sizeof(abinLeaf));
+    if ( NULL == more ) {
+      leaves->status = -1;
+      return(NULL);
+    }
+    leaves->leaf = more;
+    if ( ctx->nbands > 1 ) {
+      float *bmore = (float*)realloc( leaves->bandsum, nmax*ctx->nbands*sizeof(float));
+      if ( NULL == bmore ) {
+        leaves->status = -1;
+        return(NULL);
+      }
+      leaves->bandsum = bmore;
+    }
+    leaves->maxleaves = nmax;
+  }
+
+  leaves->nleaves += 1;
+  return( &(leaves->leaf[leaves->nleaves-1]) );
+}
+
+
+/* Recursive binning routine.  Leaves are appended to the list in 
+ * depth-first order which is the order the mask numbers are assigned. */
+void abin_rec ( 
+        dmnautilusContext *ctx, /* i: context */
+        abinCount *count, /* i/o: work done */
+        long   xs,     /* i: start of x-axis (sub img) */
+        long   ys,     /* i: start of y-axis (sub img) */
+        long   xl,     /* i: length of x-axis (sub img) */
+        long   yl,     /* i: length of y-axis (sub img) */
+        short  level,  /* i: depth of the sub-image in the tree */
+        const abinStats *stats, /* i: statistics of the sub-image */
+        abinLeafList *leaves  /* o: leaves found */
+       )   
+{
+  short check;
+  abinStats sub[4];
+
+  check = split_sub_image( ctx, count, xs, ys, xl, yl, stats, sub );
+  if ( check < 0 ) {
+    leaves->status = -1;
+    return;
+  }
+
+  if ( check ) {
+    /* Enter recursion; see get_sub_stats() for the floor/ceil */
+        abin_rec( ctx, count, xs, ys, FLOOR(xl/2.0), FLOOR(yl/2.0), level+1, sub+0, leaves ); /* low-left */
+        abin_rec( ctx, count, xs+FLOOR(xl/2.0), ys, CEIL(xl/2.0), FLOOR(yl/2.0), level+1, sub+1, leaves ); /* low-rite*/
+        abin_rec( ctx, count, xs, ys+FLOOR(yl/2.0), FLOOR(xl/2.0), CEIL(yl/2.0), level+1, sub+2, leaves ); /* up-left */
+        abin_rec( ctx, count, xs+FLOOR(xl/2.0), ys+FLOOR(yl/2.0), CEIL(xl/2.0), CEIL(yl/2.0), level+1, sub+3, leaves); /* up-rite */
+        return; 
+  }
+
+  add_leaf( ctx, count, leaves, xs, ys, xl, yl, level, stats );
+  return;
+}
+
+
+/* Walk the top of the tree serially, same as abin_rec, but stop 'depth'
+ * levels down and save each sub-image as a task.  Sub-images that become
+ * leaves before then are also saved as (trivial) tasks.  The task list is
+ * thus in depth-first order and concatenating the leaves of each task in
+ * order gives exactly the serial leaf order. */
+static int make_tasks( dmnautilusContext *ctx, long xs, long ys, long xl, long yl, 
+                short level, const abinStats *stats, short depth, abinTaskList *tasks )
+{
+  short check = 0;
+  abinStats sub[4];
+
+  if ( depth > 0 ) {
+    check = split_sub_image( ctx, &(ctx->count), xs, ys, xl, yl, stats, sub );
+    if ( check < 0 ) {
+      return(-1);
+    }
+  }
+
+  if ( check ) {
+    if ( ( 0 != make_tasks( ctx, xs, ys, FLOOR(xl/2.0), FLOOR(yl/2.0), level+1, sub+0, depth-1, tasks )) ||
+         ( 0 != make_tasks( ctx, xs+FLOOR(xl/2.0), ys, CEIL(xl/2.0), FLOOR(yl/2.0), level+1, sub+1, depth-1, tasks )) ||
+         ( 0 != make_tasks( ctx, xs, ys+FLOOR(yl/2.0), FLOOR(xl/2.0), CEIL(yl/2.0), level+1, sub+2, depth-1, tasks )) ||
+         ( 0 != make_tasks( ctx, xs+FLOOR(xl/2.0), ys+FLOOR(yl/2.0), CEIL(xl/2.0), CEIL(yl/2.0), level+1, sub+3, depth-1, tasks ))) {
+      return(-1);
+    }
+    return(0);
+  }
+
+  if ( tasks->ntasks == tasks->maxtasks ) {
+    long nmax = ( tasks->maxtasks == 0 ) ? 64 : 2*tasks->maxtasks;
+    abinTask *more = (abinTask*)realloc( tasks->task, nmax*sizeof(abinTask));
+    if ( NULL == more ) {
+      return(-1);
+    }
+    tasks->task = more;
+    tasks->maxtasks = nmax;
+  }
+  memset( &(tasks->task[tasks->ntasks]), 0, sizeof(abinTask));
+  tasks->task[tasks->ntasks].xs = xs;
+  tasks->task[tasks->ntasks].ys = ys;
+  tasks->task[tasks->ntasks].xl = xl;
+  tasks->task[tasks->ntasks].yl = yl;
+  tasks->task[tasks->ntasks].stats = *stats;
+  tasks->task[tasks->ntasks].level = level;
+  tasks->task[tasks->ntasks].is_leaf = ( depth > 0 );
+  tasks->ntasks += 1;
+
+  return(0);
+}
+
+
+int add_node( abinNodeList *list, long xs, long ys, long xl, long yl,
+              short level, const abinStats *stats, unsigned long long path )
+{
+  abinNode *node;
+
+  if ( list->nnodes == list->maxnodes ) {
+    long nmax = ( list->maxnodes == 0 ) ? 64 : 2*list->maxnodes;
+    abinNode *more = (abinNode*)realloc( list->node, nmax*sizeof(abinNode));
+    if ( NULL == more ) {
+      return(-1);
+    }
+    list->node = more;
+    list->maxnodes = nmax;
+  }
+
+  node = &(list->node[list->nnodes]);
+  node->xs = xs;
+  node->ys = ys;
+  node->xl = xl;
+  node->yl = yl;
+  node->stats = *stats;
+  node->path = path;
+  node->level = level;
+  node->prev = NULL;
+  node->nprev = 0;
+  node->subtree = 0;
+  list->nnodes += 1;
+
+  return(0);
+}
+
+
+static int compare_node_path( const void *aa, const void *bb )
+{
+  const abinNode *na = (const abinNode*)aa;
+  const abinNode *nb = (const abinNode*)bb;
+
+  if ( na->path < nb->path ) return(-1);
+  if ( na->path > nb->path ) return(1);
+  return(0);
+}
+
+
+/* Whether to split, for each combination of the sub-images above the
+ * threshold (bit 0 low-left, 1 low-rite, 2 up-left, 3 up-rite); the 
+ * same rules as split_sub_image() */
+static int make_split_table( dmnautilusContext *ctx, unsigned char *table )
+{
+  short bits;
+
+  for (bits=0; bits<16; bits++ ) {
+    short ill = ( bits & 1 ) ? 1 : 0;
+    short ilr = ( bits & 2 ) ? 1 : 0;
+    short iul = ( bits & 4 ) ? 1 : 0;
+    short iur = ( bits & 8 ) ? 1 : 0;
+
+    if ( ( ZERO_ABOVE == ctx->criteria ) || ( ONE_ABOVE == ctx->criteria ) ) {
+      /* ZERO_ABOVE does not look at the sub-images; see split_level */
+      table[bits] = ( ill + ilr + iul + iur ) > 0;
+    } else if ( TWO_ABOVE == ctx->criteria ) {
+      table[bits] = ( (ill && ilr ) || (ilr && iur ) || (iur && iul ) || (iul && ill ) );
+    } else if ( THREE_ABOVE == ctx->criteria ) {
+      table[bits] = ( ill + ilr + iul + iur ) >= 3;
+    } else if ( ALL_ABOVE == ctx->criteria ) {
+      table[bits] = ( ill + ilr + iul + iur ) == 4;
+    } else {
+      err_msg("This should not have happened, something's amiss");
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+
+/* Make every split decision for a level at once; the same as calling
+ * split_sub_image() for each node of the frontier.  The statistics of
+ * the sub-images of every node that can split are looked up in one
+ * pass over the frontier, then the decisions are made in a second pass
+ * over the flat arrays, w/ the criteria in the table rather than in 
+ * branches. */
+static int split_level( dmnautilusContext *ctx, const abinNodeList *cur, 
+                        const unsigned char *table, abinLevel *lev )
+{
+  float thresh = ctx->snr_thresh;
+  short zero = ( ZERO_ABOVE == ctx->criteria );
+  long nn;
+
+  if ( cur->nnodes > lev->maxnodes ) {
+    long nmax = ( cur->nnodes > 2*lev->maxnodes ) ? cur->nnodes : 2*lev->maxnodes;
+    abinStats *sub = (abinStats*)realloc( lev->sub, 4*nmax*sizeof(abinStats));
+    unsigned char *check;
+    if ( NULL == sub ) {
+      return(-1);
+    }
+    lev->sub = sub;
+    check = (unsigned char*)realloc( lev->check, nmax*sizeof(unsigned char));
+    if ( NULL == check ) {
+      return(-1);
+    }
+    lev->check = check;
+    lev->maxnodes = nmax;
+  }
+
+  /* Statistics.  A 1 pixel wide sub-image never splits.  With 
+   * ZERO_ABOVE they are only needed by the sub-images of a split. */
+  for (nn=0; nn<cur->nnodes; nn++ ) {
+    const abinNode *node = &(cur->node[nn]);
+    abinStats *sub = lev->sub + 4*nn;
+    if ( ( node->xl > 1 ) && ( node->yl > 1 ) &&
+         ( !zero || ( node->stats.snr > thresh ) ) ) {
+      get_sub_stats( ctx, &(ctx->count), node->xs, node->ys, node->xl, node->yl, sub );
+    } else {
+      memset( sub, 0, 4*sizeof(abinStats));
+      lev->check[nn] = 0;
+      continue;
+    }
+    lev->check[nn] = 1;
+  }
+
+  /* Decisions.  It is OK to split if a sub-image has no valid pixels,
+   * but not all of them. */
+  for (nn=0; nn<cur->nnodes; nn++ ) {
+    const abinStats *sub = lev->sub + 4*nn;
+    unsigned char bits = 
+      ( ( sub[0].snr >= thresh ) || ( 0 == sub[0].npix ) ) |
+      ( ( ( sub[1].snr >= thresh ) || ( 0 == sub[1].npix ) ) << 1 ) |
+      ( ( ( sub[2].snr >= thresh ) || ( 0 == sub[2].npix ) ) << 2 ) |
+      ( ( ( sub[3].snr >= thresh ) || ( 0 == sub[3].npix ) ) << 3 );
+    short some = ( sub[0].npix + sub[1].npix + sub[2].npix + sub[3].npix ) > 0;
+    lev->check[nn] = lev->check[nn] && ( zero || ( some && table[bits] ) );
+  }
+
+  return(0);
+}
+
+
+/* Level-synchronous traversal.  The frontier is a flat array of the 
+ * sub-images at the current level; every split decision for the level
+ * is made at once by split_level(), and the sub-images of those that
+ * split become the next frontier.  There is no recursion.
+ *
+ * The leaves are then sorted by quadrant path, which is the order the
+ * depth-first recursion finds them, and divided into ~ntarget tasks so
+ * their values can be summed in parallel. */
+static int make_level_tasks( dmnautilusContext *ctx, const abinStats *root, long ntarget, 
+                             abinTaskList *tasks, abinNodeList *leaves )
+{
+  abinNodeList frontier[2];
+  abinNodeList *cur, *next;
+  abinLevel lev;
+  unsigned char table[16];
+  short level;
+  long nn;
+  int retval = 0;
+
+  memset( frontier, 0, 2*sizeof(abinNodeList));
+  memset( &lev, 0, sizeof(abinLevel));
+  cur = &frontier[0];
+  next = &frontier[1];
+
+  if ( ( 0 != make_split_table( ctx, table )) ||
+       ( 0 != add_node( cur, 0, 0, ctx->xlen, ctx->ylen, 0, root, 0 )) ) {
+    return(-1);
+  }
+
+  for (level=0; ( 0 == retval ) && ( cur->nnodes > 0 ); level++ ) {
+    int shift = 2*(ABIN_MAX_LEVEL-1-level);
+    abinNodeList *swap;
+
+    next->nnodes = 0;
+    if ( 0 != split_level( ctx, cur, table, &lev )) {
+      retval = -1;
+      break;
+    }
+    for (nn=0; nn<cur->nnodes; nn++ ) {
+      abinNode *node = &(cur->node[nn]);
+      abinStats *sub = lev.sub + 4*nn;
+      short check = lev.check[nn];
+
+      if ( check && ( level >= ABIN_MAX_LEVEL ) ) {
+        err_msg("ERROR: The quad-tree is more than %d levels deep; use engine=depth\n",
+                ABIN_MAX_LEVEL );
+        retval = -1;
+        break;
+      }
+
+      if ( check ) {
+        /* Same sub-images, in the same order, as get_sub_stats() */
+        long hx = FLOOR(node->xl/2.0);
+        long hy = FLOOR(node->yl/2.0);
+        long cx = CEIL(node->xl/2.0);
+        long cy = CEIL(node->yl/2.0);
+        unsigned long long pp = node->path;
+        if ( ( 0 != add_node( next, node->xs, node->ys, hx, hy, level+1, sub+0, pp | (0ULL<<shift) )) || /* low-left */
+             ( 0 != add_node( next, node->xs+hx, node->ys, cx, hy, level+1, sub+1, pp | (1ULL<<shift) )) || /* low-rite*/
+             ( 0 != add_node( next, node->xs, node->ys+hy, hx, cy, level+1, sub+2, pp | (2ULL<<shift) )) || /* up-left */
+             ( 0 != add_node( next, node->xs+hx, node->ys+hy, cx, cy, level+1, sub+3, pp | (3ULL<<shift) ))) { /* up-rite */
+          retval = -1;
+          break;
+        }
+      } else {
+        if ( 0 != add_node( leaves, node->xs, node->ys, node->xl, node->yl,
+                            level, &(node->stats), node->path )) {
+          retval = -1;
+          break;
+        }
+      }
+    } // end for nn
+
+    swap = cur;
+    cur = next;
+    next = swap;
+  } // end for level
+
+  if ( frontier[0].node ) free( frontier[0].node );
+  if ( frontier[1].node ) free( frontier[1].node );
+  if ( lev.sub ) free( lev.sub );
+  if ( lev.check ) free( lev.check );
+  if ( 0 != retval ) {
+    return(retval);
+  }
+
+  qsort( leaves->node, leaves->nnodes, sizeof(abinNode), compare_node_path );
+
+  return( split_node_tasks( leaves, ntarget, tasks ));
+}
+
+
+/* Split a list of nodes, in depth-first order, into ~ntarget tasks */
+static int split_node_tasks( abinNodeList *nodes, long ntarget, abinTaskList *tasks )
+{
+  long kk, nper;
+
+  if ( ntarget > nodes->nnodes ) {
+    ntarget = nodes->nnodes;
+  }
+  nper = ( ntarget > 0 ) ? ( nodes->nnodes + ntarget - 1 ) / ntarget : 0;
+  tasks->task = (abinTask*)calloc( ( ntarget > 0 ) ? ntarget : 1, sizeof(abinTask));
+  if ( NULL == tasks->task ) {
+    return(-1);
+  }
+  tasks->maxtasks = ntarget;
+  for (kk=0; kk<nodes->nnodes; kk+=nper ) {
+    abinTask *task = &(tasks->task[tasks->ntasks]);
+    task->nodes = nodes->node + kk;
+    task->nnodes = ( kk+nper > nodes->nnodes ) ? nodes->nnodes-kk : nper;
+    tasks->ntasks += 1;
+  }
+
+  return(0);
+}
+
+
+/* Sum up the leaves found by the level engine for one task */
+static void run_leaf_task( dmnautilusContext *ctx, abinTask *task )
+{
+  long nn;
+
+  for (nn=0; nn<task->nnodes; nn++ ) {
+    abinNode *node = &(task->nodes[nn]);
+    add_leaf( ctx, &(task->count), &(task->leaves), node->xs, node->ys, node->xl, node->yl, 
+              node->level, &(node->stats) );
+  }
+}
+
+
+/* Traverse the sub-tree for one task */
+static void run_tree_task( dmnautilusContext *ctx, abinTask *task )
+{
+  if ( task->is_leaf ) {
+    add_leaf( ctx, &(task->count), &(task->leaves), task->xs, task->ys, task->xl, task->yl, 
+              task->level, &(task->stats) );
+  } else {
+    abin_rec( ctx, &(task->count), task->xs, task->ys, task->xl, task->yl, task->level, &(task->stats), &(task->leaves) );
+  }
+}
+
+
+/* Number of valid pixels in [xs,xe) x [ys,ye), from the pixel-count
+ * summed-area table; outside the box of valid pixels it is 0 w/o one.
+ * -1 if it is not known (the table was not made, eg w/ inbinfile). */
+long count_valid( dmnautilusContext *ctx, long xs, long ys, long xe, long ye )
+{
+  if ( ( xe <= ctx->vbox[0] ) || ( xs >= ctx->vbox[2] ) ||
+       ( ye <= ctx->vbox[1] ) || ( ys >= ctx->vbox[3] ) ) {
+    return(0);
+  }
+  if ( !ctx->have_counts ) {
+    return(-1);
+  }
+  return( ctx->sumpix[SAT_IDX(xe,ye)] - ctx->sumpix[SAT_IDX(xe,ys)] - 
+          ctx->sumpix[SAT_IDX(xs,ye)] + ctx->sumpix[SAT_IDX(xs,ys)] );
+}
+
+
+/* Threads pull the next task off the list until there are none left.
+ * The tasks are small compared to the list so this balances the load
+ * about as well as work-stealing would w/o the bookkeeping. */
+typedef struct {
+  dmnautilusContext *ctx;
+  abinTaskList *tasks;
+  void (*func)(dmnautilusContext *ctx, abinTask *task);
+  long next;
+  pthread_mutex_t lock;
+} abinTaskQueue;
+
+
+static void *run_task_queue( void *arg )
+{
+  abinTaskQueue *queue = (abinTaskQueue*)arg;
+
+  while (1) {
+    long at;
+    pthread_mutex_lock( &(queue->lock) );
+    at = queue->next;
+    queue->next += 1;
+    pthread_mutex_unlock( &(queue->lock) );
+
+    if ( at >= queue->tasks->ntasks ) {
+      break;
+    }
+    queue->func( queue->ctx, &(queue->tasks->task[at]) );
+  }
+  return(NULL);
+}
+
+
+/* Run func on each task using nthreads threads (main thread included) */
+int run_tasks( dmnautilusContext *ctx, abinTaskList *tasks, void (*func)(dmnautilusContext *ctx, abinTask *task), 
+               short nthreads )
+{
+  abinTaskQueue queue;
+  pthread_t *threads = NULL;
+  short ii, nstarted = 0;
+
+  queue.ctx = ctx;
+  queue.tasks = tasks;
+  queue.func = func;
+  queue.next = 0;
+  pthread_mutex_init( &(queue.lock), NULL );
+
+  if ( nthreads > 1 ) {
+    threads = (pthread_t*)calloc( nthreads-1, sizeof(pthread_t));
+  }
+  for (ii=0; threads && ii<nthreads-1; ii++) {
+    if ( 0 != pthread_create( &threads[ii], NULL, run_task_queue, &queue )) {
+      break;  /* Fewer threads is OK; main thread will finish the work */
+    }
+    nstarted++;
+  }
+
+  run_task_queue( &queue );
+
+  for (ii=0; ii<nstarted; ii++ ) {
+    pthread_join( threads[ii], NULL );
+  }
+  if (threads) free(threads);
+  pthread_mutex_destroy( &(queue.lock) );
+
+  return(0);
+}
+
+
+/* Run the quad-tree on the whole image.  The top few levels are walked
+ * serially to create ~16 tasks per thread; the tasks are traversed 
+ * in parallel.  Mask numbers are then assigned in task order so they are
+ * the same as the serial, depth-first order regardless of the number of
+ * threads.  With the LEVEL_SYNC engine the whole tree is walked first 
+ * and the tasks only sum up the leaves.  With the leaves of an earlier
+ * run (prev) the tree is walked with add_incr_nodes() instead, and the
+ * tasks only redo what changed.
+ *
+ * The leaves are left in the task list for make_output(); the caller
+ * must free_tasks() it. */
+int abin_tree( dmnautilusContext *ctx, short nthreads, dmnautilusEngine engine,
+               abinPrevTree *prev, abinTaskList *tasks )
+{
+  abinNodeList nodes;
+  abinStats root;
+  short depth = 0;
+  long ntarget = 16*nthreads;
+  long reach = 1;
+  long ii;
+  unsigned long mask_no = 0;
+  int retval = 0;
+
+  memset( tasks, 0, sizeof(abinTaskList));
+  memset( &nodes, 0, sizeof(abinNodeList));
+
+  if ( ( nthreads > 1 ) && ( DEPTH_FIRST == engine ) ) {
+    while ( reach < ntarget ) {
+      reach *= 4;
+      depth++;
+    }
+  }
+
+  get_stats( ctx, &(ctx->count), 0, 0, ctx->xlen, ctx->ylen, &root );
+  if ( prev ) {
+    prev->at = 0;
+    if ( ( 0 != add_incr_nodes( ctx, prev, 0, 0, ctx->xlen, ctx->ylen, 0, &root, &nodes )) ||
+         ( prev->at != prev->nleaves ) ) {
+      err_msg("ERROR: The previous table of bins does not match the quad-tree of infile\n");
+      retval = -1;
+    } else if ( 0 != split_node_tasks( &nodes, ( nthreads > 1 ) ? ntarget : 1, tasks )) {
+      err_msg("ERROR: Could not allocate memory\n");
+      retval = -1;
+    }
+  } else if ( LEVEL_SYNC == engine ) {
+    if ( 0 != make_level_tasks( ctx, &root, ( nthreads > 1 ) ? ntarget : 1, tasks, &nodes )) {
+      err_msg("ERROR: Problem traversing quad-tree\n");
+      retval = -1;
+    }
+  } else if ( 0 != make_tasks( ctx, 0, 0, ctx->xlen, ctx->ylen, 0, &root, depth, tasks )) {
+    err_msg("ERROR: Problem creating quad-tree tasks\n");
+    retval = -1;
+  }
+
+  if ( 0 == retval ) {
+    if ( prev ) {
+      run_tasks( ctx, tasks, run_incr_task, nthreads );
+    } else {
+      run_tasks( ctx, tasks, ( LEVEL_SYNC == engine ) ? run_leaf_task : run_tree_task, nthreads );
+    }
+
+    for (ii=0; ii<tasks->ntasks; ii++ ) {
+      if ( 0 != tasks->task[ii].leaves.status ) {
+        err_msg("ERROR: Problem traversing quad-tree\n");
+        retval = -1;
+        break;
+      }
+      tasks->task[ii].first_mask_no = mask_no+1;
+      mask_no += tasks->task[ii].leaves.nleaves;
+      tasks->task[ii].nodes = NULL;   /* freed below */
+    }
+    add_task_counts( ctx, tasks );
+  }
+
+  if ( nodes.node ) free( nodes.node );
+
+  return(retval);
+}
+
+
+void free_tasks( abinTaskList *tasks )
+{
+  long ii;
+
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    if ( tasks->task[ii].leaves.leaf ) free( tasks->task[ii].leaves.leaf );
+    if ( tasks->task[ii].leaves.bandsum ) free( tasks->task[ii].leaves.bandsum );
+  }
+  if ( tasks->task ) free( tasks->task );
+  memset( tasks, 0, sizeof(abinTaskList));
+}
+
+
+/* Add the work done by the tasks to the context's */
+void add_task_counts( dmnautilusContext *ctx, abinTaskList *tasks )
+{
+  long ii;
+
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    ctx->count.snr_calls += tasks->task[ii].count.snr_calls;
+    ctx->count.pixels += tasks->task[ii].count.pixels;
+  }
+}
@@ -0,0 +1,343 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <histlib.h>
+
+#include "dmn_private.h"
+
+
+/* outtreefile: every node of the quad-tree, a level at a time (see
+ * abinTree). */
+
+
+/* ------Prototypes ----------------------- */
+
+static const abinLeaf *next_tree_leaf( abinLeafCursor *cur );
+static int add_tree_nodes( dmnautilusContext *ctx, abinTree *tree, abinLeafCursor *cur, long xs, long ys, long xl, long yl, short level );
+static int make_tree( dmnautilusContext *ctx, abinTaskList *tasks, abinTree *tree );
+static void free_tree( abinTree *tree );
+
+
+/* ----------------------------- */
+
+
+/* The columns of outtreefile; the same as the table of bins where they
+ * are the same thing */
+static const char *tree_columns[] = { "LEVEL", "XS", "YS", "XL", "YL",
+   "SUM", "AREA", "SNR", "SPLIT", "CHILD", "MASK_NO", "X_LL", "Y_LL", "X_UR", "Y_UR" };
+#define NUM_TREE_COLUMNS  (sizeof(tree_columns)/sizeof(tree_columns[0]))
+
+
+static const abinLeaf *next_tree_leaf( abinLeafCursor *cur )
+{
+  while ( ( cur->task < cur->tasks->ntasks ) && 
+          ( cur->leaf >= cur->tasks->task[cur->task].leaves.nleaves ) ) {
+    cur->task++;
+    cur->leaf = 0;
+  }
+  if ( cur->task >= cur->tasks->ntasks ) {
+    return(NULL);
+  }
+  return( &(cur->tasks->task[cur->task].leaves.leaf[cur->leaf]) );
+}
+
+
+/* Rebuild the tree above the leaves, in depth-first order: a node is a
+ * leaf if it is the next one, otherwise it split the same way 
+ * abin_rec() does.  This works the same whichever engine (or a sweep,
+ * or the incremental traversal) made the leaves.  The SUM and AREA of a
+ * node that split are those of its 4 children added up, so they add up
+ * the same way all the way to the root; its SNR is the one from the
+ * summed-area tables that the split was decided on. */
+static int add_tree_nodes( dmnautilusContext *ctx, abinTree *tree, abinLeafCursor *cur, 
+                           long xs, long ys, long xl, long yl, short level )
+{
+  const abinLeaf *leaf = next_tree_leaf( cur );
+  abinLeaf *node;
+  abinStats stats;
+  long hx = xl/2;   /* FLOOR(xl/2.0); xl-hx is CEIL(xl/2.0) */
+  long hy = yl/2;
+  long child[4];
+  short kk;
+
+  if ( ( NULL == leaf ) || ( tree->nnodes == tree->levend[0] ) || 
+       ( level > ABIN_MAX_LEVEL ) ) {
+    return(-1);
+  }
+  node = tree->node + tree->nnodes;
+  node->xs = xs;
+  node->ys = ys;
+  node->xl = xl;
+  node->yl = yl;
+  node->level = level;
+
+  if ( ( leaf->xs == xs ) && ( leaf->ys == ys ) && ( leaf->xl == xl ) && ( leaf->yl == yl ) ) {
+    node->sum = leaf->sum;
+    node->val = leaf->val;
+    node->area = leaf->area;
+    node->snr = leaf->snr;
+    tree->mask_no[tree->nnodes] = ++(cur->mask_no);
+    tree->nnodes++;
+    cur->leaf++;
+    return(0);
+  }
+
+  if ( ( hx < 1 ) || ( hy < 1 ) ) {
+    return(-1);   /* the leaves are not a quad-tree of the image */
+  }
+  get_stats( ctx, &(ctx->count), xs, ys, xl, yl, &stats );
+  node->snr = stats.snr;
+  tree->mask_no[tree->nnodes] = 0;
+  tree->nnodes++;
+
+  /* lower-left, lower-right, upper-left, upper-right */
+  for (kk=0; kk<4; kk++ ) {
+    child[kk] = tree->nnodes;
+    if ( 0 != add_tree_nodes( ctx, tree, cur,
+                              ( kk & 1 ) ? xs+hx : xs, ( kk & 2 ) ? ys+hy : ys,
+                              ( kk & 1 ) ? xl-hx : hx, ( kk & 2 ) ? yl-hy : hy,
+                              level+1 )) {
+      return(-1);
+    }
+  }
+
+  node->sum = 0.0;
+  node->area = 0;
+  for (kk=0; kk<4; kk++ ) {
+    node->sum += tree->node[child[kk]].sum;
+    node->area += tree->node[child[kk]].area;
+  }
+  node->val = node->sum / node->area;
+  return(0);
+}
+
+
+/* All the nodes of the tree that made the leaves, in level order.  Each
+ * split turns one leaf into four, so there are (nleaves-1)/3 nodes that
+ * split.  The depth-first order of the rebuilt tree, kept within each 
+ * level, is the order a level-by-level traversal would find them in. */
+static int make_tree( dmnautilusContext *ctx, abinTaskList *tasks, abinTree *tree )
+{
+  abinLeafCursor cur;
+  abinLeaf *dfs;
+  unsigned long *dfs_mask;
+  long at[ABIN_MAX_LEVEL+1];
+  long nleaves = 0;
+  long ii;
+  short ll;
+
+  memset( tree, 0, sizeof(abinTree));
+  memset( &cur, 0, sizeof(abinLeafCursor));
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    nleaves += tasks->task[ii].leaves.nleaves;
+  }
+  if ( ( nleaves < 1 ) || ( 0 != ( nleaves-1 ) % 3 ) ) {
+    err_msg("ERROR: The bins are not a quad-tree of the image\n");
+    return(-1);
+  }
+  tree->levend[0] = nleaves + ( nleaves-1 )/3;   /* room, until counted */
+
+  dfs = (abinLeaf*)calloc( tree->levend[0], sizeof(abinLeaf));
+  dfs_mask = (unsigned long*)calloc( tree->levend[0], sizeof(unsigned long));
+  tree->node = (abinLeaf*)calloc( tree->levend[0], sizeof(abinLeaf));
+  tree->mask_no = (unsigned long*)calloc( tree->levend[0], sizeof(unsigned long));
+  if ( ( NULL == dfs ) || ( NULL == dfs_mask ) || ( NULL == tree->node ) || 
+       ( NULL == tree->mask_no ) ) {
+    if ( dfs ) free( dfs );
+    if ( dfs_mask ) free( dfs_mask );
+    free_tree( tree );
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+
+  /* Rebuild it depth-first into dfs, then sort it by level */
+  cur.tasks = tasks;
+  {
+    abinTree walk = *tree;
+    walk.node = dfs;
+    walk.mask_no = dfs_mask;
+    if ( ( 0 != add_tree_nodes( ctx, &walk, &cur, 0, 0, ctx->xlen, ctx->ylen, 0 )) ||
+         ( walk.nnodes != walk.levend[0] ) || ( NULL != next_tree_leaf( &cur ) ) ) {
+      free( dfs );
+      free( dfs_mask );
+      free_tree( tree );
+      err_msg("ERROR: The bins are not a quad-tree of the image\n");
+      return(-1);
+    }
+    tree->nnodes = walk.nnodes;
+  }
+
+  memset( tree->levend, 0, sizeof(tree->levend));
+  for (ii=0; ii<tree->nnodes; ii++ ) {
+    tree->levend[dfs[ii].level] += 1;
+    if ( dfs[ii].level >= tree->nlevels ) {
+      tree->nlevels = dfs[ii].level+1;
+    }
+  }
+  for (ll=0; ll<tree->nlevels; ll++ ) {
+    at[ll] = ( ll > 0 ) ? tree->levend[ll-1] : 0;
+    tree->levend[ll] += at[ll];
+  }
+  for (ii=0; ii<tree->nnodes; ii++ ) {
+    long kk = at[dfs[ii].level]++;
+    tree->node[kk] = dfs[ii];
+    tree->mask_no[kk] = dfs_mask[ii];
+  }
+
+  free( dfs );
+  free( dfs_mask );
+  return(0);
+}
+
+
+/* Write the tree, one row per node in level order.  CHILD is the row of
+ * the first of the 4 children of a node that split, so a viewer can go
+ * down from any node; reading the first LEVEND<n> rows gives the tree
+ * down to depth n, eg for a coarse preview. */
+int write_tree_table( dmnautilusContext *ctx, dmBlock *inBlock, abinTaskList *tasks,
+                      const char *treefile, const char *unit, short clobber )
+{
+  abinTree tree;
+  abinTaskList all;
+  abinTask one;
+  abinCorners corners;
+  dmBlock *outBlock;
+  dmDescriptor *cols[NUM_TREE_COLUMNS];
+  long nsplit[ABIN_MAX_LEVEL+1];
+  double snr;
+  long method;
+  long nlevels;
+  long ii;
+  short ll;
+
+  if ( 0 != make_tree( ctx, tasks, &tree ) ) {
+    return(-1);
+  }
+
+  /* One task that is all of the nodes; nothing to free */
+  memset( &one, 0, sizeof(abinTask));
+  one.leaves.leaf = tree.node;
+  one.leaves.nleaves = tree.nnodes;
+  all.task = &one;
+  all.ntasks = 1;
+  all.maxtasks = 1;
+  if ( 0 != make_corners( ctx, &all, &corners ) ) {
+    free_tree( &tree );
+    return(-1);
+  }
+
+  pthread_mutex_lock( &dm_lock );
+
+  if ( ds_clobber( (char*)treefile, clobber, NULL) != 0 ) {
+    pthread_mutex_unlock( &dm_lock );
+    free_corners( &corners );
+    free_tree( &tree );
+    return(-1);
+  }
+
+  outBlock = dmTableCreate( treefile );
+  if ( outBlock == NULL ) {
+    pthread_mutex_unlock( &dm_lock );
+    free_corners( &corners );
+    free_tree( &tree );
+    err_msg("ERROR: Could not create output '%s'\n", treefile);
+    return(-1);
+  }
+  dmBlockCopy( inBlock, outBlock, "HEADER"); 
+  ds_copy_full_header( inBlock, outBlock, "dmnautilus", 0 );
+  put_param_hist_info( outBlock, "dmnautilus", NULL, 0 );
+  dmKeyWrite_l( outBlock, "XLEN", &(ctx->xlen), "pixels", "Length of image x-axis" );
+  dmKeyWrite_l( outBlock, "YLEN", &(ctx->ylen), "pixels", "Length of image y-axis" );
+  snr = ctx->snr_thresh;
+  method = ctx->criteria;
+  dmKeyWrite_d( outBlock, "SNR", &snr, NULL, "SNR threshold" );
+  dmKeyWrite_l( outBlock, "METHOD", &method, NULL, "Sub-images required above threshold" );
+  nlevels = tree.nlevels;
+  dmKeyWrite_l( outBlock, "NLEVELS", &nlevels, NULL, "Number of levels in the tree" );
+  for (ll=0; ll<tree.nlevels; ll++ ) {
+    char key[16];
+    sprintf( key, "LEVEND%d", ll );
+    dmKeyWrite_l( outBlock, key, &(tree.levend[ll]), NULL, "Rows through this level" );
+  }
+
+  cols[0] = dmColumnCreate( outBlock, tree_columns[0], dmSHORT, 0, NULL, "Depth in the tree; the image is 0" );
+  cols[1] = dmColumnCreate( outBlock, tree_columns[1], dmLONG, 0, "pixel", "Start of x-axis" );
+  cols[2] = dmColumnCreate( outBlock, tree_columns[2], dmLONG, 0, "pixel", "Start of y-axis" );
+  cols[3] = dmColumnCreate( outBlock, tree_columns[3], dmLONG, 0, "pixel", "Length of x-axis" );
+  cols[4] = dmColumnCreate( outBlock, tree_columns[4], dmLONG, 0, "pixel", "Length of y-axis" );
+  cols[5] = dmColumnCreate( outBlock, tree_columns[5], dmFLOAT, 0, ( unit && *unit ) ? unit : NULL, "Sum of pixel values" );
+  cols[6] = dmColumnCreate( outBlock, tree_columns[6], dmLONG, 0, "pixels", "Number of valid pixels" );
+  cols[7] = dmColumnCreate( outBlock, tree_columns[7], dmFLOAT, 0, NULL, "Signal to noise ratio" );
+  cols[8] = dmColumnCreate( outBlock, tree_columns[8], dmSHORT, 0, NULL, "1 if the node split, 0 for a bin" );
+  cols[9] = dmColumnCreate( outBlock, tree_columns[9], dmLONG, 0, NULL, "Row of the first child; 0 for a bin" );
+  cols[10] = dmColumnCreate( outBlock, tree_columns[10], dmLONG, 0, NULL, "Mask (group) number of a bin; 0 if it split" );
+  cols[11] = dmColumnCreate( outBlock, tree_columns[11], dmDOUBLE, 0, NULL, "Lower-left x (physical)" );
+  cols[12] = dmColumnCreate( outBlock, tree_columns[12], dmDOUBLE, 0, NULL, "Lower-left y (physical)" );
+  cols[13] = dmColumnCreate( outBlock, tree_columns[13], dmDOUBLE, 0, NULL, "Upper-right x (physical)" );
+  cols[14] = dmColumnCreate( outBlock, tree_columns[14], dmDOUBLE, 0, NULL, "Upper-right y (physical)" );
+
+  memset( nsplit, 0, sizeof(nsplit));
+  for (ii=0; ii<tree.nnodes; ii++ ) {
+    abinLeaf *node = tree.node + ii;
+    short split = ( 0 == tree.mask_no[ii] );
+    long child = 0;
+
+    if ( split ) {
+      /* 1-based row: the next level starts after levend[level] */
+      child = tree.levend[node->level] + 4*nsplit[node->level] + 1;
+      nsplit[node->level] += 1;
+    }
+    dmSetScalar_s( cols[0], node->level );
+    dmSetScalar_l( cols[1], node->xs+1 );
+    dmSetScalar_l( cols[2], node->ys+1 );
+    dmSetScalar_l( cols[3], node->xl );
+    dmSetScalar_l( cols[4], node->yl );
+    dmSetScalar_f( cols[5], node->sum );
+    dmSetScalar_l( cols[6], node->area );
+    dmSetScalar_f( cols[7], node->snr );
+    dmSetScalar_s( cols[8], split );
+    dmSetScalar_l( cols[9], child );
+    dmSetScalar_l( cols[10], tree.mask_no[ii] );
+    dmSetScalar_d( cols[11], corners.xx[2*ii] );
+    dmSetScalar_d( cols[12], corners.yy[2*ii] );
+    dmSetScalar_d( cols[13], corners.xx[2*ii+1] );
+    dmSetScalar_d( cols[14], corners.yy[2*ii+1] );
+    dmTableNextRow( outBlock );
+  }
+
+  dmTableClose( outBlock );
+  pthread_mutex_unlock( &dm_lock );
+  free_corners( &corners );
+  free_tree( &tree );
+  return(0);
+}
+
+
+static void free_tree( abinTree *tree )
+{
+  if ( tree->node ) free( tree->node );
+  if ( tree->mask_no ) free( tree->mask_no );
+  memset( tree, 0, sizeof(abinTree));
+}
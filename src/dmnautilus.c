@@ -21,566 +21,888 @@
 
 
 
-#include <dslib.h>
-#include <ascdm.h>
+
 #include <stdlib.h>
 #include <math.h>
-#include <histlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include <cxcregion.h>
-#include <dsnan.h>
-
-#define FLOOR(x)  floor((x))
-#define CEIL(x)   ceil((x))
-
-regRegion *maskRegion;
-
 
-/* Okay, global variables are a bad idea, excpet when doing recursion and
- * we are passing the same data to each level ... more data gets pushed on the
- * stack and causes crashes.  Also using global variables can make it
- * run much faster so we'll bite the bullet here. */
-void  *GlobalData;     /* i: data array */
-float *GlobalDErr;     /* i: error array */
-float *GlobalOutData;  /* o: output array */
-float *GlobalOutArea;  /* o: output area array */
-float *GlobalOutSNR;   /* o: output SNR */
-unsigned long *GlobalMask; /* o: output mask */
-long GlobalXLen;        /* i: length of x-axis (full img) */
-long GlobalYLen;        /* i: length of y-axis (full img) */
-long GlobalLAxes[2];    /* X,Y lens togeether */
-float GlobalSNRThresh;   /* i: SNR threshold */
-enum { ZERO_ABOVE=0, ONE_ABOVE, TWO_ABOVE, THREE_ABOVE, ALL_ABOVE} GlobalSplitCriteria;
-dmDataType GlobalDataType;
-dmDescriptor *GlobalXdesc=NULL;
-dmDescriptor *GlobalYdesc=NULL;
-short *GlobalPixMask=NULL;
+#include "dmn_private.h"
 
 
-/* Using the dmtools/dmimgio routines removes lots of duplicate code that was
- * originally here.  Also allow us to keep track of NULL/NaN value pixels
- * more easily
- */
-#include "dmimgio.h"
-
+/* The DM, region, and WCS libraries are not thread safe.  Contexts may
+ * be run at the same time in different threads (eg batch mode), so all
+ * calls into them go through this lock; only the binning itself runs
+ * concurrently. */
+pthread_mutex_t dm_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* ------Prototypes ----------------------- */
 
-int load_error_image( char *errimg );
-int abin(void);
-double get_snr(long xs, long ys, long xl ,long yl, float *oval, long *area);
-void abin_rec ( long xs, long ys, long xl, long yl);   
-int convert_coords( dmDescriptor *xdesc, dmDescriptor *ydesc, double xx, double yy, double *xat, double *yat);
+static void clear_image( dmnautilusContext *ctx );
+static void free_band_data( dmnautilusContext *ctx );
+static int set_criteria( dmnautilusContext *ctx, dmnautilusParams *params );
+static int setup_bands( dmnautilusContext *ctx, dmnautilusInput *input, dmnautilusParams *params );
+static int check_band_outputs( dmnautilusContext *ctx, dmnautilusOutputs *outputs );
+static int open_infile( dmnautilusContext *ctx, dmnautilusInput *input, dmBlock **inBlock, char *unit );
+static int prepare_tables( dmnautilusContext *ctx, dmnautilusInput *input, abinClock *clock );
+static int write_products( dmnautilusContext *ctx, abinTaskList *tasks, short nthreads, dmBlock *inBlock, const char *unit, dmnautilusOutputs *outputs, short clobber, abinClock *clock );
+static void count_leaves( dmnautilusContext *ctx, abinTaskList *tasks );
+static void end_stats( dmnautilusContext *ctx );
+static int set_arrays( dmnautilusContext *ctx, const dmnautilusArrays *arrays );
+static int fill_arrays( dmnautilusContext *ctx, abinTaskList *tasks, short nthreads, dmnautilusArrayOutputs *outputs );
+static void mark_time( abinClock *clock, double *wall, double *cpu );
 
 
 /* ----------------------------- */
 
 
-int convert_coords( dmDescriptor *xdesc,
-                    dmDescriptor *ydesc,
-                    double xx,  /*Note: Using double rather than long here! */
-                    double yy, /* */
-                    double *xat,
-                    double *yat
-                    )
+/* Release everything that belongs to the current image (not the
+ * reusable buffers) */
+static void clear_image( dmnautilusContext *ctx )
 {
-  if ( xdesc ) {
-    double lgc[2];
-    double phy[2];
-    lgc[0] = xx+1;
-    lgc[1] = yy+1;
-    dmCoordCalc_d( xdesc, lgc, phy );
-    if ( ydesc ) {
-      dmCoordCalc_d( ydesc, lgc+1, phy+1 );
-    }
-    *xat = phy[0];
-    *yat = phy[1];
-  } else {
-    *xat = xx;
-    *yat = yy;
+  short bb;
+
+  for (bb=0; bb<ctx->maxbands; bb++ ) {
+    abinBand *band = ctx->band+bb;
+    if ( band->data && !ctx->borrowed ) free( band->data );
+    if ( band->dplane ) free( band->dplane );
+    band->data = NULL;
+    band->kdata = NULL;
+    band->dplane = NULL;
   }
-  return(0);
+  if ( ctx->pixmask && !ctx->borrowed_mask ) free( ctx->pixmask );
+  ctx->pixmask = NULL;
+  ctx->borrowed = 0;
+  ctx->borrowed_mask = 0;
+  ctx->tilemask = NULL;
+  ctx->tiled = 0;
+  ctx->have_counts = 0;
+  ctx->xdesc = NULL;
+  ctx->ydesc = NULL;
 }
 
 
-/* Compute the signal to noise ratio in the sub-image.  Also returns the
- * sum of the pixel values and the area (number of non-null pixels) */
-double get_snr( 
-        long   xs,     /* i: start of x-axis (sub img) */
-        long   ys,     /* i: start of y-axis (sub img) */
-        long   xl,     /* i: length of x-axis (sub img) */
-        long   yl,      /* i: length of y-axis (sub img) */
-        float  *oval,   /* o: sum of pixel values */
-        long   *area    /* o: number of pixels */
-  )
+/* Fill in the leaf counts and sizes and the depth of the tree */
+static void count_leaves( dmnautilusContext *ctx, abinTaskList *tasks )
 {
-  
-  float val;
-  float noise;
-  float locsnr;
-  long ii,jj;
-  double pixval;
-
-  val = 0.0;
-  noise = 0.0;
-  *area = 0;
-
-  /* Determine SNR for current sub-image */
-  for (ii=xs; ii<(xl+xs); ii++ ) {
-      if ( ii >= GlobalXLen ) {
-        continue; 
+  dmnautilusStats *stats = &(ctx->stats);
+  long ii, nn;
+
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    for (nn=0; nn<tasks->task[ii].leaves.nleaves; nn++) {
+      abinLeaf *leaf = &(tasks->task[ii].leaves.leaf[nn]);
+      long side = ( leaf->xl > leaf->yl ) ? leaf->xl : leaf->yl;
+      short bin = 0;
+
+      while ( ( side > 1 ) && ( bin < DMNAUTILUS_NUM_SIZES-1 ) ) {
+        side /= 2;
+        bin++;
       }
-    for (jj=ys; jj<(yl+ys); jj++) {
-      long pix;
-      if ( jj >= GlobalYLen ) {
-        continue; 
+      stats->leaf_sizes[bin] += 1;
+      stats->leaves += 1;
+      if ( leaf->level > stats->max_depth ) {
+        stats->max_depth = leaf->level;
       }
-      pix = ii+(jj*GlobalXLen);
+    }
+  }
+}
 
 
-      pixval = get_image_value( GlobalData, GlobalDataType, ii, jj,
-          GlobalLAxes, GlobalPixMask);
-      if ( ds_dNAN(pixval) ) {          
-          continue;
-      }
-      val += pixval;
-      noise += ( GlobalDErr[pix] * GlobalDErr[pix] );
-      *area += 1;
-
+/* Copy the work done into the stats, and the peak memory use */
+static void end_stats( dmnautilusContext *ctx )
+{
+  struct rusage usage;
 
-    }
+  ctx->stats.snr_calls = ctx->count.snr_calls;
+  ctx->stats.pixels = ctx->count.pixels;
+  if ( 0 == getrusage( RUSAGE_SELF, &usage ) ) {
+    ctx->stats.peak_rss = usage.ru_maxrss;
   }
-  locsnr = val / sqrt(noise);
-  *oval = val;
+}
+
 
-  return locsnr;
+/* Add the time since the start of the phase to *wall and *cpu and
+ * start the next phase */
+static void mark_time( abinClock *clock, double *wall, double *cpu )
+{
+  struct timespec ts;
+  double now_wall, now_cpu;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  now_wall = ts.tv_sec + 1.0e-9*ts.tv_nsec;
+  clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts );
+  now_cpu = ts.tv_sec + 1.0e-9*ts.tv_nsec;
+  if ( wall ) {
+    *wall += now_wall - clock->wall;
+    *cpu += now_cpu - clock->cpu;
+  }
+  clock->wall = now_wall;
+  clock->cpu = now_cpu;
 }
 
 
+/* ----- Public API ---------------------------- */
 
 
-/* Recursive binning routine */
-void abin_rec ( 
-        long   xs,     /* i: start of x-axis (sub img) */
-        long   ys,     /* i: start of y-axis (sub img) */
-        long   xl,     /* i: length of x-axis (sub img) */
-        long   yl      /* i: length of y-axis (sub img) */
-       )   
-{
-  
-  static unsigned long mask_no; /* keep as static to avoid yet another
-                   param to function; gets updated for
-                   each recursive call.  Could make this a global value too.*/
-
-  
-  short check = 0;
-
-  if ( ZERO_ABOVE == GlobalSplitCriteria ) {
-      /* This is the original method -- if the current block is above SNR
-       * then split it. */
-      float at, oval;
-      long npix;  
-      at = get_snr( xs, ys, xl, yl , &oval, &npix );
-      check = ( at > GlobalSNRThresh );
 
-  } else {
-      /* Determine SNR for current sub-image */
-
-      /* This new method will only split the 2x2 if when the sub images
-       * are created, some/all of them will remain above the SNR limit.
-       * 
-       */
-      
-      float ll, lr, ul, ur;
-      float oval_ll, oval_lr, oval_ul, oval_ur;
-      long npix_ll, npix_lr, npix_ul, npix_ur;
-
-      short ill, ilr, iul, iur;
-
-      ll = get_snr( xs, ys, FLOOR(xl/2.0), FLOOR(yl/2.0), &oval_ll, &npix_ll ); /* low-left */
-      lr = get_snr( xs+FLOOR(xl/2.0), ys, CEIL(xl/2.0), FLOOR(yl/2.0), &oval_lr, &npix_lr ); /* low-rite*/
-      ul = get_snr( xs, ys+FLOOR(yl/2.0), FLOOR(xl/2.0), CEIL(yl/2.0), &oval_ul, &npix_ul); /* up-left */
-      ur = get_snr( xs+FLOOR(xl/2.0), ys+FLOOR(yl/2.0), CEIL(xl/2.0), CEIL(yl/2.0), &oval_ur, &npix_ur ); /* up-rite */
-
-      /*
-       * It is OK to split if sub-cell has no valid pixel; but not all of them.
-       */       
-      ill = ( ll >= GlobalSNRThresh) || ( npix_ll == 0);  
-      ilr = ( lr >= GlobalSNRThresh) || ( npix_lr == 0);
-      iul = ( ul >= GlobalSNRThresh) || ( npix_ul == 0);
-      iur = ( ur >= GlobalSNRThresh) || ( npix_ur == 0);
-
-      /* If there are no pixels, no reason to recurse */
-      if ((npix_ll+npix_lr+npix_ul+npix_ur) ==0 ) {
-          check =0; 
-
-      } else if ( ONE_ABOVE == GlobalSplitCriteria ) {
-          /* If any one of the sub images is above snr, then split */
-          check = ( ill + ilr + iul + iur  );            
-
-      } else if ( TWO_ABOVE == GlobalSplitCriteria ) {
-          /* If two, then they have to be side-by side, not diagonal */
-         check = ( (ill && ilr ) || 
-                   (ilr && iur ) ||
-                   (iur && iul ) ||
-                   (iul && ill )
-                  ); 
-
-      } else if ( THREE_ABOVE == GlobalSplitCriteria ) {
-          check = ( ill + ilr + iul + iur ) >= 3 ? 1 : 0;
-
-      } else if ( ALL_ABOVE == GlobalSplitCriteria ) {
-          check = ( ill + ilr + iul + iur ) == 4 ? 1 : 0;
+dmnautilusContext *dmnautilus_context_new( void )
+{
+  dmnautilusContext *ctx;
+  ctx = (dmnautilusContext*)calloc( 1, sizeof(dmnautilusContext));
+  return(ctx);
+}
 
-      } else {
-          err_msg("This should not have happened, something's amiss");
-          return;
-      }
 
-  } // end else 
-
-  
-  if (( check )&&(xl>1)&&(yl>1)) {
-    /* Enter recursion */
-
-    /* need to use floor() and ceil() because input image may
-       not be square, or 2^n.  This will bias the left-upper image w/ 1 more 
-       pixel per bin; but that's a limit of not using square images.
-       The alternative is only use square smallest sub-image or pad image to 2**N.*/
-        abin_rec( xs, ys, FLOOR(xl/2.0), FLOOR(yl/2.0) ); /* low-left */
-        abin_rec( xs+FLOOR(xl/2.0), ys, CEIL(xl/2.0), FLOOR(yl/2.0) ); /* low-rite*/
-        abin_rec( xs, ys+FLOOR(yl/2.0), FLOOR(xl/2.0), CEIL(yl/2.0) ); /* up-left */
-        abin_rec( xs+FLOOR(xl/2.0), ys+FLOOR(yl/2.0), CEIL(xl/2.0), CEIL(yl/2.0)); /* up-rite */
-        return; 
-    }
-      
-    float locsnr;
-    long ii,jj;
-    float val;
-    long area;
-    double pixval;
+void dmnautilus_context_free( dmnautilusContext *ctx )
+{
+  short bb;
 
-    locsnr = get_snr( xs, ys, xl, yl, &val, &area );
+  if ( NULL == ctx ) {
+    return;
+  }
+  dmnautilus_unload( ctx );
+  for (bb=0; bb<ctx->maxbands; bb++ ) {
+    free_buffer( &(ctx->band[bb].varbuf) );
+    free_buffer( &(ctx->band[bb].tilebuf[0]) );
+    free_buffer( &(ctx->band[bb].tilebuf[1]) );
+    free_buffer( &(ctx->sat[bb].buf[0]) );
+    free_buffer( &(ctx->sat[bb].buf[1]) );
+  }
+  if (ctx->band) free(ctx->band);
+  if (ctx->sat) free(ctx->sat);
+  free_buffer( &(ctx->planes[0]) );
+  free_buffer( &(ctx->planes[1]) );
+  free_buffer( &(ctx->pixbuf) );
+  free_buffer( &(ctx->tilemaskbuf) );
+  if (ctx->row) free(ctx->row);
+  if (ctx->vrow) free(ctx->vrow);
+  free(ctx);
+}
 
-    val /= area;
 
-    mask_no += 1; /* statically increases per bin */
+/* The split criteria and the output compression; these are all that
+ * changes between dmnautilus_rebin() calls */
+static int set_criteria( dmnautilusContext *ctx, dmnautilusParams *params )
+{
+  if ( ( params->method < ZERO_ABOVE ) || ( params->method > ALL_ABOVE ) ) {
+    err_msg("Invalid method parameter value");
+    return(-1);
+  }
+  if ( ( params->engine != DEPTH_FIRST ) && ( params->engine != LEVEL_SYNC ) ) {
+    err_msg("Invalid engine parameter value");
+    return(-1);
+  }
+  if ( ( params->layout != LAYOUT_ROW ) && ( params->layout != LAYOUT_TILE ) ) {
+    err_msg("Invalid layout parameter value");
+    return(-1);
+  }
+  if ( ( params->compress < COMPRESS_NONE ) || ( params->compress > COMPRESS_GZIP ) ) {
+    err_msg("Invalid compress parameter value");
+    return(-1);
+  }
+  if ( ( params->masktype < MASK_ULONG ) || ( params->masktype > MASK_AUTO ) ) {
+    err_msg("Invalid masktype parameter value");
+    return(-1);
+  }
+  ctx->criteria = params->method;
+  ctx->compress = params->compress;
+  ctx->masktype = params->masktype;
+  ctx->snr_thresh = params->snr;
+  return(0);
+}
 
-    /* store output values */
-    for (ii=xs; ii<xs+xl; ii++ ) {
-      if ( ii >= GlobalXLen ) { /* shouldn't be needed anymore */
-      continue; 
-      }
-      for (jj=ys; jj<ys+yl; jj++) {
-      long pix;
 
-      if ( jj >= GlobalYLen ) { /* shouldn't be needed anymore */
-        continue; 
-      }
+/* Size the per-band state for infile plus input->bands */
+static int setup_bands( dmnautilusContext *ctx, dmnautilusInput *input, 
+                        dmnautilusParams *params )
+{
+  short nbands;
 
-    pix = ii+(jj*GlobalXLen);
+  nbands = 1 + ( input->bands ? input->nbands : 0 );
+  if ( nbands > 1 ) {
+    if ( ( params->joint < JOINT_SUM ) || ( params->joint > JOINT_ANY ) ) {
+      err_msg("Invalid joint parameter value");
+      return(-1);
+    }
+    if ( want_output( input->binfile ) ) {
+      err_msg("ERROR: A table of bins can only be expanded for one band\n");
+      return(-1);
+    }
+  }
+  if ( 0 != alloc_bands( ctx, nbands ) ) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+  ctx->joint = params->joint;
+  ctx->nsat = ( ( nbands > 1 ) && ( JOINT_SUM != params->joint ) ) ? nbands : 1;
+  return(0);
+}
 
-      pixval = get_image_value( GlobalData, GlobalDataType, ii, jj,
-          GlobalLAxes, GlobalPixMask);
 
-      if ( ds_dNAN(pixval) ) {
-        GlobalOutData[pix] = pixval;
-        GlobalOutArea[pix] = pixval;
-        GlobalMask[pix] = 0;
-        GlobalOutSNR[pix] = pixval;
-      } else {
-        GlobalOutData[pix] = val;
-        GlobalOutArea[pix] = area;
-        GlobalMask[pix] = mask_no;
-        GlobalOutSNR[pix] = locsnr;
-      }
-      
-     } // end for jj
-    } // end for ii
-
-    /*   
-     * The original hacky way to use the Cdelt[]'s doesn't work. There are 
-     * cases where the regions overlap which is bad.
-     * 
-     * So instead of using a box, we use a rectangle since the
-     * edge points are explicitly specified.
-     * 
-    */
-
-    double regx[2], regy[2];
-
-    /* Need the minus 0.5 since pixels are assumed to be cenetered on integer values */
-    convert_coords( GlobalXdesc,GlobalYdesc, xs-0.5, ys-0.5, regx+0, regy+0);
-    convert_coords( GlobalXdesc,GlobalYdesc, xs+xl-0.5, ys+yl-0.5, regx+1, regy+1);
-    
-    
-    regAppendShape( maskRegion, "Rectangle", 1, 1, regx, regy,
-            1, NULL, NULL, 0, 0 );
+static int check_band_outputs( dmnautilusContext *ctx, dmnautilusOutputs *outputs )
+{
+  short bb;
 
-    return;
+  for (bb=1; bb<ctx->nbands; bb++ ) {
+    if ( ( NULL == outputs->bandoutfiles ) || !want_output( outputs->bandoutfiles[bb-1] ) ) {
+      err_msg("ERROR: Need an output file for each band\n");
+      return(-1);
+    }
+  }
+  return(0);
 }
 
 
+/* Read infile and the other bands.  *inBlock is left open for the 
+ * output headers; it is NULL if infile could not be opened at all. */
+static int open_infile( dmnautilusContext *ctx, dmnautilusInput *input, 
+                        dmBlock **inBlock, char *unit )
+{
+  long *lAxes=NULL;
+  regRegion *dss=NULL;
+  char *infile;
+  long null;
+  short has_null;
+  short bb;
+  int retval = 0;
 
-int load_error_image( char *errimg ) {
-    
-  /* Read Error Image */
-  unsigned long npix = GlobalXLen*GlobalYLen;
+  *inBlock = NULL;
+  if ( NULL == ( infile = get_infile_name( input->infile, input->binspec ))) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+  pthread_mutex_lock( &dm_lock );
+  *inBlock = dmImageOpen( infile );
+  if ( !*inBlock ) {
+    pthread_mutex_unlock( &dm_lock );
+    if ( want_output( input->binspec ) ) {
+      err_msg("ERROR: Could not open infile='%s'\n", infile );
+    } else {
+      err_msg("ERROR: Could not open infile='%s' (set binspec if it is an event list)\n", 
+              infile );
+    }
+    free( infile );
+    return(-1);
+  }
+  free( infile );
 
-  if ( ( strlen(errimg) == 0 ) ||
-       ( ds_strcmp_cis(errimg,"none" ) == 0 ) ) {
+  memset( unit, 0, DS_SZ_KEYWORD) ;
 
-     double pixval;
-     long xx,yy,jj;    
+  ctx->band[0].datatype = get_image_data( *inBlock, &(ctx->band[0].data), &lAxes, &dss, 
+                                          &null, &has_null );
+  get_image_wcs( *inBlock, &(ctx->xdesc), &(ctx->ydesc) );
+  ctx->pixmask = get_image_mask( *inBlock, ctx->band[0].data, ctx->band[0].datatype, lAxes, 
+                                 dss, null, has_null, ctx->xdesc, ctx->ydesc );
+  ctx->have_counts = 0;
+  dmGetUnit( dmImageGetDataDescriptor(*inBlock),unit, DS_SZ_KEYWORD );
+  pthread_mutex_unlock( &dm_lock );
 
-     for (yy=0; yy<GlobalYLen; yy++) {
-        for ( xx=0;xx<GlobalXLen;xx++) {
+  if ( ( lAxes[0]*lAxes[1] ) == 0 ) {
+    err_msg("ERROR: Image is empty (one axis is 0 length)\n");
+    retval = -1;
+  } else {
+    ctx->lAxes[0] = ctx->xlen = lAxes[0];
+    ctx->lAxes[1] = ctx->ylen = lAxes[1];
+  }
+  free( lAxes );
+  if ( dss ) regFree( dss );
+  for (bb=1; ( 0 == retval ) && ( bb<ctx->nbands ); bb++ ) {
+    retval = load_band( ctx, ctx->band+bb, input->bands[bb-1].infile, input->binspec );
+  }
+  return(retval);
+}
 
-            jj = xx + yy*GlobalXLen;
-           pixval = get_image_value( GlobalData, GlobalDataType, xx,yy,
-                    GlobalLAxes, GlobalPixMask);
 
-            if (ds_dNAN(pixval) ) {
-                GlobalDErr[jj] = 0;
-            } else {
-                GlobalDErr[jj] = sqrt(pixval);  // assumes Gaussian stats
-            }
-        
-       }  // end xx
-     } // end yy
+/* Work buffers, pixel kernels, and the error images; everything the
+ * summed-area tables need */
+static int prepare_tables( dmnautilusContext *ctx, dmnautilusInput *input, abinClock *clock )
+{
+  short bb;
+  int retval = 0;
 
-  } else {
-    long enAxes;
-    long *elAxes;
-    dmDescriptor *errDs;
-    dmBlock *erBlock;
-
-    erBlock = dmImageOpen( errimg );
-    if ( erBlock == NULL ) {
-      err_msg("ERROR: Could not open file '%s'\n", errimg);
-      return(-1);
-    }
-    errDs = dmImageGetDataDescriptor(erBlock );
-    enAxes = dmGetArrayDimensions( errDs, &elAxes );
-    if ( (enAxes != 2 ) || 
-     ( elAxes[0] != GlobalXLen ) ||
-     ( elAxes[1] != GlobalYLen )    ) {
-      err_msg("ERROR: Error image must be 2D image with non-zero axes\n");
-      return(-1);
+  if ( 0 != alloc_buffers( ctx ) ) {
+    retval = -1;
+  }
+  for (bb=0; ( 0 == retval ) && ( bb<ctx->nbands ); bb++ ) {
+    retval = select_kernels( ctx, ctx->band+bb );
+  }
+  if ( 0 == retval ) {
+    find_valid_box( ctx );
+  }
+  mark_time( clock, &(ctx->stats.wall.prepare), &(ctx->stats.cpu.prepare) );
+  for (bb=0; ( 0 == retval ) && ( bb<ctx->nbands ); bb++ ) {
+    if ( 0 == bb ) {
+      retval = load_error_image( ctx, ctx->band, input->errfile, input->varfile );
+    } else {
+      retval = load_error_image( ctx, ctx->band+bb, input->bands[bb-1].errfile, 
+                                 input->bands[bb-1].varfile );
     }
-    // get_data( errDs, npix, GlobalDErr );
+  }
+  mark_time( clock, &(ctx->stats.wall.errimg), &(ctx->stats.cpu.errimg) );
+  return(retval);
+}
 
-    dmGetArray_f( errDs, GlobalDErr, npix );
 
-    dmImageClose( erBlock );
-  }
+/* Make the output files asked for from the leaves.
+ * NB: mask file has different datatypes and different extensions */
+static int write_products( dmnautilusContext *ctx, abinTaskList *tasks, short nthreads,
+                           dmBlock *inBlock, const char *unit, 
+                           dmnautilusOutputs *outputs, short clobber, abinClock *clock )
+{
+  abinCorners corners;
+  short bb;
+  int retval = 0;
+
+  memset( &corners, 0, sizeof(abinCorners));
 
-  return 0;
+  if ( want_output( outputs->maskfile ) || want_output( outputs->binfile ) ) {
+    retval = make_corners( ctx, tasks, &corners );
+    mark_time( clock, &(ctx->stats.wall.regions), &(ctx->stats.cpu.regions) );
+  }
+  for (bb=0; ( 0 == retval ) && ( bb<ctx->nbands ); bb++ ) {
+    ctx->fill_band = bb;
+    retval = make_output( ctx, tasks, nthreads, OUT_VALUE, inBlock, 
+                          ( 0 == bb ) ? outputs->outfile : outputs->bandoutfiles[bb-1],
+                          unit, NULL, clobber );
+  }
+  if ( ( 0 == retval ) && want_output( outputs->areafile ) ) {
+    retval = make_output( ctx, tasks, nthreads, OUT_AREA, inBlock, 
+                          outputs->areafile, "pixels", NULL, clobber );
+  }
+  if ( ( 0 == retval ) && want_output( outputs->snrfile ) ) {
+    retval = make_output( ctx, tasks, nthreads, OUT_SNR, inBlock, 
+                          outputs->snrfile, NULL, NULL, clobber );
+  }
+  if ( ( 0 == retval ) && want_output( outputs->maskfile ) ) {
+    retval = make_output( ctx, tasks, nthreads, OUT_MASK, inBlock, 
+                          outputs->maskfile, NULL, &corners, clobber );
+  }
+  if ( ( 0 == retval ) && want_output( outputs->binfile ) ) {
+    retval = write_bin_table( ctx, inBlock, tasks, &corners, outputs->binfile, unit, 
+                              NULL, clobber );
+  }
+  if ( ( 0 == retval ) && want_output( outputs->treefile ) ) {
+    retval = write_tree_table( ctx, inBlock, tasks, outputs->treefile, unit, clobber );
+  }
+  /* The last output image may still be being written */
+  if ( ( 0 != finish_output( ctx ) ) && ( 0 == retval ) ) {
+    retval = -1;
+  }
+  free_corners( &corners );
+  return(retval);
 }
 
 
+/* The leaves have been summed, so the pixel values are no longer 
+ * needed; only the validity plane is used from here on. */
+static void free_band_data( dmnautilusContext *ctx )
+{
+  short bb;
+
+  for (bb=0; bb<ctx->nbands; bb++ ) {
+    abinBand *band = ctx->band+bb;
+    if ( band->data && !ctx->borrowed ) free( band->data );
+    if ( band->dplane ) free( band->dplane );
+    band->data = NULL;
+    band->dplane = NULL;
+    band->kdata = NULL;
+  }
+}
 
-/* Main routine; does all the work of a quad-tree adaptive binning routine*/
-int abin (void)
+
+/* Does all the work of a quad-tree adaptive binning routine for
+ * one image */
+int dmnautilus_run( dmnautilusContext *ctx,
+                    dmnautilusInput *input,
+                    dmnautilusParams *params,
+                    dmnautilusOutputs *outputs )
 {
+  dmBlock *inBlock;
+  short nthreads;
+  char unit[DS_SZ_KEYWORD];
+  abinTaskList tasks;
+  abinPrevTree prev;
+  short incremental;
+  abinClock clock;
+  int retval = 0;
+
+  if ( ctx->loaded ) {
+    dmnautilus_unload( ctx );
+  }
+  memset( &tasks, 0, sizeof(abinTaskList));
+  memset( &prev, 0, sizeof(abinPrevTree));
+  memset( &(ctx->stats), 0, sizeof(dmnautilusStats));
+  memset( &(ctx->count), 0, sizeof(abinCount));
+  mark_time( &clock, NULL, NULL );
+
+  if ( ( 0 != set_criteria( ctx, params ) ) ||
+       ( 0 != setup_bands( ctx, input, params ) ) ||
+       ( 0 != check_band_outputs( ctx, outputs ) ) ) {
+    return(-1);
+  }
+  nthreads = ( params->nthreads < 1 ) ? 1 : params->nthreads;
+
+  incremental = want_output( input->prevbinfile );
+  if ( incremental != want_output( input->deltafile ) ) {
+    err_msg("ERROR: prevbinfile and indeltafile must be used together\n");
+    return(-1);
+  }
+  if ( incremental && ( ( ctx->nbands > 1 ) || want_output( input->binfile ) ) ) {
+    err_msg("ERROR: Incremental binning is only for one band, and not with inbinfile\n");
+    return(-1);
+  }
+  if ( want_output( input->binfile ) && want_output( outputs->treefile ) ) {
+    err_msg("ERROR: The tree of a table of bins cannot be written; it has no statistics\n");
+    return(-1);
+  }
+  ctx->check_exact = incremental || want_output( outputs->binfile );
+  ctx->exact_sums = 0;
 
-  char infile[DS_SZ_FNAME];
-  char errimg[DS_SZ_FNAME];
+  /* Read the data */
+  retval = open_infile( ctx, input, &inBlock, unit );
+  if ( NULL == inBlock ) {
+    return(-1);
+  }
+  mark_time( &clock, &(ctx->stats.wall.load), &(ctx->stats.cpu.load) );
 
-  char outfile[DS_SZ_FNAME];
-  char areafile[DS_SZ_FNAME];
-  char maskfile[DS_SZ_FNAME];
-  char snrfile[DS_SZ_FNAME];
-  short method;
-  short clobber;
+  if ( 0 == retval ) {
+    ctx->tiled = ( LAYOUT_TILE == params->layout ) && !want_output( input->binfile );
+    ctx->map_buffers = need_mapped_buffers( ctx, params->memlimit );
+    ctx->tmpdir = ( params->tmpdir && *params->tmpdir ) ? params->tmpdir : P_tmpdir;
 
-  long npix;
+    if ( want_output( input->binfile ) ) {
+      /* Expand the table of bins; nothing to compute */
+      if ( 0 != select_kernels( ctx, ctx->band ) ) {
+        retval = -1;
+      } else {
+        find_valid_box( ctx );
+        retval = read_bin_table( ctx, input->binfile, nthreads, NULL, &tasks, NULL );
+      }
+      mark_time( &clock, &(ctx->stats.wall.prepare), &(ctx->stats.cpu.prepare) );
+      count_leaves( ctx, &tasks );
+    } else {
+      retval = prepare_tables( ctx, input, &clock );
+      if ( ( 0 == retval ) && incremental ) {
+        retval = load_prev_tree( ctx, input->prevbinfile, input->deltafile, params, &prev );
+        mark_time( &clock, &(ctx->stats.wall.load), &(ctx->stats.cpu.load) );
+      }
+      if ( ( 0 == retval ) && ( 0 != make_sum_tables( ctx ) ) ) {
+        retval = -1;
+      }
+      if ( ( 0 == retval ) && ctx->tiled ) {
+        retval = tile_bands( ctx );
+      }
+      mark_time( &clock, &(ctx->stats.wall.prepare), &(ctx->stats.cpu.prepare) );
+
+      /* Start Algorithm */
+      if ( 0 == retval ) {
+        retval = abin_tree( ctx, nthreads, params->engine, incremental ? &prev : NULL,
+                            &tasks );
+        mark_time( &clock, &(ctx->stats.wall.traverse), &(ctx->stats.cpu.traverse) );
+        count_leaves( ctx, &tasks );
+      }
+      free_prev_tree( &prev );
+    }
+  }
 
-  dmBlock *inBlock;
+  free_band_data( ctx );
 
-  /* Read in all the data */
-  clgetstr( "infile", infile, DS_SZ_FNAME );
-  clgetstr( "outfile", outfile, DS_SZ_FNAME );
-  GlobalSNRThresh = clgetd( "snr" );
-  method = clgeti("method");
-  clgetstr( "inerrfile",   errimg, DS_SZ_FNAME );
-  clgetstr( "outmaskfile", maskfile, DS_SZ_FNAME );
-  clgetstr( "outsnrfile",  snrfile,  DS_SZ_FNAME );
-  clgetstr( "outareafile", areafile, DS_SZ_FNAME );
-  clobber = clgetb( "clobber" );
-
-  switch (method) 
-  {
-    case 0: GlobalSplitCriteria = ZERO_ABOVE; break;
-    case 1: GlobalSplitCriteria = ONE_ABOVE; break;
-    case 2: GlobalSplitCriteria = TWO_ABOVE; break;
-    case 3: GlobalSplitCriteria = THREE_ABOVE; break;
-    case 4: GlobalSplitCriteria = ALL_ABOVE; break;
-    default:
-      err_msg("Invalid method parameter value");
-      return(-1);
-      break;
-  };
+  /* Write out files */
+  if ( 0 == retval ) {
+    retval = write_products( ctx, &tasks, nthreads, inBlock, unit, outputs, 
+                             params->clobber, &clock );
+  }
+  free_tasks( &tasks );
 
+  /* Must keep open until now to do all the wcs/hdr copies */
+  pthread_mutex_lock( &dm_lock );
+  dmImageClose( inBlock ); 
+  clear_image( ctx );
+  pthread_mutex_unlock( &dm_lock );
+  mark_time( &clock, &(ctx->stats.wall.output), &(ctx->stats.cpu.output) );
 
-  /* Go ahead and take care of the autonaming */
-  ds_autoname( infile, outfile, "abinimg", DS_SZ_FNAME );
-  ds_autoname( outfile, maskfile, "maskimg", DS_SZ_FNAME );
-  ds_autoname( outfile, snrfile, "snrimg", DS_SZ_FNAME );
-  ds_autoname( outfile, areafile, "areaimg", DS_SZ_FNAME );
+  end_stats( ctx );
 
+  return(retval);
+}
 
-  /* Read the data */
-  /* TODO: Replace with dmimgio routines */
 
-  inBlock = dmImageOpen( infile );
-  if ( !inBlock ) {
-    err_msg("ERROR: Could not open infile='%s'\n", infile );
+/* Read the image and make its summed-area tables, which do not depend
+ * on snr or method, and keep them for dmnautilus_rebin() */
+int dmnautilus_load( dmnautilusContext *ctx,
+                     dmnautilusInput *input,
+                     dmnautilusParams *params )
+{
+  abinClock clock;
+  int retval = 0;
+
+  dmnautilus_unload( ctx );
+  memset( &(ctx->stats), 0, sizeof(dmnautilusStats));
+  memset( &(ctx->count), 0, sizeof(abinCount));
+  mark_time( &clock, NULL, NULL );
+
+  if ( want_output( input->binfile ) || want_output( input->prevbinfile ) ) {
+    err_msg("ERROR: inbinfile and prevbinfile cannot be used with a loaded image\n");
+    return(-1);
+  }
+  if ( ( params->layout != LAYOUT_ROW ) && ( params->layout != LAYOUT_TILE ) ) {
+    err_msg("Invalid layout parameter value");
+    return(-1);
+  }
+  if ( 0 != setup_bands( ctx, input, params ) ) {
     return(-1);
   }
+  /* Checked once here for all the tables of bins written from it */
+  ctx->check_exact = 1;
+  ctx->exact_sums = 0;
+
+  retval = open_infile( ctx, input, &(ctx->inBlock), ctx->unit );
+  mark_time( &clock, &(ctx->stats.wall.load), &(ctx->stats.cpu.load) );
+  if ( 0 == retval ) {
+    ctx->tiled = ( LAYOUT_TILE == params->layout );
+    ctx->map_buffers = need_mapped_buffers( ctx, params->memlimit );
+    ctx->tmpdir = ( params->tmpdir && *params->tmpdir ) ? params->tmpdir : P_tmpdir;
+    retval = prepare_tables( ctx, input, &clock );
+  }
+  if ( ( 0 == retval ) && ( 0 != make_sum_tables( ctx ) ) ) {
+    retval = -1;
+  }
+  if ( ( 0 == retval ) && ctx->tiled ) {
+    retval = tile_bands( ctx );
+  }
+  mark_time( &clock, &(ctx->stats.wall.prepare), &(ctx->stats.cpu.prepare) );
 
+  if ( 0 != retval ) {
+    dmnautilus_unload( ctx );
+    return(-1);
+  }
+  ctx->loaded = 1;
 
+  end_stats( ctx );
+  return(0);
+}
 
-  long *lAxes=NULL;
-  regRegion *dss=NULL;
-  long null;
-  short has_null;
-  char unit[DS_SZ_KEYWORD];
-  memset( &unit[0], 0, DS_SZ_KEYWORD) ;
 
-  GlobalDataType = get_image_data( inBlock, &GlobalData, &lAxes, &dss, &null, &has_null );
-  get_image_wcs( inBlock, &GlobalXdesc, &GlobalYdesc );
-  GlobalPixMask = get_image_mask( inBlock, GlobalData, GlobalDataType, lAxes, dss, null, has_null, 
-                         GlobalXdesc, GlobalYdesc );
-  dmGetUnit( dmImageGetDataDescriptor(inBlock),unit, DS_SZ_KEYWORD );
+/* Bin the loaded image again.  Only the tree is traversed and the 
+ * outputs written; the stats are of this call alone. */
+int dmnautilus_rebin( dmnautilusContext *ctx,
+                      dmnautilusParams *params,
+                      dmnautilusOutputs *outputs )
+{
+  abinTaskList tasks;
+  abinClock clock;
+  short nthreads;
+  int retval = 0;
 
+  if ( !ctx->loaded ) {
+    err_msg("ERROR: No image has been loaded\n");
+    return(-1);
+  }
+  memset( &tasks, 0, sizeof(abinTaskList));
+  memset( &(ctx->stats), 0, sizeof(dmnautilusStats));
+  memset( &(ctx->count), 0, sizeof(abinCount));
+  mark_time( &clock, NULL, NULL );
 
-  npix = ( lAxes[0]*lAxes[1]);
-  if (npix ==0 ) {
-    err_msg("ERROR: Image is empty (one axis is 0 length)\n");
+  if ( ( 0 != set_criteria( ctx, params ) ) ||
+       ( 0 != check_band_outputs( ctx, outputs ) ) ) {
     return(-1);
   }
+  nthreads = ( params->nthreads < 1 ) ? 1 : params->nthreads;
+  ctx->tmpdir = ( params->tmpdir && *params->tmpdir ) ? params->tmpdir : P_tmpdir;
 
+  retval = abin_tree( ctx, nthreads, params->engine, NULL, &tasks );
+  mark_time( &clock, &(ctx->stats.wall.traverse), &(ctx->stats.cpu.traverse) );
+  count_leaves( ctx, &tasks );
 
-  GlobalLAxes[0] = GlobalXLen = lAxes[0];
-  GlobalLAxes[1] = GlobalYLen = lAxes[1];
+  if ( 0 == retval ) {
+    retval = write_products( ctx, &tasks, nthreads, ctx->inBlock, ctx->unit, outputs, 
+                             params->clobber, &clock );
+  }
+  free_tasks( &tasks );
+  mark_time( &clock, &(ctx->stats.wall.output), &(ctx->stats.cpu.output) );
 
+  end_stats( ctx );
+  return(retval);
+}
 
-  /* Allocate memory for the products */
-  //GlobalData = (float*)calloc(npix,sizeof(float));
-  GlobalDErr = (float*)calloc(npix,sizeof(float));
-  GlobalOutData = (float*)calloc(npix,sizeof(float));
-  GlobalOutArea = (float*)calloc(npix,sizeof(float));
-  GlobalOutSNR = (float*)calloc(npix,sizeof(float));
-  GlobalMask = (unsigned long*)calloc(npix,sizeof(unsigned long));
-  maskRegion = regCreateEmptyRegion();
 
+int dmnautilus_sweep( dmnautilusContext *ctx,
+                      dmnautilusParams *params,
+                      const double *snrs,
+                      long nsnr,
+                      dmnautilusOutputs *outputs,
+                      const char *hierfile )
+{
+  abinHier hier;
+  abinStats root;
+  abinClock clock;
+  float *thresh;
+  float lowest;
+  short nthreads;
+  long ii;
+  int retval = 0;
+
+  if ( !ctx->loaded ) {
+    err_msg("ERROR: No image has been loaded\n");
+    return(-1);
+  }
+  if ( nsnr < 1 ) {
+    err_msg("ERROR: No snr values to sweep\n");
+    return(-1);
+  }
+  memset( &hier, 0, sizeof(abinHier));
+  memset( &(ctx->stats), 0, sizeof(dmnautilusStats));
+  memset( &(ctx->count), 0, sizeof(abinCount));
+  mark_time( &clock, NULL, NULL );
 
-  if ( 0 != load_error_image( errimg ) ) {
-        return -1;
+  if ( 0 != set_criteria( ctx, params ) ) {
+    return(-1);
+  }
+  for (ii=0; ii<nsnr; ii++ ) {
+    if ( 0 != check_band_outputs( ctx, &(outputs[ii]) ) ) {
+      return(-1);
+    }
+  }
+  if ( NULL == ( thresh = (float*)calloc( nsnr, sizeof(float)))) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
   }
-  
-  /* Start Algorithm */
+  lowest = INFINITY;
+  for (ii=0; ii<nsnr; ii++ ) {
+    thresh[ii] = snrs[ii];
+    if ( thresh[ii] < lowest ) {
+      lowest = thresh[ii];
+    }
+  }
+  nthreads = ( params->nthreads < 1 ) ? 1 : params->nthreads;
+  ctx->tmpdir = ( params->tmpdir && *params->tmpdir ) ? params->tmpdir : P_tmpdir;
+
+  /* One traversal for all of them, at the lowest threshold */
+  get_stats( ctx, &(ctx->count), 0, 0, ctx->xlen, ctx->ylen, &root );
+  if ( ( 0 != add_hier_nodes( ctx, &hier, 0, 0, ctx->xlen, ctx->ylen, 0, &root, 
+                              INFINITY, lowest ) ) ||
+       ( 0 != sum_hier_leaves( ctx, &hier, thresh, nsnr, want_output( hierfile ), 
+                               nthreads ) ) ) {
+    err_msg("ERROR: Problem traversing quad-tree\n");
+    retval = -1;
+  }
+  mark_time( &clock, &(ctx->stats.wall.traverse), &(ctx->stats.cpu.traverse) );
 
-  abin_rec( 0, 0, GlobalXLen, GlobalYLen);
+  if ( ( 0 == retval ) && want_output( hierfile ) ) {
+    ctx->snr_thresh = lowest;
+    retval = write_hier_table( ctx, &hier, hierfile, params->clobber );
+  }
 
+  for (ii=0; ( 0 == retval ) && ( ii<nsnr ); ii++ ) {
+    abinTaskList tasks;
 
-  /* Write out files -- NB: mask file has different datatypes and different extensions */
-  dmBlock *outBlock;
-  dmDescriptor *outDes;
+    if ( 0 != make_cut_tasks( ctx, &hier, thresh[ii], ( nthreads > 1 ) ? 16*nthreads : 1,
+                              &tasks ) ) {
+      err_msg("ERROR: Could not allocate memory\n");
+      retval = -1;
+    } else {
+      count_leaves( ctx, &tasks );
+      ctx->snr_thresh = thresh[ii];
+      retval = write_products( ctx, &tasks, nthreads, ctx->inBlock, ctx->unit, 
+                               &(outputs[ii]), params->clobber, &clock );
+    }
+    free_tasks( &tasks );
+  }
+  free_hier( &hier );
+  free( thresh );
+  mark_time( &clock, &(ctx->stats.wall.output), &(ctx->stats.cpu.output) );
 
+  end_stats( ctx );
+  return(retval);
+}
 
 
-  if ( ds_clobber( outfile, clobber, NULL) == 0 ) {
-    outBlock = dmImageCreate(outfile, dmFLOAT, lAxes, 2 );
-    if ( outBlock == NULL ) {
-      err_msg("ERROR: Could not create output '%s'\n", outfile);
-    }
-    outDes = dmImageGetDataDescriptor( outBlock );
-    dmBlockCopy( inBlock, outBlock, "HEADER"); 
-    ds_copy_full_header( inBlock, outBlock, "dmnautilus", 0 );
-    put_param_hist_info( outBlock, "dmnautilus", NULL, 0 );
-    dmSetUnit( outDes, unit );
-    dmBlockCopyWCS( inBlock, outBlock);
-    dmSetArray_f( outDes, GlobalOutData, npix );
-    dmImageClose( outBlock );
-  } else {
+/* Point the context at the caller's arrays in place of reading infile.
+ * They are borrowed: clear_image() drops them w/o freeing. */
+static int set_arrays( dmnautilusContext *ctx, const dmnautilusArrays *arrays )
+{
+  if ( ( NULL == arrays->data ) || ( arrays->xlen < 1 ) || ( arrays->ylen < 1 ) ) {
+    err_msg("ERROR: Image is empty (one axis is 0 length)\n");
+    return(-1);
+  }
+  if ( arrays->err && arrays->var ) {
+    err_msg("ERROR: Only one of the error and variance arrays can be used\n");
     return(-1);
   }
 
-  if ( (strlen(areafile)>0) && (ds_strcmp_cis(areafile,"none")!=0) ) {
-    if ( ds_clobber( areafile, clobber, NULL) == 0 ) {
-      outBlock = dmImageCreate(areafile, dmFLOAT, lAxes, 2 );
-      if ( outBlock == NULL ) {
-    err_msg("ERROR: Could not create output '%s'\n", areafile);
-      }
-      outDes = dmImageGetDataDescriptor( outBlock );
-      dmBlockCopy( inBlock, outBlock, "HEADER");
-      ds_copy_full_header( inBlock, outBlock, "dmnautilus", 0 );
-      put_param_hist_info( outBlock, "dmnautilus", NULL, 0 );
-      dmSetUnit( outDes, "pixels" );
-      dmBlockCopyWCS( inBlock, outBlock);
-      dmSetArray_f( outDes, GlobalOutArea, npix );
-      dmImageClose( outBlock );
-    } else {
-      return(-1);
+  ctx->lAxes[0] = ctx->xlen = arrays->xlen;
+  ctx->lAxes[1] = ctx->ylen = arrays->ylen;
+  ctx->xdesc = NULL;
+  ctx->ydesc = NULL;
+  ctx->band[0].data = (void*)arrays->data;
+  ctx->band[0].datatype = arrays->datatype;
+  ctx->borrowed = 1;
+  ctx->pixmask = (short*)arrays->valid;   /* NULL: made from the NaN's */
+  ctx->borrowed_mask = ( NULL != arrays->valid );
+  ctx->have_counts = 0;
+  return(0);
+}
+
+
+/* Fill the caller's output arrays and make the list of bins; the same
+ * as write_products() w/o the files */
+static int fill_arrays( dmnautilusContext *ctx, abinTaskList *tasks, short nthreads,
+                        dmnautilusArrayOutputs *outputs )
+{
+  abinProduct product[4] = { OUT_VALUE, OUT_AREA, OUT_SNR, OUT_MASK };
+  void *plane[4];
+  long ii, nn, kk;
+
+  plane[0] = outputs->value;
+  plane[1] = outputs->area;
+  plane[2] = outputs->snr;
+  plane[3] = outputs->mask;
+
+  ctx->fill_band = 0;
+  ctx->mask_type = dmULONG;
+  for (ii=0; ii<4; ii++ ) {
+    if ( plane[ii] ) {
+      ctx->plane = plane[ii];
+      ctx->product = product[ii];
+      run_tasks( ctx, tasks, run_fill_task, nthreads );
     }
   }
+  ctx->plane = NULL;
 
-  if ( (strlen(snrfile)>0) && (ds_strcmp_cis(snrfile,"none")!=0) ) {
-    if ( ds_clobber( snrfile, clobber, NULL) == 0 ) {
-      outBlock = dmImageCreate(snrfile, dmFLOAT, lAxes, 2 );
-      if ( outBlock == NULL ) {
-    err_msg("ERROR: Could not create output '%s'\n", snrfile);
-      }
-      outDes = dmImageGetDataDescriptor( outBlock );
-      dmBlockCopy( inBlock, outBlock, "HEADER");
-      ds_copy_full_header( inBlock, outBlock, "dmnautilus", 0 );
-      put_param_hist_info( outBlock, "dmnautilus", NULL, 0 );
-      dmBlockCopyWCS( inBlock, outBlock);
-      dmSetArray_f( outDes, GlobalOutSNR, npix );
-      dmImageClose( outBlock );
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    outputs->nbins += tasks->task[ii].leaves.nleaves;
+  }
+  outputs->bins = (dmnautilusBin*)malloc( (outputs->nbins+1)*sizeof(dmnautilusBin));
+  if ( NULL == outputs->bins ) {
+    outputs->nbins = 0;
+    err_msg("ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+  kk = 0;
+  for (ii=0; ii<tasks->ntasks; ii++ ) {
+    for (nn=0; nn<tasks->task[ii].leaves.nleaves; nn++) {
+      abinLeaf *leaf = &(tasks->task[ii].leaves.leaf[nn]);
+      dmnautilusBin *bin = outputs->bins + kk;
+      bin->xs = leaf->xs;
+      bin->ys = leaf->ys;
+      bin->xl = leaf->xl;
+      bin->yl = leaf->yl;
+      bin->sum = leaf->sum;
+      bin->val = leaf->val;
+      bin->area = leaf->area;
+      bin->snr = leaf->snr;
+      bin->level = leaf->level;
+      kk++;
+    }
+  }
+  return(0);
+}
+
+
+/* dmnautilus_run() on an image in memory: the caller's arrays take the
+ * place of infile and the output files */
+int dmnautilus_bin_arrays( dmnautilusContext *ctx,
+                           const dmnautilusArrays *arrays,
+                           dmnautilusParams *params,
+                           dmnautilusArrayOutputs *outputs )
+{
+  dmnautilusInput input;
+  abinTaskList tasks;
+  abinClock clock;
+  short nthreads;
+  int retval = 0;
+
+  if ( ctx->loaded ) {
+    dmnautilus_unload( ctx );
+  }
+  memset( &input, 0, sizeof(dmnautilusInput));
+  memset( &tasks, 0, sizeof(abinTaskList));
+  memset( &(ctx->stats), 0, sizeof(dmnautilusStats));
+  memset( &(ctx->count), 0, sizeof(abinCount));
+  outputs->bins = NULL;
+  outputs->nbins = 0;
+  mark_time( &clock, NULL, NULL );
+
+  if ( ( 0 != set_criteria( ctx, params ) ) ||
+       ( 0 != setup_bands( ctx, &input, params ) ) ||
+       ( 0 != set_arrays( ctx, arrays ) ) ) {
+    return(-1);
+  }
+  nthreads = ( params->nthreads < 1 ) ? 1 : params->nthreads;
+  ctx->check_exact = 0;
+  ctx->exact_sums = 0;
+  ctx->tiled = ( LAYOUT_TILE == params->layout );
+  ctx->map_buffers = need_mapped_buffers( ctx, params->memlimit );
+  ctx->tmpdir = ( params->tmpdir && *params->tmpdir ) ? params->tmpdir : P_tmpdir;
+
+  /* No error files in input, so this leaves the errors Poisson */
+  retval = prepare_tables( ctx, &input, &clock );
+  if ( ( 0 == retval ) && arrays->var ) {
+    ctx->band->dvar = (float*)arrays->var;    /* only ever read */
+  } else if ( ( 0 == retval ) && arrays->err ) {
+    long npix = ctx->xlen*ctx->ylen;
+    if ( 0 != get_buffer( ctx, &(ctx->band->varbuf), npix*sizeof(float) ) ) {
+      err_msg("ERROR: Could not allocate memory for image\n");
+      retval = -1;
     } else {
-      return(-1);
+      memcpy( ctx->band->varbuf.ptr, arrays->err, npix*sizeof(float));
+      ctx->band->dvar = (float*)ctx->band->varbuf.ptr;
+      ctx->band->var_is_sigma = 1;
     }
   }
+  mark_time( &clock, &(ctx->stats.wall.errimg), &(ctx->stats.cpu.errimg) );
 
+  if ( ( 0 == retval ) && ( 0 != make_sum_tables( ctx ) ) ) {
+    retval = -1;
+  }
+  if ( ( 0 == retval ) && ctx->tiled ) {
+    retval = tile_bands( ctx );
+  }
+  mark_time( &clock, &(ctx->stats.wall.prepare), &(ctx->stats.cpu.prepare) );
 
-  if ( (strlen(maskfile)>0) && (ds_strcmp_cis(maskfile,"none")!=0) ) {
-    if ( ds_clobber( maskfile, clobber, NULL) == 0 ) {
-      outBlock = dmImageCreate(maskfile, dmULONG, lAxes, 2 );
-      if ( outBlock == NULL ) {
-    err_msg("ERROR: Could not create output '%s'\n", maskfile);
-      }
-      outDes = dmImageGetDataDescriptor( outBlock );
-      dmBlockCopy( inBlock, outBlock, "HEADER");
-      ds_copy_full_header( inBlock, outBlock, "dmnautilus", 0 );
-      put_param_hist_info( outBlock, "dmnautilus", NULL, 0 );
-      dmBlockCopyWCS( inBlock, outBlock);
-      dmSetArray_ul( outDes, GlobalMask, npix );
+  if ( 0 == retval ) {
+    retval = abin_tree( ctx, nthreads, params->engine, NULL, &tasks );
+    mark_time( &clock, &(ctx->stats.wall.traverse), &(ctx->stats.cpu.traverse) );
+    count_leaves( ctx, &tasks );
+  }
+  free_band_data( ctx );
 
-      dmBlockClose( dmTableWriteRegion( dmBlockGetDataset( outBlock ),
-              "REGION", NULL, maskRegion ));
+  if ( 0 == retval ) {
+    retval = fill_arrays( ctx, &tasks, nthreads, outputs );
+  }
+  free_tasks( &tasks );
+  clear_image( ctx );
+  mark_time( &clock, &(ctx->stats.wall.output), &(ctx->stats.cpu.output) );
 
-      dmImageClose( outBlock );
-    } else {
-      return(-1);
-    }
+  end_stats( ctx );
+  return(retval);
+}
+
+
+void dmnautilus_unload( dmnautilusContext *ctx )
+{
+  pthread_mutex_lock( &dm_lock );
+  if ( ctx->inBlock ) {
+    dmImageClose( ctx->inBlock );
   }
-  
-  /* Must keep open until now to do all the wcs/hdr copies */
-  dmImageClose( inBlock ); 
-  
-  /* make valgrind happy */
-  free(GlobalData);
-  free(GlobalDErr);
-  free(GlobalOutData);
-  free(GlobalOutArea);
-  free(GlobalOutSNR);
-  free(GlobalMask);
+  clear_image( ctx );
+  pthread_mutex_unlock( &dm_lock );
+  ctx->inBlock = NULL;
+  ctx->loaded = 0;
+}
 
 
-  return(0);
+void dmnautilus_get_timings( dmnautilusContext *ctx, dmnautilusTimings *timings )
+{
+  *timings = ctx->stats.wall;
+}
+
 
+void dmnautilus_get_stats( dmnautilusContext *ctx, dmnautilusStats *stats )
+{
+  *stats = ctx->stats;
 }
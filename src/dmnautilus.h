@@ -0,0 +1,306 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+#ifndef DMNAUTILUS_H
+#define DMNAUTILUS_H
+
+#include <ascdm.h>
+
+/* libdmnautilus: quad-tree adaptive binning of 2D images.
+ *
+ * All the state for one run lives in a dmnautilusContext, so several
+ * images can be binned in one process (or at the same time in different
+ * threads, each with its own context; the calls into the DM library are
+ * serialized internally).  A context keeps its buffers
+ * between runs; binning many images of the same size with one context
+ * does not re-allocate them.
+ *
+ *   dmnautilusContext *ctx = dmnautilus_context_new();
+ *   for ( each image ) {
+ *     ... fill in input, params, outputs ...
+ *     if ( 0 != dmnautilus_run( ctx, &input, &params, &outputs )) { ... }
+ *   }
+ *   dmnautilus_context_free( ctx );
+ *
+ * To try several snr and method values on one image, load it once
+ * and bin it as many times as needed; only the tree and the outputs are
+ * redone each time:
+ *
+ *   dmnautilus_load( ctx, &input, &params );
+ *   for ( each snr, method ) {
+ *     ... fill in params.snr, params.method, outputs ...
+ *     dmnautilus_rebin( ctx, &params, &outputs );
+ *   }
+ *   dmnautilus_unload( ctx );
+ *
+ * An image that is already in memory (eg a NumPy array) is binned
+ * w/o any files with dmnautilus_bin_arrays().
+ *
+ * Functions return 0 on success and -1 on failure; the reason is
+ * reported with err_msg().
+ */
+
+/* Opaque; all the algorithm state */
+typedef struct dmnautilusContext dmnautilusContext;
+
+/* Number of sub-images that must be above the SNR threshold to split.
+ * ZERO_ABOVE is the original algorithm: split if the image itself is
+ * above threshold. */
+typedef enum {
+  ZERO_ABOVE=0, ONE_ABOVE, TWO_ABOVE, THREE_ABOVE, ALL_ABOVE
+} dmnautilusCriteria;
+
+/* How the quad-tree is traversed; the output is the same for both.
+ * DEPTH_FIRST is the original recursion.  LEVEL_SYNC walks the tree
+ * one level at a time w/o recursion: the sub-image statistics for a
+ * whole level are looked up together, then all its split decisions are
+ * made in one pass over flat arrays. */
+typedef enum {
+  DEPTH_FIRST=0, LEVEL_SYNC
+} dmnautilusEngine;
+
+/* How the bands are combined to decide whether a sub-image is above
+ * the SNR threshold when several are binned together: JOINT_SUM uses
+ * the SNR of the bands summed; JOINT_ALL needs every band to be above
+ * the threshold, JOINT_ANY any one of them. */
+typedef enum {
+  JOINT_SUM=0, JOINT_ALL, JOINT_ANY
+} dmnautilusJoint;
+
+/* How the pixels are laid out in memory when the bins are summed; the
+ * output is the same for both.  LAYOUT_ROW is the image as read.  
+ * LAYOUT_TILE copies the data, variance and validity into 64x64 tiles
+ * once the summed-area tables are made, so the pixels of a bin are
+ * close together rather than a whole row apart. */
+typedef enum {
+  LAYOUT_ROW=0, LAYOUT_TILE
+} dmnautilusLayout;
+
+/* Tile compression of the output images (the tables are not 
+ * compressed).  The mask and area images are always lossless; 
+ * COMPRESS_RICE quantizes the binned and SNR images, COMPRESS_GZIP
+ * keeps every value. */
+typedef enum {
+  COMPRESS_NONE=0, COMPRESS_RICE, COMPRESS_GZIP
+} dmnautilusCompress;
+
+/* Data type of the output mask image.  MASK_ULONG is what it has
+ * always been.  MASK_AUTO is the smallest unsigned type that holds the
+ * number of bins (byte, ushort, or ulong), which is smaller on disk and
+ * in memory but changes with the number of bins. */
+typedef enum {
+  MASK_ULONG=0, MASK_AUTO
+} dmnautilusMaskType;
+
+/* Another band of the same field as infile, eg another energy range */
+typedef struct {
+  const char *infile;
+  const char *errfile;   /* NULL, "" or "none" for sqrt(data) */
+  const char *varfile;   /* NULL, "" or "none" */
+} dmnautilusBand;
+
+typedef struct {
+  const char *infile;    /* Input image */
+  const char *errfile;   /* Input error image; NULL, "" or "none" for sqrt(data) */
+  const char *binfile;   /* Table of bins (see outputs) to expand instead of
+                            binning infile; NULL, "" or "none" to bin.  infile
+                            is then only used for the header, WCS, and which
+                            pixels are valid. */
+  const char *varfile;   /* Input variance image; NULL, "" or "none".  Only
+                            one of errfile and varfile can be given. */
+  const char *binspec;   /* Binning for an event list infile, eg "sky=4";
+                            NULL, "" or "none" for an image.  Ignored if
+                            infile already has a [bin] filter. */
+  dmnautilusBand *bands; /* More bands binned together with infile: there
+                            is one tree and one mask for all of them, and
+                            a binned image of each.  NULL for one band. */
+  short nbands;          /* Number of bands in the list */
+  const char *prevbinfile;  /* Table of bins (outbinfile) of an earlier run
+                               on the same field, so only what changed is
+                               redone; NULL, "" or "none" to bin from scratch */
+  const char *deltafile; /* What was added to infile since then, eg the 
+                            counts of a new observation; its non-zero and
+                            null pixels are the ones that changed.  Needed
+                            with prevbinfile. */
+} dmnautilusInput;
+
+typedef struct {
+  double snr;                   /* SNR threshold */
+  dmnautilusCriteria method;    /* Split criteria */
+  short nthreads;               /* Number of threads to traverse tree */
+  short clobber;                /* Remove existing outputs? */
+  dmnautilusEngine engine;      /* Tree traversal engine */
+  long memlimit;                /* MB; work buffers for images that need
+                                   more are mapped temporary files, 0 for
+                                   never.  Not a limit on the memory used:
+                                   the input is always read whole */
+  const char *tmpdir;           /* Where those go; NULL or "" for the default */
+  dmnautilusJoint joint;        /* How input bands are combined */
+  dmnautilusLayout layout;      /* Pixel layout for summing the bins */
+  dmnautilusCompress compress;  /* Tile compression of the output images */
+  dmnautilusMaskType masktype;  /* Data type of the output mask image */
+} dmnautilusParams;
+
+/* Output file names; any but outfile can be NULL, "" or "none" to skip */
+typedef struct {
+  const char *outfile;    /* Adaptively binned image */
+  const char *maskfile;   /* Mask (group number) image + regions */
+  const char *snrfile;    /* SNR image */
+  const char *areafile;   /* Area image */
+  const char *binfile;    /* Table of bins: one row per leaf */
+  const char **bandoutfiles;  /* Binned image of each input band, after
+                                 outfile for infile */
+  const char *treefile;   /* Table of every node of the quad-tree, the ones
+                             that split as well as the bins, one level 
+                             after another.  Not with input binfile. */
+} dmnautilusOutputs;
+
+/* An image in memory, for dmnautilus_bin_arrays().  The arrays are
+ * xlen*ylen pixels with x changing fastest (a C-ordered [y,x] array)
+ * and belong to the caller; they are read in place and never changed.
+ * data is not copied if datatype is dmBYTE, dmSHORT, dmUSHORT, dmLONG
+ * (C long), dmULONG (C unsigned long), dmFLOAT, or dmDOUBLE.  */
+typedef struct {
+  const void *data;      /* pixel values */
+  dmDataType datatype;
+  long xlen;
+  long ylen;
+  const float *err;      /* error of each pixel; NULL for sqrt(data).  It
+                            is squared into a work buffer. */
+  const float *var;      /* or the variance; NULL.  Only one of err and
+                            var can be given. */
+  const short *valid;    /* 0 for pixels to leave out, which must include
+                            any NaN; NULL to leave out the NaN pixels */
+} dmnautilusArrays;
+
+/* One bin; pixels are 0-based and the bin is xs..xs+xl-1, ys..ys+yl-1 */
+typedef struct {
+  long xs;
+  long ys;
+  long xl;
+  long yl;
+  float sum;    /* sum of pixel values */
+  float val;    /* average pixel value */
+  long area;    /* number of valid pixels */
+  float snr;    /* signal to noise ratio */
+  short level;  /* depth in the tree; the whole image is 0 */
+} dmnautilusBin;
+
+/* What dmnautilus_bin_arrays() makes.  The images are xlen*ylen arrays
+ * given by the caller, or NULL to skip; they are filled in place, as 
+ * the output files would be.  bins is always made, in mask number
+ * order (mask value nn is bins[nn-1]); free() it when done. */
+typedef struct {
+  float *value;           /* binned image */
+  float *area;            /* area image */
+  float *snr;             /* SNR image */
+  unsigned long *mask;    /* mask (bin number) image; 0 outside the bins */
+  dmnautilusBin *bins;    /* o: the bins */
+  long nbins;             /* o: and how many */
+} dmnautilusArrayOutputs;
+
+/* Seconds spent in each phase of the last run */
+typedef struct {
+  double load;       /* reading the image, WCS, and validity mask */
+  double errimg;     /* reading the error or variance image */
+  double prepare;    /* summed-area tables, or reading the table of bins */
+  double traverse;   /* quad-tree traversal */
+  double regions;    /* corners of the bins for the regions and table */
+  double output;     /* making and writing the output files */
+} dmnautilusTimings;
+
+#define DMNAUTILUS_NUM_SIZES  32
+
+/* What the last run did.  The counters are counted as the work is done,
+ * by every thread; snr_calls and max_depth are 0 when a table of bins is
+ * expanded, since there is no tree to traverse. */
+typedef struct {
+  dmnautilusTimings wall;   /* wall clock */
+  dmnautilusTimings cpu;    /* CPU time of the whole process: all the
+                               threads, and any other images being
+                               binned at the same time */
+  long snr_calls;           /* sub-image statistics looked up */
+  long pixels;              /* pixel values read: making the summed-area
+                               tables, reading the changed rows of an
+                               incremental run, and summing the leaves */
+  long leaves;              /* number of bins */
+  short max_depth;          /* deepest leaf; the whole image is 0 */
+  long leaf_sizes[DMNAUTILUS_NUM_SIZES];  /* leaves with the longer side
+                               2^n to 2^(n+1)-1 pixels */
+  long peak_rss;            /* kB; high-water mark of the process so far */
+} dmnautilusStats;
+
+
+dmnautilusContext *dmnautilus_context_new( void );
+void dmnautilus_context_free( dmnautilusContext *ctx );
+
+int dmnautilus_run( dmnautilusContext *ctx,
+                    dmnautilusInput *input,
+                    dmnautilusParams *params,
+                    dmnautilusOutputs *outputs );
+
+/* Read infile (and any bands and error images) and make the summed-area
+ * tables, keeping them in the context.  inbinfile and prevbinfile 
+ * cannot be used.  joint, layout, memlimit, and tmpdir are taken from params
+ * here; snr, method, engine, and nthreads come from each rebin. */
+int dmnautilus_load( dmnautilusContext *ctx,
+                     dmnautilusInput *input,
+                     dmnautilusParams *params );
+
+/* Bin the loaded image with params and write outputs.  The timings and
+ * counters are of this call only. */
+int dmnautilus_rebin( dmnautilusContext *ctx,
+                      dmnautilusParams *params,
+                      dmnautilusOutputs *outputs );
+
+/* Bin the loaded image at each of nsnr thresholds, writing outputs[k]
+ * for snrs[k]; params.snr is not used.  The quad-tree is traversed once,
+ * at the lowest threshold, and a pixel sum is done once for all the
+ * thresholds it is a bin for.  If hierfile is set every bin of any
+ * snr from the lowest up is written to it as a table of bins with SNR_LO
+ * and SNR_HI columns; used as inbinfile it gives the bins of any snr in
+ * that range.  The timings and counters are totals over all thresholds. */
+int dmnautilus_sweep( dmnautilusContext *ctx,
+                      dmnautilusParams *params,
+                      const double *snrs,
+                      long nsnr,
+                      dmnautilusOutputs *outputs,
+                      const char *hierfile );
+
+/* Bin an image in memory w/ params, w/o reading or writing any files.
+ * Only snr, method, nthreads, engine, and layout are used from params
+ * (memlimit and tmpdir too, for the work buffers).  There is no WCS, so
+ * the bins are in pixels; a loaded image is unloaded first. */
+int dmnautilus_bin_arrays( dmnautilusContext *ctx,
+                           const dmnautilusArrays *arrays,
+                           dmnautilusParams *params,
+                           dmnautilusArrayOutputs *outputs );
+
+/* Free the loaded image; dmnautilus_run() and dmnautilus_context_free()
+ * do this too */
+void dmnautilus_unload( dmnautilusContext *ctx );
+
+/* Wall clock timings of the last dmnautilus_run() with this context */
+void dmnautilus_get_timings( dmnautilusContext *ctx, dmnautilusTimings *timings );
+
+/* Timings and counters of the last dmnautilus_run() */
+void dmnautilus_get_stats( dmnautilusContext *ctx, dmnautilusStats *stats );
+
+#endif
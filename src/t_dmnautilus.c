@@ -62,6 +62,1057 @@
 H***************************************************************** */
 
 #include "dslib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stk.h>
+#include "dmnautilus.h"
+
+int abin(void);
+
+#define SERVER_LINE  (8*DS_SZ_FNAME)   /* longest request */
+
+
+/* infile, outfile, inerrfile, invarfile, and the optional outputs are all stacks
+ * so that many images can be binned in one run.  A fixed pool of
+ * workers takes the images in turn; each worker has its own library
+ * context so buffers are reused from one image to the next. */
+typedef struct {
+  Stack infiles;
+  Stack outfiles;
+  Stack errfiles;
+  Stack varfiles;
+  Stack maskfiles;
+  Stack snrfiles;
+  Stack areafiles;
+  Stack binfiles;
+  Stack treefiles;
+  Stack inbinfiles;
+  Stack prevbinfiles;
+  Stack deltafiles;
+  dmnautilusParams params;
+  const char *binspec;    /* same for every image */
+  long nimages;
+  long next;              /* next image to bin */
+  int *status;            /* return value for each image */
+  short verbose;
+  short server;           /* read requests from stdin */
+  FILE *statsfp;          /* outstatsfile, or NULL */
+  pthread_mutex_t lock;   /* protects next, the stacks, and the reports */
+} abinBatch;
+
+/* The file names for one image, after autonaming */
+typedef struct {
+  char infile[DS_SZ_FNAME];
+  char errfile[DS_SZ_FNAME];
+  char varfile[DS_SZ_FNAME];
+  char outfile[DS_SZ_FNAME];
+  char maskfile[DS_SZ_FNAME];
+  char snrfile[DS_SZ_FNAME];
+  char areafile[DS_SZ_FNAME];
+  char binfile[DS_SZ_FNAME];
+  char treefile[DS_SZ_FNAME];
+  char inbinfile[DS_SZ_FNAME];
+  char prevbinfile[DS_SZ_FNAME];
+  char deltafile[DS_SZ_FNAME];
+} abinNames;
+
+
+static void get_stack_name( Stack stk, long nn, char *name );
+static void get_batch_names( abinBatch *batch, long nn, abinNames *names );
+static void autoname_outputs( abinNames *names );
+static int set_method( long method, dmnautilusParams *params );
+static int set_engine( const char *engine, dmnautilusParams *params );
+static int set_layout( const char *layout, dmnautilusParams *params );
+static int set_compress( const char *compress, dmnautilusParams *params );
+static int set_masktype( const char *masktype, dmnautilusParams *params );
+static int parse_request( char *line, abinBatch *batch, dmnautilusParams *params, abinNames *names );
+static int run_server( dmnautilusContext *ctx, abinBatch *batch, abinNames *names, dmnautilusInput *input, dmnautilusOutputs *outputs );
+static short is_blank_name( const char *name );
+static short is_shared_name( const char *name );
+static int check_stack( Stack stk, long nimages, const char *parname, short any_shared );
+static void *run_batch_worker( void *arg );
+static int run_bands( abinBatch *batch );
+static int check_sweep_stack( Stack stk, long nsnr, const char *parname, short one_each );
+static int run_sweep( abinBatch *batch, Stack snrlist, char *hierfile );
+static void print_stats( const char *infile, dmnautilusStats *stats, short verbose );
+static void write_json_string( FILE *fp, const char *str );
+static void write_json_timings( FILE *fp, const char *name, dmnautilusTimings *tt );
+static void write_stats( FILE *fp, const char *infile, int status, dmnautilusStats *stats );
+static double get_total( dmnautilusTimings *tt );
+
+
+/* Get the nn-th (0 based) name from the stack; a stack with one
+ * entry is used for every image */
+static void get_stack_name( Stack stk, long nn, char *name )
+{
+  char *item;
+  int count = stk_count( stk );
+
+  memset( name, 0, DS_SZ_FNAME );
+  if ( count < 1 ) {
+    return;
+  }
+  item = stk_read_num( stk, ( count == 1 ) ? 1 : nn+1 );
+  if ( item ) {
+    strncpy( name, item, DS_SZ_FNAME-1 );
+    free( item );
+  }
+}
+
+
+static void get_batch_names( abinBatch *batch, long nn, abinNames *names )
+{
+  get_stack_name( batch->infiles, nn, names->infile );
+  get_stack_name( batch->errfiles, nn, names->errfile );
+  get_stack_name( batch->varfiles, nn, names->varfile );
+  get_stack_name( batch->outfiles, nn, names->outfile );
+  get_stack_name( batch->maskfiles, nn, names->maskfile );
+  get_stack_name( batch->snrfiles, nn, names->snrfile );
+  get_stack_name( batch->areafiles, nn, names->areafile );
+  get_stack_name( batch->binfiles, nn, names->binfile );
+  get_stack_name( batch->treefiles, nn, names->treefile );
+  get_stack_name( batch->inbinfiles, nn, names->inbinfile );
+  get_stack_name( batch->prevbinfiles, nn, names->prevbinfile );
+  get_stack_name( batch->deltafiles, nn, names->deltafile );
+}
+
+
+/* Go ahead and take care of the autonaming */
+static void autoname_outputs( abinNames *names )
+{
+  ds_autoname( names->infile, names->outfile, "abinimg", DS_SZ_FNAME );
+  ds_autoname( names->outfile, names->maskfile, "maskimg", DS_SZ_FNAME );
+  ds_autoname( names->outfile, names->snrfile, "snrimg", DS_SZ_FNAME );
+  ds_autoname( names->outfile, names->areafile, "areaimg", DS_SZ_FNAME );
+  ds_autoname( names->outfile, names->binfile, "bintab", DS_SZ_FNAME );
+  ds_autoname( names->outfile, names->treefile, "treetab", DS_SZ_FNAME );
+}
+
+
+static short is_blank_name( const char *name )
+{
+  return( ( 0 == strlen(name) ) || ( 0 == ds_strcmp_cis( (char*)name, "none" )) );
+}
+
+
+/* Can one output name be used for several images?  Only if it is 
+ * blank/none or a directory that autonaming will fill in. */
+static short is_shared_name( const char *name )
+{
+  struct stat st;
+
+  if ( is_blank_name( name ) ) {
+    return(1);
+  }
+  if ( ( 0 == stat( name, &st ) ) && S_ISDIR( st.st_mode ) ) {
+    return(1);
+  }
+  return(0);
+}
+
+
+/* The stack must have one entry per input image, or a single entry
+ * that can be shared by all of them. */
+static int check_stack( Stack stk, long nimages, const char *parname, short any_shared )
+{
+  char name[DS_SZ_FNAME];
+  int count = stk_count( stk );
+
+  if ( ( count == nimages ) || ( count < 1 ) ) {
+    return(0);
+  }
+  if ( count == 1 ) {
+    get_stack_name( stk, 0, name );
+    if ( any_shared || is_shared_name( name ) ) {
+      return(0);
+    }
+    err_msg("ERROR: %s='%s' would be used for all %ld input images; "
+            "use a stack of %ld names or a directory\n", parname, name, 
+            nimages, nimages );
+    return(-1);
+  }
+  err_msg("ERROR: %s has %d entries but there are %ld input images\n",
+          parname, count, nimages );
+  return(-1);
+}
+
+
+static double get_total( dmnautilusTimings *tt )
+{
+  return( tt->load + tt->errimg + tt->prepare + tt->traverse + 
+          tt->regions + tt->output );
+}
+
+
+/* verbose=1 is one line per image; 2 adds the time spent in each phase
+ * and the peak memory; 3 adds the counters */
+static void print_stats( const char *infile, dmnautilusStats *stats, short verbose )
+{
+  const char *phases[] = { "load", "errimg", "prepare", "traverse", "regions", "output" };
+  double wall[6] = { stats->wall.load, stats->wall.errimg, stats->wall.prepare,
+                     stats->wall.traverse, stats->wall.regions, stats->wall.output };
+  double cpu[6] = { stats->cpu.load, stats->cpu.errimg, stats->cpu.prepare,
+                    stats->cpu.traverse, stats->cpu.regions, stats->cpu.output };
+  short ii;
+
+  printf("%s: %ld bins, max depth %d, %.3f s\n", infile, stats->leaves, 
+         stats->max_depth, get_total( &(stats->wall) ));
+  if ( verbose < 2 ) {
+    return;
+  }
+
+  printf("  %-10s %10s %10s\n", "phase", "wall [s]", "cpu [s]");
+  for (ii=0; ii<6; ii++ ) {
+    printf("  %-10s %10.4f %10.4f\n", phases[ii], wall[ii], cpu[ii] );
+  }
+  printf("  peak memory %ld kB\n", stats->peak_rss );
+  if ( verbose < 3 ) {
+    return;
+  }
+
+  printf("  sub-image statistics looked up %ld\n", stats->snr_calls );
+  printf("  pixel values read %ld\n", stats->pixels );
+  printf("  bins by longer side [pixels]:\n");
+  for (ii=0; ii<DMNAUTILUS_NUM_SIZES; ii++ ) {
+    if ( stats->leaf_sizes[ii] > 0 ) {
+      printf("    %10ld - %-10ld %ld\n", 1L<<ii, (2L<<ii)-1, stats->leaf_sizes[ii] );
+    }
+  }
+}
+
+
+static void write_json_string( FILE *fp, const char *str )
+{
+  fputc( '"', fp );
+  for ( ; *str; str++ ) {
+    if ( ( '"' == *str ) || ( '\\' == *str ) ) {
+      fprintf( fp, "\\%c", *str );
+    } else if ( (unsigned char)*str < 0x20 ) {
+      fprintf( fp, "\\u%04x", (unsigned char)*str );
+    } else {
+      fputc( *str, fp );
+    }
+  }
+  fputc( '"', fp );
+}
+
+
+static void write_json_timings( FILE *fp, const char *name, dmnautilusTimings *tt )
+{
+  fprintf( fp, "\"%s\": {\"load\": %.6f, \"errimg\": %.6f, \"prepare\": %.6f, "
+           "\"traverse\": %.6f, \"regions\": %.6f, \"output\": %.6f, "
+           "\"total\": %.6f}", name, tt->load, tt->errimg, tt->prepare, 
+           tt->traverse, tt->regions, tt->output, get_total( tt ));
+}
+
+
+/* One JSON object per image, one per line, for monitoring */
+static void write_stats( FILE *fp, const char *infile, int status, dmnautilusStats *stats )
+{
+  short ii;
+
+  fprintf( fp, "{\"infile\": ");
+  write_json_string( fp, infile );
+  fprintf( fp, ", \"status\": %d, ", status );
+  write_json_timings( fp, "wall", &(stats->wall) );
+  fprintf( fp, ", ");
+  write_json_timings( fp, "cpu", &(stats->cpu) );
+  fprintf( fp, ", \"snr_calls\": %ld, \"pixels\": %ld, \"leaves\": %ld, "
+           "\"max_depth\": %d, \"leaf_sizes\": [", stats->snr_calls, 
+           stats->pixels, stats->leaves, stats->max_depth );
+  for (ii=0; ii<DMNAUTILUS_NUM_SIZES; ii++ ) {
+    fprintf( fp, "%s%ld", ( ii > 0 ) ? ", " : "", stats->leaf_sizes[ii] );
+  }
+  fprintf( fp, "], \"peak_rss_kb\": %ld}\n", stats->peak_rss );
+  fflush( fp );
+}
+
+
+static int set_method( long method, dmnautilusParams *params )
+{
+  switch (method) 
+  {
+    case 0: params->method = ZERO_ABOVE; break;
+    case 1: params->method = ONE_ABOVE; break;
+    case 2: params->method = TWO_ABOVE; break;
+    case 3: params->method = THREE_ABOVE; break;
+    case 4: params->method = ALL_ABOVE; break;
+    default:
+      err_msg("Invalid method parameter value");
+      return(-1);
+      break;
+  };
+  return(0);
+}
+
+
+static int set_engine( const char *engine, dmnautilusParams *params )
+{
+  if ( 0 == ds_strcmp_cis( (char*)engine, "depth" )) {
+    params->engine = DEPTH_FIRST;
+  } else if ( 0 == ds_strcmp_cis( (char*)engine, "level" )) {
+    params->engine = LEVEL_SYNC;
+  } else {
+    err_msg("Invalid engine parameter value");
+    return(-1);
+  }
+  return(0);
+}
+
+
+static int set_layout( const char *layout, dmnautilusParams *params )
+{
+  if ( 0 == ds_strcmp_cis( (char*)layout, "row" )) {
+    params->layout = LAYOUT_ROW;
+  } else if ( 0 == ds_strcmp_cis( (char*)layout, "tile" )) {
+    params->layout = LAYOUT_TILE;
+  } else {
+    err_msg("Invalid layout parameter value");
+    return(-1);
+  }
+  return(0);
+}
+
+
+static int set_compress( const char *compress, dmnautilusParams *params )
+{
+  if ( 0 == ds_strcmp_cis( (char*)compress, "none" )) {
+    params->compress = COMPRESS_NONE;
+  } else if ( 0 == ds_strcmp_cis( (char*)compress, "rice" )) {
+    params->compress = COMPRESS_RICE;
+  } else if ( 0 == ds_strcmp_cis( (char*)compress, "gzip" )) {
+    params->compress = COMPRESS_GZIP;
+  } else {
+    err_msg("Invalid compress parameter value");
+    return(-1);
+  }
+  return(0);
+}
+
+
+static int set_masktype( const char *masktype, dmnautilusParams *params )
+{
+  if ( 0 == ds_strcmp_cis( (char*)masktype, "ulong" )) {
+    params->masktype = MASK_ULONG;
+  } else if ( 0 == ds_strcmp_cis( (char*)masktype, "auto" )) {
+    params->masktype = MASK_AUTO;
+  } else {
+    err_msg("Invalid masktype parameter value");
+    return(-1);
+  }
+  return(0);
+}
+
+
+/* One server request: key=value pairs separated by blanks, eg
+ *
+ *   snr=8 method=2 outfile=a665_8_2.abin outmaskfile=a665_8_2.map
+ *
+ * Anything not given keeps its value from the parameter file, so a
+ * request only has to say what changed.  outfile is a stack w/ one
+ * name per band; the other outputs are shared by the bands. */
+static int parse_request( char *line, abinBatch *batch, dmnautilusParams *params, 
+                          abinNames *names )
+{
+  char *tok, *save=NULL;
+  long nn;
+
+  for (nn=0; nn<batch->nimages; nn++ ) {
+    get_batch_names( batch, nn, &names[nn] );
+  }
+
+  for ( tok = strtok_r( line, " \t", &save ); tok; tok = strtok_r( NULL, " \t", &save )) {
+    char *val = strchr( tok, '=' );
+    char *end;
+    if ( NULL == val ) {
+      err_msg("ERROR: Expected key=value in request, not '%s'\n", tok );
+      return(-1);
+    }
+    *val++ = '\0';
+
+    if ( 0 == ds_strcmp_cis( tok, "snr" )) {
+      params->snr = strtod( val, &end );
+      if ( ( end == val ) || ( *end != '\0' ) || ( params->snr < 0 ) ) {
+        err_msg("ERROR: Bad snr='%s'\n", val );
+        return(-1);
+      }
+    } else if ( 0 == ds_strcmp_cis( tok, "method" )) {
+      long method = strtol( val, &end, 10 );
+      if ( ( end == val ) || ( *end != '\0' ) || ( 0 != set_method( method, params ) ) ) {
+        return(-1);
+      }
+    } else if ( 0 == ds_strcmp_cis( tok, "engine" )) {
+      if ( 0 != set_engine( val, params ) ) {
+        return(-1);
+      }
+    } else if ( 0 == ds_strcmp_cis( tok, "compress" )) {
+      if ( 0 != set_compress( val, params ) ) {
+        return(-1);
+      }
+    } else if ( 0 == ds_strcmp_cis( tok, "nthreads" )) {
+      long nthreads = strtol( val, &end, 10 );
+      if ( ( end == val ) || ( *end != '\0' ) || ( nthreads < 1 ) || ( nthreads > SHRT_MAX ) ) {
+        err_msg("ERROR: Bad nthreads='%s'\n", val );
+        return(-1);
+      }
+      params->nthreads = nthreads;
+    } else if ( 0 == ds_strcmp_cis( tok, "clobber" )) {
+      params->clobber = ( ( 0 == ds_strcmp_cis( val, "yes" )) || 
+                          ( 0 == ds_strcmp_cis( val, "y" )) || ( 0 == strcmp( val, "+" )) );
+    } else if ( 0 == ds_strcmp_cis( tok, "outfile" )) {
+      Stack stk = stk_build( val );
+      if ( ( NULL == stk ) || ( stk_count( stk ) != batch->nimages ) ) {
+        err_msg("ERROR: outfile needs one name per band\n");
+        if ( stk ) stk_close( stk );
+        return(-1);
+      }
+      for (nn=0; nn<batch->nimages; nn++ ) {
+        get_stack_name( stk, nn, names[nn].outfile );
+      }
+      stk_close( stk );
+    } else {
+      char *name = NULL;
+      if ( 0 == ds_strcmp_cis( tok, "outmaskfile" )) {
+        name = names[0].maskfile;
+      } else if ( 0 == ds_strcmp_cis( tok, "outsnrfile" )) {
+        name = names[0].snrfile;
+      } else if ( 0 == ds_strcmp_cis( tok, "outareafile" )) {
+        name = names[0].areafile;
+      } else if ( 0 == ds_strcmp_cis( tok, "outbinfile" )) {
+        name = names[0].binfile;
+      } else if ( 0 == ds_strcmp_cis( tok, "outtreefile" )) {
+        name = names[0].treefile;
+      } else {
+        err_msg("ERROR: Unknown key '%s' in request\n", tok );
+        return(-1);
+      }
+      memset( name, 0, DS_SZ_FNAME );
+      strncpy( name, val, DS_SZ_FNAME-1 );
+    }
+  }
+
+  for (nn=0; nn<batch->nimages; nn++ ) {
+    autoname_outputs( &names[nn] );
+  }
+  return(0);
+}
+
+
+/* server=yes: load the image once and bin it again for each request
+ * read from stdin, until EOF or "quit".  Each request gets one line
+ * back on stdout, "OK <bins> bins <seconds> s" or "ERROR" (the reason
+ * goes to stderr as usual), so whatever is driving the tool through a 
+ * pipe knows when the outputs are ready.  Loading answers the same way. */
+static int run_server( dmnautilusContext *ctx, abinBatch *batch, abinNames *names,
+                       dmnautilusInput *input, dmnautilusOutputs *outputs )
+{
+  dmnautilusParams params;
+  dmnautilusStats stats;
+  char line[SERVER_LINE];
+  long nrequests = 0;
+  long nfailed = 0;
+  int status;
+
+  if ( 0 != dmnautilus_load( ctx, input, &(batch->params) )) {
+    printf("ERROR\n");
+    fflush( stdout );
+    return(-1);
+  }
+  dmnautilus_get_stats( ctx, &stats );
+  printf("OK loaded %s %.3f s\n", names[0].infile, get_total( &(stats.wall) ));
+  fflush( stdout );
+
+  while ( NULL != fgets( line, SERVER_LINE, stdin )) {
+    char *cmd = line + strspn( line, " \t" );
+
+    memset( &stats, 0, sizeof(dmnautilusStats));
+    if ( ( NULL == strchr( line, '\n' ) ) && !feof( stdin ) ) {
+      int cc;
+      while ( ( EOF != ( cc = getchar() )) && ( '\n' != cc ) ) {
+        ;  /* drop the rest of it */
+      }
+      err_msg("ERROR: Request is longer than %d characters\n", SERVER_LINE-1 );
+      status = -1;
+    } else {
+      cmd[strcspn( cmd, "\r\n" )] = '\0';
+      if ( ( '\0' == *cmd ) || ( '#' == *cmd ) ) {
+        continue;
+      }
+      if ( ( 0 == ds_strcmp_cis( cmd, "quit" )) || ( 0 == ds_strcmp_cis( cmd, "exit" )) ) {
+        break;
+      }
+      params = batch->params;
+      status = parse_request( cmd, batch, &params, names );
+      if ( 0 == status ) {
+        status = dmnautilus_rebin( ctx, &params, outputs );
+        dmnautilus_get_stats( ctx, &stats );
+      }
+    }
+    nrequests++;
+
+    if ( ( batch->verbose > 0 ) && ( 0 == status ) ) {
+      print_stats( names[0].infile, &stats, batch->verbose );
+    }
+    if ( batch->statsfp ) {
+      write_stats( batch->statsfp, names[0].infile, status, &stats );
+    }
+    if ( 0 == status ) {
+      printf("OK %ld bins %.3f s\n", stats.leaves, get_total( &(stats.wall) ));
+    } else {
+      printf("ERROR\n");
+      nfailed++;
+    }
+    fflush( stdout );
+  }
+
+  dmnautilus_unload( ctx );
+  if ( nfailed > 0 ) {
+    err_msg("ERROR: %ld of %ld requests failed\n", nfailed, nrequests );
+    return(-1);
+  }
+  return(0);
+}
+
+
+/* Bin images until there are none left.  An image that fails is 
+ * recorded and the worker moves on to the next one. */
+static void *run_batch_worker( void *arg )
+{
+  abinBatch *batch = (abinBatch*)arg;
+  dmnautilusContext *ctx;
+  dmnautilusInput input;
+  dmnautilusOutputs outputs;
+  abinNames names;
+  long nn;
+
+  if ( NULL == ( ctx = dmnautilus_context_new() )) {
+    err_msg("ERROR: Could not allocate memory\n");
+    return(NULL);
+  }
+
+  memset( &input, 0, sizeof(dmnautilusInput));
+  memset( &outputs, 0, sizeof(dmnautilusOutputs));
+  input.infile = names.infile;
+  input.errfile = names.errfile;
+  input.varfile = names.varfile;
+  input.binfile = names.inbinfile;
+  input.binspec = batch->binspec;
+  input.prevbinfile = names.prevbinfile;
+  input.deltafile = names.deltafile;
+  outputs.outfile = names.outfile;
+  outputs.maskfile = names.maskfile;
+  outputs.snrfile = names.snrfile;
+  outputs.areafile = names.areafile;
+  outputs.binfile = names.binfile;
+  outputs.treefile = names.treefile;
+
+  while (1) {
+    pthread_mutex_lock( &(batch->lock) );
+    nn = batch->next;
+    if ( nn < batch->nimages ) {
+      batch->next++;
+      get_batch_names( batch, nn, &names );
+      autoname_outputs( &names );
+    }
+    pthread_mutex_unlock( &(batch->lock) );
+
+    if ( nn >= batch->nimages ) {
+      break;
+    }
+    batch->status[nn] = dmnautilus_run( ctx, &input, &(batch->params), &outputs );
+
+    if ( ( batch->verbose > 0 ) || batch->statsfp ) {
+      dmnautilusStats stats;
+      dmnautilus_get_stats( ctx, &stats );
+      pthread_mutex_lock( &(batch->lock) );
+      if ( ( batch->verbose > 0 ) && ( 0 == batch->status[nn] ) ) {
+        print_stats( names.infile, &stats, batch->verbose );
+      }
+      if ( batch->statsfp ) {
+        write_stats( batch->statsfp, names.infile, batch->status[nn], &stats );
+      }
+      pthread_mutex_unlock( &(batch->lock) );
+    }
+  }
+
+  dmnautilus_context_free( ctx );
+  return(NULL);
+}
+
+
+/* With joint set the input images are the bands of one image: they are
+ * binned with a single tree and there is one outfile per band.  The
+ * other outputs describe the shared bins so there is only one of each.
+ * Server mode also comes through here, w/ one image or the bands of one. */
+static int run_bands( abinBatch *batch )
+{
+  dmnautilusContext *ctx;
+  dmnautilusInput input;
+  dmnautilusOutputs outputs;
+  dmnautilusBand *bands;
+  abinNames *names;
+  const char **bandoutfiles;
+  long nn;
+  int retval = 0;
+
+  if ( batch->nimages > SHRT_MAX ) {
+    err_msg("ERROR: Too many bands\n");
+    return(-1);
+  }
+
+  names = (abinNames*)calloc( batch->nimages, sizeof(abinNames));
+  bands = (dmnautilusBand*)calloc( batch->nimages, sizeof(dmnautilusBand));
+  bandoutfiles = (const char**)calloc( batch->nimages, sizeof(char*));
+  ctx = dmnautilus_context_new();
+  if ( ( NULL == names ) || ( NULL == bands ) || ( NULL == bandoutfiles ) || 
+       ( NULL == ctx ) ) {
+    err_msg("ERROR: Could not allocate memory\n");
+    retval = -1;
+  }
+
+  for (nn=0; ( 0 == retval ) && ( nn<batch->nimages ); nn++ ) {
+    get_batch_names( batch, nn, &names[nn] );
+    autoname_outputs( &names[nn] );
+    bands[nn].infile = names[nn].infile;
+    bands[nn].errfile = names[nn].errfile;
+    bands[nn].varfile = names[nn].varfile;
+    bandoutfiles[nn] = names[nn].outfile;
+  }
+
+  if ( 0 == retval ) {
+    memset( &input, 0, sizeof(dmnautilusInput));
+    input.infile = names[0].infile;
+    input.errfile = names[0].errfile;
+    input.varfile = names[0].varfile;
+    input.binfile = names[0].inbinfile;
+    input.binspec = batch->binspec;
+    input.prevbinfile = names[0].prevbinfile;
+    input.deltafile = names[0].deltafile;
+    memset( &outputs, 0, sizeof(dmnautilusOutputs));
+    input.bands = bands+1;
+    input.nbands = batch->nimages-1;
+    outputs.outfile = names[0].outfile;
+    outputs.maskfile = names[0].maskfile;
+    outputs.snrfile = names[0].snrfile;
+    outputs.areafile = names[0].areafile;
+    outputs.binfile = names[0].binfile;
+    outputs.treefile = names[0].treefile;
+    outputs.bandoutfiles = bandoutfiles+1;
+
+    if ( batch->server ) {
+      retval = run_server( ctx, batch, names, &input, &outputs );
+    } else {
+      retval = dmnautilus_run( ctx, &input, &(batch->params), &outputs );
+    }
+
+    if ( !batch->server && ( ( batch->verbose > 0 ) || batch->statsfp ) ) {
+      dmnautilusStats stats;
+      dmnautilus_get_stats( ctx, &stats );
+      if ( ( batch->verbose > 0 ) && ( 0 == retval ) ) {
+        print_stats( names[0].infile, &stats, batch->verbose );
+      }
+      if ( batch->statsfp ) {
+        write_stats( batch->statsfp, names[0].infile, retval, &stats );
+      }
+    }
+  }
+
+  if ( ctx ) dmnautilus_context_free( ctx );
+  if ( bandoutfiles ) free( bandoutfiles );
+  if ( bands ) free( bands );
+  if ( names ) free( names );
+  return(retval);
+}
+
+
+/* With snrlist the outputs are per threshold.  outfile needs a name
+ * for each; the others can also be left blank or be a directory, since
+ * they are autonamed from outfile. */
+static int check_sweep_stack( Stack stk, long nsnr, const char *parname, short one_each )
+{
+  char name[DS_SZ_FNAME];
+  int count = stk_count( stk );
+
+  if ( count == nsnr ) {
+    return(0);
+  }
+  if ( !one_each && ( count <= 1 ) ) {
+    get_stack_name( stk, 0, name );
+    if ( is_shared_name( name ) ) {
+      return(0);
+    }
+  }
+  err_msg("ERROR: %s needs one name for each of the %ld snrlist values\n", parname, nsnr );
+  return(-1);
+}
+
+
+/* snrlist: bin the one infile at each threshold with a single traversal
+ * (dmnautilus_sweep), and write the hierarchy of bins if asked for.
+ * hierfile (DS_SZ_FNAME) is autonamed in place. */
+static int run_sweep( abinBatch *batch, Stack snrlist, char *hierfile )
+{
+  dmnautilusContext *ctx;
+  dmnautilusInput input;
+  dmnautilusOutputs *outputs;
+  abinNames *names;
+  double *snrs;
+  long nsnr = stk_count( snrlist );
+  long nn;
+  int retval = 0;
+
+  names = (abinNames*)calloc( nsnr, sizeof(abinNames));
+  outputs = (dmnautilusOutputs*)calloc( nsnr, sizeof(dmnautilusOutputs));
+  snrs = (double*)calloc( nsnr, sizeof(double));
+  ctx = dmnautilus_context_new();
+  if ( ( NULL == names ) || ( NULL == outputs ) || ( NULL == snrs ) || ( NULL == ctx ) ) {
+    err_msg("ERROR: Could not allocate memory\n");
+    retval = -1;
+  }
+
+  for (nn=0; ( 0 == retval ) && ( nn<nsnr ); nn++ ) {
+    char *item = stk_read_num( snrlist, nn+1 );
+    char *end = NULL;
+
+    snrs[nn] = item ? strtod( item, &end ) : 0;
+    if ( ( NULL == item ) || ( end == item ) || ( '\0' != *end ) || ( snrs[nn] < 0 ) ) {
+      err_msg("ERROR: Invalid snrlist value '%s'\n", item ? item : "" );
+      retval = -1;
+    }
+    if ( item ) free( item );
+
+    get_batch_names( batch, nn, &names[nn] );
+    autoname_outputs( &names[nn] );
+    outputs[nn].outfile = names[nn].outfile;
+    outputs[nn].maskfile = names[nn].maskfile;
+    outputs[nn].snrfile = names[nn].snrfile;
+    outputs[nn].areafile = names[nn].areafile;
+    outputs[nn].binfile = names[nn].binfile;
+    outputs[nn].treefile = names[nn].treefile;
+  }
+
+  if ( 0 == retval ) {
+    memset( &input, 0, sizeof(dmnautilusInput));
+    input.infile = names[0].infile;
+    input.errfile = names[0].errfile;
+    input.varfile = names[0].varfile;
+    input.binspec = batch->binspec;
+    ds_autoname( names[0].outfile, hierfile, "hiertab", DS_SZ_FNAME );
+
+    retval = dmnautilus_load( ctx, &input, &(batch->params) );
+    if ( 0 == retval ) {
+      retval = dmnautilus_sweep( ctx, &(batch->params), snrs, nsnr, outputs, hierfile );
+    }
+
+    if ( ( batch->verbose > 0 ) || batch->statsfp ) {
+      dmnautilusStats stats;
+      dmnautilus_get_stats( ctx, &stats );
+      if ( ( batch->verbose > 0 ) && ( 0 == retval ) ) {
+        print_stats( names[0].infile, &stats, batch->verbose );
+      }
+      if ( batch->statsfp ) {
+        write_stats( batch->statsfp, names[0].infile, retval, &stats );
+      }
+    }
+  }
+
+  if ( ctx ) dmnautilus_context_free( ctx );
+  if ( snrs ) free( snrs );
+  if ( outputs ) free( outputs );
+  if ( names ) free( names );
+  return(retval);
+}
+
+
+/* Read the parameter file and run the library on each input image */
+int abin(void)
+{
+  char infile[DS_SZ_FNAME];
+  char errimg[DS_SZ_FNAME];
+  char varimg[DS_SZ_FNAME];
+
+  char outfile[DS_SZ_FNAME];
+  char areafile[DS_SZ_FNAME];
+  char maskfile[DS_SZ_FNAME];
+  char snrfile[DS_SZ_FNAME];
+  char binfile[DS_SZ_FNAME];
+  char treefile[DS_SZ_FNAME];
+  char inbinfile[DS_SZ_FNAME];
+  char prevbinfile[DS_SZ_FNAME];
+  char deltafile[DS_SZ_FNAME];
+  char statsfile[DS_SZ_FNAME];
+  char hierfile[DS_SZ_FNAME];
+  char snrlist[DS_SZ_FNAME];
+  char binspec[DS_SZ_FNAME];
+  char engine[DS_SZ_KEYWORD];
+  char layout[DS_SZ_KEYWORD];
+  char compress[DS_SZ_KEYWORD];
+  char masktype[DS_SZ_KEYWORD];
+  char joint[DS_SZ_KEYWORD];
+  char tmpdir[DS_SZ_FNAME];
+  short method;
+  short nthreads;
+  short server;
+  short joint_bands;
+  Stack snrs = NULL;
+  long nsnr = 0;
+  long nworkers;
+  long nstarted = 0;
+  long nfailed = 0;
+  long ii;
+  pthread_t *threads = NULL;
+
+  abinBatch batch;
+  int retval = 0;
+
+  memset( &batch, 0, sizeof(abinBatch));
+
+  /* Read in all the data */
+  clgetstr( "infile", infile, DS_SZ_FNAME );
+  clgetstr( "outfile", outfile, DS_SZ_FNAME );
+  batch.params.snr = clgetd( "snr" );
+  method = clgeti("method");
+  clgetstr( "snrlist", snrlist, DS_SZ_FNAME );
+  clgetstr( "inerrfile",   errimg, DS_SZ_FNAME );
+  clgetstr( "invarfile",   varimg, DS_SZ_FNAME );
+  clgetstr( "inbinfile",   inbinfile, DS_SZ_FNAME );
+  clgetstr( "binspec",     binspec, DS_SZ_FNAME );
+  clgetstr( "prevbinfile", prevbinfile, DS_SZ_FNAME );
+  clgetstr( "indeltafile", deltafile, DS_SZ_FNAME );
+  batch.binspec = binspec;
+  clgetstr( "outmaskfile", maskfile, DS_SZ_FNAME );
+  clgetstr( "outsnrfile",  snrfile,  DS_SZ_FNAME );
+  clgetstr( "outareafile", areafile, DS_SZ_FNAME );
+  clgetstr( "outbinfile",  binfile,  DS_SZ_FNAME );
+  clgetstr( "outhierfile", hierfile, DS_SZ_FNAME );
+  clgetstr( "outtreefile", treefile, DS_SZ_FNAME );
+  clgetstr( "outstatsfile", statsfile, DS_SZ_FNAME );
+  clgetstr( "compress", compress, DS_SZ_KEYWORD );
+  clgetstr( "masktype", masktype, DS_SZ_KEYWORD );
+  nthreads = clgeti( "nthreads" );
+  clgetstr( "engine", engine, DS_SZ_KEYWORD );
+  clgetstr( "layout", layout, DS_SZ_KEYWORD );
+  clgetstr( "joint", joint, DS_SZ_KEYWORD );
+  batch.params.memlimit = clgeti( "memlimit" );
+  clgetstr( "tmpdir", tmpdir, DS_SZ_FNAME );
+  batch.params.tmpdir = tmpdir;
+  batch.params.clobber = clgetb( "clobber" );
+  server = clgetb( "server" );
+  batch.verbose = clgeti( "verbose" );
+
+  if ( ( 0 != set_method( method, &(batch.params) )) ||
+       ( 0 != set_engine( engine, &(batch.params) )) ||
+       ( 0 != set_layout( layout, &(batch.params) )) ||
+       ( 0 != set_compress( compress, &(batch.params) )) ||
+       ( 0 != set_masktype( masktype, &(batch.params) )) ) {
+    return(-1);
+  }
+
+  joint_bands = ( 0 != ds_strcmp_cis( joint, "none" ));
+  if ( !joint_bands ) {
+    batch.params.joint = JOINT_SUM;  /* not used with one band */
+  } else if ( 0 == ds_strcmp_cis( joint, "sum" )) {
+    batch.params.joint = JOINT_SUM;
+  } else if ( 0 == ds_strcmp_cis( joint, "all" )) {
+    batch.params.joint = JOINT_ALL;
+  } else if ( 0 == ds_strcmp_cis( joint, "any" )) {
+    batch.params.joint = JOINT_ANY;
+  } else {
+    err_msg("Invalid joint parameter value");
+    return(-1);
+  }
+
+  batch.infiles = stk_build( infile );
+  batch.outfiles = stk_build( outfile );
+  batch.errfiles = stk_build( errimg );
+  batch.varfiles = stk_build( varimg );
+  batch.maskfiles = stk_build( maskfile );
+  batch.snrfiles = stk_build( snrfile );
+  batch.areafiles = stk_build( areafile );
+  batch.binfiles = stk_build( binfile );
+  batch.treefiles = stk_build( treefile );
+  batch.inbinfiles = stk_build( inbinfile );
+  batch.prevbinfiles = stk_build( prevbinfile );
+  batch.deltafiles = stk_build( deltafile );
+  if ( ( NULL == batch.infiles ) || ( NULL == batch.outfiles ) ||
+       ( NULL == batch.errfiles ) || ( NULL == batch.varfiles ) ||
+       ( NULL == batch.maskfiles ) || ( NULL == batch.snrfiles ) ||
+       ( NULL == batch.areafiles ) || ( NULL == batch.binfiles ) ||
+       ( NULL == batch.treefiles ) || ( NULL == batch.inbinfiles ) || ( NULL == batch.prevbinfiles ) ||
+       ( NULL == batch.deltafiles ) ) {
+    err_msg("ERROR: Could not build file stacks\n");
+    retval = -1;
+  }
+
+  if ( 0 == retval ) {
+    batch.nimages = stk_count( batch.infiles );
+    if ( batch.nimages < 1 ) {
+      err_msg("ERROR: No input images\n");
+      retval = -1;
+    }
+  }
+
+  if ( ( 0 == retval ) && server && !joint_bands && ( batch.nimages > 1 ) ) {
+    err_msg("ERROR: server mode is for one infile, or the bands of one with joint\n");
+    retval = -1;
+  }
+  batch.server = server;
+
+  /* A sweep is of one image; its outputs are per threshold */
+  if ( !is_blank_name( snrlist ) ) {
+    if ( ( NULL == ( snrs = stk_build( snrlist ) )) || ( stk_count( snrs ) < 1 ) ) {
+      err_msg("ERROR: Could not read snrlist='%s'\n", snrlist );
+      retval = -1;
+    } else {
+      nsnr = stk_count( snrs );
+    }
+  } else if ( !is_blank_name( hierfile ) ) {
+    err_msg("ERROR: outhierfile is only made with snrlist\n");
+    retval = -1;
+  }
+
+  if ( nsnr > 0 ) {
+    if ( ( 0 == retval ) && 
+         ( joint_bands || server || ( batch.nimages > 1 ) ||
+           !is_blank_name( inbinfile ) || !is_blank_name( prevbinfile ) ) ) {
+      err_msg("ERROR: snrlist is for one infile, w/o joint, server, inbinfile, or prevbinfile\n");
+      retval = -1;
+    }
+    if ( ( 0 == retval ) &&
+         ( ( 0 != check_sweep_stack( batch.outfiles, nsnr, "outfile", 1 )) ||
+           ( 0 != check_sweep_stack( batch.maskfiles, nsnr, "outmaskfile", 0 )) ||
+           ( 0 != check_sweep_stack( batch.snrfiles, nsnr, "outsnrfile", 0 )) ||
+           ( 0 != check_sweep_stack( batch.areafiles, nsnr, "outareafile", 0 )) ||
+           ( 0 != check_sweep_stack( batch.binfiles, nsnr, "outbinfile", 0 )) ||
+           ( 0 != check_sweep_stack( batch.treefiles, nsnr, "outtreefile", 0 )) ) ) {
+      retval = -1;
+    }
+  } else if ( joint_bands ) {
+    /* The bands share one set of bins, so only outfile has one per band */
+    if ( ( 0 == retval ) &&
+         ( ( stk_count( batch.outfiles ) != batch.nimages ) ||
+           ( stk_count( batch.maskfiles ) > 1 ) || ( stk_count( batch.snrfiles ) > 1 ) ||
+           ( stk_count( batch.areafiles ) > 1 ) || ( stk_count( batch.binfiles ) > 1 ) ||
+           ( stk_count( batch.treefiles ) > 1 ) || ( stk_count( batch.inbinfiles ) > 1 ) ) ) {
+      err_msg("ERROR: With joint set, outfile needs one name per band and the other "
+              "outputs a single name\n");
+      retval = -1;
+    }
+    if ( ( 0 == retval ) &&
+         ( ( 0 != check_stack( batch.errfiles, batch.nimages, "inerrfile", 1 )) ||
+           ( 0 != check_stack( batch.varfiles, batch.nimages, "invarfile", 1 )) ) ) {
+      retval = -1;
+    }
+  } else if ( ( 0 != retval ) ||
+       ( 0 != check_stack( batch.outfiles, batch.nimages, "outfile", 0 )) ||
+       ( 0 != check_stack( batch.errfiles, batch.nimages, "inerrfile", 1 )) ||
+       ( 0 != check_stack( batch.varfiles, batch.nimages, "invarfile", 1 )) ||
+       ( 0 != check_stack( batch.maskfiles, batch.nimages, "outmaskfile", 0 )) ||
+       ( 0 != check_stack( batch.snrfiles, batch.nimages, "outsnrfile", 0 )) ||
+       ( 0 != check_stack( batch.areafiles, batch.nimages, "outareafile", 0 )) ||
+       ( 0 != check_stack( batch.binfiles, batch.nimages, "outbinfile", 0 )) ||
+       ( 0 != check_stack( batch.treefiles, batch.nimages, "outtreefile", 0 )) ||
+       ( 0 != check_stack( batch.inbinfiles, batch.nimages, "inbinfile", 1 )) ||
+       ( 0 != check_stack( batch.prevbinfiles, batch.nimages, "prevbinfile", 1 )) ||
+       ( 0 != check_stack( batch.deltafiles, batch.nimages, "indeltafile", 1 )) ) {
+    retval = -1;
+  }
+
+  /* One stats file for the whole run, one line per image */
+  if ( ( 0 == retval ) && ( strlen(statsfile) > 0 ) && 
+       ( 0 != ds_strcmp_cis( statsfile, "none" )) ) {
+    if ( 0 != ds_clobber( statsfile, batch.params.clobber, NULL )) {
+      retval = -1;
+    } else if ( NULL == ( batch.statsfp = fopen( statsfile, "w" ))) {
+      err_msg("ERROR: Could not create outstatsfile='%s'\n", statsfile );
+      retval = -1;
+    }
+  }
+
+  if ( ( 0 == retval ) && ( nsnr > 0 ) ) {
+    batch.params.nthreads = ( nthreads < 1 ) ? 1 : nthreads;
+    retval = run_sweep( &batch, snrs, hierfile );
+  } else if ( ( 0 == retval ) && ( joint_bands || server ) ) {
+    batch.params.nthreads = ( nthreads < 1 ) ? 1 : nthreads;
+    retval = run_bands( &batch );
+  } else if ( 0 == retval ) {
+    batch.status = (int*)calloc( batch.nimages, sizeof(int));
+    if ( NULL == batch.status ) {
+      err_msg("ERROR: Could not allocate memory\n");
+      retval = -1;
+    }
+  }
+
+  if ( ( 0 == retval ) && !joint_bands && !server && ( nsnr < 1 ) ) {
+    /* With several images the threads go to whole images; whatever is
+     * left over is used to traverse each tree. */
+    if ( nthreads < 1 ) nthreads = 1;
+    nworkers = ( nthreads < batch.nimages ) ? nthreads : batch.nimages;
+    batch.params.nthreads = nthreads / nworkers;
+    for (ii=0; ii<batch.nimages; ii++ ) {
+      batch.status[ii] = -1;  /* until it has been run */
+    }
+    batch.next = 0;
+    pthread_mutex_init( &(batch.lock), NULL );
+
+    if ( nworkers > 1 ) {
+      threads = (pthread_t*)calloc( nworkers-1, sizeof(pthread_t));
+    }
+    for (ii=0; threads && ii<nworkers-1; ii++) {
+      if ( 0 != pthread_create( &threads[ii], NULL, run_batch_worker, &batch )) {
+        break;  /* Fewer workers is OK; main thread will finish the work */
+      }
+      nstarted++;
+    }
+
+    run_batch_worker( &batch );
+
+    for (ii=0; ii<nstarted; ii++ ) {
+      pthread_join( threads[ii], NULL );
+    }
+    if (threads) free(threads);
+    pthread_mutex_destroy( &(batch.lock) );
+
+    /* Report each failure; the rest of the batch still ran */
+    for (ii=0; ii<batch.nimages; ii++ ) {
+      if ( 0 != batch.status[ii] ) {
+        if ( batch.nimages > 1 ) {
+          get_stack_name( batch.infiles, ii, infile );
+          err_msg("ERROR: Could not bin infile='%s'\n", infile );
+        }
+        nfailed++;
+      }
+    }
+    if ( nfailed > 0 ) {
+      if ( batch.nimages > 1 ) {
+        err_msg("ERROR: %ld of %ld images failed\n", nfailed, batch.nimages );
+      }
+      retval = -1;
+    }
+  }
+
+  if ( batch.status ) free( batch.status );
+  if ( snrs ) stk_close( snrs );
+  if ( batch.statsfp ) fclose( batch.statsfp );
+  if ( batch.infiles ) stk_close( batch.infiles );
+  if ( batch.outfiles ) stk_close( batch.outfiles );
+  if ( batch.errfiles ) stk_close( batch.errfiles );
+  if ( batch.varfiles ) stk_close( batch.varfiles );
+  if ( batch.maskfiles ) stk_close( batch.maskfiles );
+  if ( batch.snrfiles ) stk_close( batch.snrfiles );
+  if ( batch.areafiles ) stk_close( batch.areafiles );
+  if ( batch.binfiles ) stk_close( batch.binfiles );
+  if ( batch.treefiles ) stk_close( batch.treefiles );
+  if ( batch.inbinfiles ) stk_close( batch.inbinfiles );
+  if ( batch.prevbinfiles ) stk_close( batch.prevbinfiles );
+  if ( batch.deltafiles ) stk_close( batch.deltafiles );
+
+  return(retval);
+}
 
 
 int main(int argc, char** argv)
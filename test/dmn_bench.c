@@ -0,0 +1,316 @@
+/*
+**  Copyright (C) 2004-2008  Smithsonian Astrophysical Observatory
+*/
+
+/*                                                                          */
+/*  This program is free software; you can redistribute it and/or modify    */
+/*  it under the terms of the GNU General Public License as published by    */
+/*  the Free Software Foundation; either version 3 of the License, or       */
+/*  (at your option) any later version.                                     */
+/*                                                                          */
+/*  This program is distributed in the hope that it will be useful,         */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           */
+/*  GNU General Public License for more details.                            */
+/*                                                                          */
+/*  You should have received a copy of the GNU General Public License along */
+/*  with this program; if not, write to the Free Software Foundation, Inc., */
+/*  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.             */
+/*                                                                          */
+
+/* dmn_bench: time libdmnautilus on synthetic images.
+ *
+ *   dmn_bench [-d dir] [-n nthreads] [-s snr] [-r repeats] [-m memlimit] 
+ *             [-l row|tile] size ...
+ *
+ * For each size, three Poisson images are made in dir: a flat
+ * background, a beta-model cluster, and point sources on a field with
+ * the pixels outside a circle masked out (NaN).  Each is binned with
+ * method=0..4 and one JSON object per run is printed with the time spent
+ * in each phase.  The images come from a fixed seed so the results can
+ * be compared from one release to the next.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <ascdm.h>
+#include <dslib.h>
+
+#include "dmnautilus.h"
+
+
+typedef enum {
+  SCENE_FLAT=0, SCENE_CLUSTER, SCENE_POINTS
+} benchScene;
+
+static const char *scene_names[] = { "flat", "cluster", "points" };
+#define NUM_SCENES  (sizeof(scene_names)/sizeof(scene_names[0]))
+
+
+static double get_uniform( unsigned long long *state );
+static double get_gauss( unsigned long long *state );
+static float get_poisson( unsigned long long *state, double lambda );
+static int make_scene( benchScene scene, long size, const char *fname );
+static int run_bench( const char *infile, const char *dir, benchScene scene,
+                      long size, dmnautilusParams *params, long repeats );
+
+
+/* xorshift64*; (0,1) */
+static double get_uniform( unsigned long long *state )
+{
+  unsigned long long xx = *state;
+  xx ^= xx >> 12;
+  xx ^= xx << 25;
+  xx ^= xx >> 27;
+  *state = xx;
+  return( ( ( ( xx * 2685821657736338717ULL ) >> 11 ) + 0.5 ) / 9007199254740992.0 );
+}
+
+
+static double get_gauss( unsigned long long *state )
+{
+  double u1 = get_uniform( state );
+  double u2 = get_uniform( state );
+  return( sqrt( -2.0*log(u1) ) * cos( 2.0*M_PI*u2 ) );
+}
+
+
+/* Knuth's method for small lambda, a normal approximation above that;
+ * plenty good enough for timing */
+static float get_poisson( unsigned long long *state, double lambda )
+{
+  if ( lambda < 30 ) {
+    double limit = exp( -lambda );
+    double prod = get_uniform( state );
+    long kk = 0;
+    while ( prod > limit ) {
+      prod *= get_uniform( state );
+      kk++;
+    }
+    return( kk );
+  } else {
+    double kk = floor( lambda + sqrt(lambda)*get_gauss( state ) + 0.5 );
+    return( ( kk < 0 ) ? 0 : kk );
+  }
+}
+
+
+/* Write one synthetic image.  The flat and cluster images are counts
+ * (short); the point source image is float so the masked pixels can be
+ * NaN. */
+static int make_scene( benchScene scene, long size, const char *fname )
+{
+  unsigned long long state = 0x9E3779B97F4A7C15ULL + 1000*size + scene;
+  long npix = size*size;
+  long lAxes[2];
+  float *lambda;
+  dmBlock *outBlock;
+  long xx, yy, nn;
+
+  lambda = (float*)malloc( npix*sizeof(float));
+  if ( NULL == lambda ) {
+    fprintf( stderr, "ERROR: Could not allocate %ld x %ld image\n", size, size );
+    return(-1);
+  }
+
+  /* Expected counts */
+  for (yy=0; yy<size; yy++) {
+    for (xx=0; xx<size; xx++) {
+      double dx = xx - size/2.0;
+      double dy = yy - size/2.0;
+      double rc = size/16.0;
+
+      switch ( scene ) {
+        case SCENE_FLAT:
+          lambda[xx+yy*size] = 2.0;
+          break;
+        case SCENE_CLUSTER:  /* beta=2/3 */
+          lambda[xx+yy*size] = 0.2 + 50.0*pow( 1.0+(dx*dx+dy*dy)/(rc*rc), -1.5 );
+          break;
+        case SCENE_POINTS:
+          lambda[xx+yy*size] = 0.1;
+          break;
+      }
+    }
+  }
+
+  if ( SCENE_POINTS == scene ) {
+    long nsrc = npix/4096;
+    for (nn=0; nn<nsrc; nn++) {
+      double xc = get_uniform( &state )*size;
+      double yc = get_uniform( &state )*size;
+      double counts = 20.0*pow( get_uniform( &state ), -1.5 );
+      double sigma = 1.0;
+      if ( counts > 1.0e5 ) counts = 1.0e5;
+
+      for (yy=(long)yc-4; yy<=(long)yc+4; yy++) {
+        for (xx=(long)xc-4; xx<=(long)xc+4; xx++) {
+          double r2;
+          if ( ( xx < 0 ) || ( xx >= size ) || ( yy < 0 ) || ( yy >= size ) ) {
+            continue;
+          }
+          r2 = (xx-xc)*(xx-xc) + (yy-yc)*(yy-yc);
+          lambda[xx+yy*size] += counts/(2*M_PI*sigma*sigma) * exp( -r2/(2*sigma*sigma) );
+        }
+      }
+    }
+  }
+
+  /* Draw the counts */
+  for (nn=0; nn<npix; nn++) {
+    lambda[nn] = get_poisson( &state, lambda[nn] );
+  }
+
+  lAxes[0] = lAxes[1] = size;
+  unlink( fname );
+  outBlock = dmImageCreate( fname, ( SCENE_POINTS == scene ) ? dmFLOAT : dmSHORT, lAxes, 2 );
+  if ( NULL == outBlock ) {
+    fprintf( stderr, "ERROR: Could not create '%s'\n", fname );
+    free( lambda );
+    return(-1);
+  }
+
+  if ( SCENE_POINTS == scene ) {
+    float rmax2 = (0.45*size)*(0.45*size);
+    for (yy=0; yy<size; yy++) {
+      for (xx=0; xx<size; xx++) {
+        float dx = xx - size/2.0;
+        float dy = yy - size/2.0;
+        if ( dx*dx+dy*dy > rmax2 ) {
+          lambda[xx+yy*size] = NAN;
+        }
+      }
+    }
+    dmSetArray_f( dmImageGetDataDescriptor( outBlock ), lambda, npix );
+  } else {
+    short *counts = (short*)lambda;  /* in place; short is smaller */
+    for (nn=0; nn<npix; nn++) {
+      counts[nn] = ( lambda[nn] > 32767 ) ? 32767 : lambda[nn];
+    }
+    dmSetArray_s( dmImageGetDataDescriptor( outBlock ), counts, npix );
+  }
+
+  dmImageClose( outBlock );
+  free( lambda );
+  return(0);
+}
+
+
+/* Bin the image with each method; one line of output per run */
+static int run_bench( const char *infile, const char *dir, benchScene scene,
+                      long size, dmnautilusParams *params, long repeats )
+{
+  dmnautilusContext *ctx;
+  dmnautilusInput input;
+  dmnautilusOutputs outputs;
+  dmnautilusTimings timings;
+  char outfile[DS_SZ_FNAME];
+  char maskfile[DS_SZ_FNAME];
+  int method;
+  long rr;
+
+  if ( NULL == ( ctx = dmnautilus_context_new() )) {
+    fprintf( stderr, "ERROR: Could not allocate memory\n");
+    return(-1);
+  }
+
+  memset( &input, 0, sizeof(dmnautilusInput));
+  memset( &outputs, 0, sizeof(dmnautilusOutputs));
+  input.infile = infile;
+  snprintf( outfile, DS_SZ_FNAME, "%s/bench_out.fits", dir );
+  snprintf( maskfile, DS_SZ_FNAME, "%s/bench_mask.fits", dir );
+  outputs.outfile = outfile;
+  outputs.maskfile = maskfile;
+
+  for (method=ZERO_ABOVE; method<=ALL_ABOVE; method++ ) {
+    params->method = (dmnautilusCriteria)method;
+    for (rr=0; rr<repeats; rr++) {
+      if ( 0 != dmnautilus_run( ctx, &input, params, &outputs ) ) {
+        dmnautilus_context_free( ctx );
+        return(-1);
+      }
+      dmnautilus_get_timings( ctx, &timings );
+      printf("{\"scene\": \"%s\", \"size\": %ld, \"method\": %d, \"snr\": %g, "
+             "\"nthreads\": %d, \"layout\": \"%s\", \"repeat\": %ld, \"load\": %.6f, "
+             "\"errimg\": %.6f, \"prepare\": %.6f, \"traverse\": %.6f, \"regions\": %.6f, "
+             "\"output\": %.6f, \"total\": %.6f}\n",
+             scene_names[scene], size, method, params->snr, params->nthreads, 
+             ( LAYOUT_TILE == params->layout ) ? "tile" : "row", rr,
+             timings.load, timings.errimg, timings.prepare, timings.traverse,
+             timings.regions, timings.output,
+             timings.load+timings.errimg+timings.prepare+timings.traverse+
+             timings.regions+timings.output );
+      fflush( stdout );
+    }
+  }
+
+  unlink( outfile );
+  unlink( maskfile );
+  dmnautilus_context_free( ctx );
+  return(0);
+}
+
+
+int main( int argc, char **argv )
+{
+  dmnautilusParams params;
+  const char *dir = ".";
+  long repeats = 1;
+  int opt;
+  int ii;
+  unsigned int scene;
+
+  memset( &params, 0, sizeof(dmnautilusParams));
+  params.snr = 10;
+  params.nthreads = 1;
+  params.clobber = 1;
+  params.engine = DEPTH_FIRST;
+  params.layout = LAYOUT_ROW;
+
+  while ( -1 != ( opt = getopt( argc, argv, "d:n:s:r:m:l:" ))) {
+    switch ( opt ) {
+      case 'd': dir = optarg; break;
+      case 'n': params.nthreads = atoi( optarg ); break;
+      case 's': params.snr = atof( optarg ); break;
+      case 'r': repeats = atol( optarg ); break;
+      case 'm': params.memlimit = atol( optarg ); break;
+      case 'l': 
+        params.layout = ( 0 == strcmp( optarg, "tile" )) ? LAYOUT_TILE : LAYOUT_ROW; 
+        break;
+      default:
+        fprintf( stderr, "usage: %s [-d dir] [-n nthreads] [-s snr] [-r repeats] "
+                 "[-m memlimit] [-l row|tile] size ...\n", argv[0] );
+        return(1);
+    }
+  }
+  if ( optind >= argc ) {
+    fprintf( stderr, "usage: %s [-d dir] [-n nthreads] [-s snr] [-r repeats] "
+             "[-m memlimit] [-l row|tile] size ...\n", argv[0] );
+    return(1);
+  }
+  params.tmpdir = dir;
+
+  for (ii=optind; ii<argc; ii++ ) {
+    long size = atol( argv[ii] );
+    if ( size < 1 ) {
+      fprintf( stderr, "ERROR: Bad image size '%s'\n", argv[ii] );
+      return(1);
+    }
+    for (scene=0; scene<NUM_SCENES; scene++ ) {
+      char infile[DS_SZ_FNAME];
+      snprintf( infile, DS_SZ_FNAME, "%s/bench_%s_%ld.fits", dir,
+                scene_names[scene], size );
+      if ( ( 0 != make_scene( (benchScene)scene, size, infile ) ) ||
+           ( 0 != run_bench( infile, dir, (benchScene)scene, size, &params, repeats ) ) ) {
+        return(1);
+      }
+      unlink( infile );
+    }
+  }
+
+  return(0);
+}
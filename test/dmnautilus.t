@@ -93,6 +93,52 @@ zerotest()
 }
 
 
+######################################################################
+# subroutine
+# cmp_data <new> <reference>
+# Compares the pixel values of an image made by a test with a 
+# reference image.  Either can have a block, eg "$outfile[2]".
+
+cmp_data()
+{
+  dmimgcalc "$1" "$2" none tst verbose=0   2>>$LOGFILE
+  if test $? -ne 0; then
+    echo "ERROR: DATA MISMATCH in $1" >> $LOGFILE
+    mismatch=0
+  fi
+}
+
+######################################################################
+# subroutine
+# cmp_image <new> <reference>
+# Compares the pixel values and the header of an image made by a test
+# with a reference image.
+
+cmp_image()
+{
+  cmp_data "$1[1]" "$2[1]"
+  dmdiff "$1" "$2" tol=$SAVDIR/tolerance verb=0 > /dev/null 2>>$LOGFILE
+  if  test $? -ne 0 ; then
+    echo "ERROR: HEADER MISMATCH in $1" >> $LOGFILE
+    mismatch=0
+  fi
+}
+
+######################################################################
+# subroutine
+# cmp_table <new> <reference>
+# Compares the columns, values, and header of a table block made by a
+# test with the same block of a reference file, eg "$outfile[REGION]".
+
+cmp_table()
+{
+  dmdiff "$1" "$2" tol=$SAVDIR/tolerance verb=0 > /dev/null 2>>$LOGFILE
+  if  test $? -ne 0 ; then
+    echo "ERROR: TABLE MISMATCH in $1" >> $LOGFILE
+    mismatch=0
+  fi
+}
+
 ######################################################################
 # Initialization
 
@@ -101,7 +147,7 @@ toolname="dmnautilus"
 
 # set up list of tests
 # !!4
-alltests="test_simple test_variance new_one new_two new_three new_four new_with_subspace new_rotated"
+alltests="test_simple test_variance new_one new_two new_three new_four new_with_subspace new_rotated new_four_threads new_four_batch new_four_level new_four_expand new_four_memlimit new_four_verbose new_bands new_four_incr new_four_server new_four_sweep new_four_tree new_four_rice new_events"
 
 # "short" test to run
 # !!5
@@ -207,6 +253,24 @@ do
   outfile=$OUTDIR/${testid}.fits
   savfile=$SAVDIR/${testid}.fits
 
+  # Threaded runs must match the serial save'd files
+  case ${testid} in
+    *_threads ) savfile=$SAVDIR/${testid%_threads}.fits ;;
+    *_batch ) savfile=$SAVDIR/${testid%_batch}.fits ;;
+    *_level ) savfile=$SAVDIR/${testid%_level}.fits ;;
+    *_expand ) savfile=$SAVDIR/${testid%_expand}.fits ;;
+    *_memlimit ) savfile=$SAVDIR/${testid%_memlimit}.fits ;;
+    *_verbose ) savfile=$SAVDIR/${testid%_verbose}.fits ;;
+    *_server ) savfile=$SAVDIR/${testid%_server}.fits ;;
+    *_sweep ) savfile=$SAVDIR/${testid%_sweep}.fits ;;
+    *_tree ) savfile=$SAVDIR/${testid%_tree}.fits ;;
+    *_rice ) savfile=$SAVDIR/${testid%_rice}.fits ;;
+    # The reference is made by the same test, from the pre-made image
+    *_events ) savfile=$OUTDIR/${testid}_img.fits ;;
+    *_bands ) savfile=$OUTDIR/${testid}_ref.fits ;;
+    *_incr ) savfile=$OUTDIR/${testid}_full.fits ;;
+  esac
+
   echo "running $testid" >> $LOGFILE
 
   ####################################################################
@@ -252,6 +316,64 @@ do
 
             ;;
 
+    new_four_threads )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=15.8 mode=h clob+ method=4 outmask=${outfile}.map nthreads=4"
+
+            ;;
+
+    new_four_batch )   test1_string="dmnautilus infile=$INDIR/img.fits,$INDIR/img+rot.fits outfile=$outfile,$OUTDIR/${testid}_rot.fits snr=15.8 mode=h clob+ method=4 outmask=${outfile}.map,$OUTDIR/${testid}_rot.fits.map nthreads=2"
+
+            ;;
+
+    new_four_level )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=15.8 mode=h clob+ method=4 outmask=${outfile}.map engine=level"
+
+            ;;
+
+    new_four_expand )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=${outfile}.tmp snr=15.8 mode=h clob+ method=4 outbinfile=${outfile}.tab && dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=15.8 mode=h clob+ method=4 inbinfile=${outfile}.tab outmask=${outfile}.map"
+
+            ;;
+
+    new_four_memlimit )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=15.8 mode=h clob+ method=4 outmask=${outfile}.map memlimit=1 tmpdir=$OUTDIR"
+
+            ;;
+
+    new_four_verbose )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=15.8 mode=h clob+ method=4 outmask=${outfile}.map verbose=3 outstatsfile=${outfile}.json"
+
+            ;;
+
+    # Each band of the joint run is the same as expanding the joint
+    # table of bins for that band alone
+    new_bands )   test1_string="dmnautilus infile=$INDIR/img.fits,$INDIR/img+rot.fits outfile=$outfile,$OUTDIR/${testid}_b2.fits snr=5 mode=h clob+ method=4 outmask=${outfile}.map joint=all outbinfile=${outfile}.tab && dmnautilus infile=$INDIR/img.fits outfile=$savfile snr=5 mode=h clob+ method=4 outmask=${savfile}.map inbinfile=${outfile}.tab && dmnautilus infile=$INDIR/img+rot.fits outfile=$OUTDIR/${testid}_b2_ref.fits snr=5 mode=h clob+ method=4 inbinfile=${outfile}.tab"
+
+            ;;
+
+    # img.fits is img_prev.fits plus the few pixels in img_delta.fits;
+    # binning it again from the bins of img_prev.fits is the same as
+    # binning it from scratch
+    new_four_incr )   test1_string="dmnautilus infile=$INDIR/img_prev.fits outfile=${outfile}.tmp snr=5 mode=h clob+ method=4 outbinfile=${outfile}.tab && dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=5 mode=h clob+ method=4 prevbinfile=${outfile}.tab indeltafile=$INDIR/img_delta.fits outmask=${outfile}.map && dmnautilus infile=$INDIR/img.fits outfile=$savfile snr=5 mode=h clob+ method=4 outmask=${savfile}.map"
+
+            ;;
+
+    new_four_server )   test1_string="printf 'snr=3 method=1 outfile=${outfile}.tmp\nsnr=15.8 method=4 outfile=$outfile outmaskfile=${outfile}.map\n' | dmnautilus infile=$INDIR/img.fits outfile=${outfile}.tmp snr=5 mode=h clob+ server=yes"
+
+            ;;
+
+    new_four_sweep )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=${outfile}.tmp,$outfile snr=5 snrlist=3,15.8 mode=h clob+ method=4 outmaskfile=${outfile}.tmp.map,${outfile}.map outhierfile=${outfile}.hier && dmnautilus infile=$INDIR/img.fits outfile=${outfile}.hx snr=15.8 mode=h clob+ method=4 inbinfile=${outfile}.hier outmask=${outfile}.hx.map && dmnautilus infile=$INDIR/img.fits outfile=${outfile}.hx3 snr=3 mode=h clob+ method=4 inbinfile=${outfile}.hier outmask=${outfile}.hx3.map"
+
+            ;;
+
+    new_four_tree )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=15.8 mode=h clob+ method=4 outmask=${outfile}.map outtreefile=${outfile}.tree && dmsort \"${outfile}.tree[SPLIT=0]\" ${outfile}.leaves keys=MASK_NO clob+ && dmnautilus infile=$INDIR/img.fits outfile=${outfile}.lx snr=15.8 mode=h clob+ method=4 inbinfile=${outfile}.leaves outmask=${outfile}.lx.map"
+
+            ;;
+
+    new_four_rice )   test1_string="dmnautilus infile=$INDIR/img.fits outfile=$outfile snr=15.8 mode=h clob+ method=4 outmask=${outfile}.map compress=rice"
+
+            ;;
+
+    # evt_img.fits is evt.fits binned at x,y=0.5:64.5:1
+    new_events )   test1_string="dmnautilus infile=$INDIR/evt.fits outfile=$outfile snr=10 mode=h clob+ method=4 outmask=${outfile}.map binspec='x=0.5:64.5:1,y=0.5:64.5:1' && dmnautilus infile=$INDIR/evt_img.fits outfile=$savfile snr=10 mode=h clob+ method=4 outmask=${savfile}.map"
+
+            ;;
+
 
 
   esac
@@ -300,6 +422,25 @@ do
 
   # check image
   # !!13
+  case ${testid} in
+    # A compressed image is the 2nd block, after an empty primary.  Its
+    # header is not the same, so only the values are compared.  The
+    # rice mask is lossless.  The binned image is quantized per row, but
+    # the 4 bins of new_four are constant along each row so no row is.
+    *_rice )
+      cmp_data "$outfile[2]" "$savfile[1]"
+      cmp_data "${outfile}.map[2]" "${savfile}.map[1]"
+      ;;
+
+    # The headers of a binned event list are not the same as the
+    # pre-made image's, nor those of a joint run and an expanded table
+    # or an incremental run and a full one, only the values
+    *_events | *_bands | *_incr )
+      cmp_data "$outfile[1]" "$savfile[1]"
+      cmp_data "${outfile}.map[1]" "${savfile}.map[1]"
+      ;;
+
+    * )
    dmimgcalc "$outfile[1]" "$savfile[1]" none tst verbose=0   2>>$LOGFILE
    if test $? -ne 0; then
      echo "ERROR: DATA MISMATCH in $outfile" >> $LOGFILE
@@ -326,6 +467,56 @@ do
      mismatch=0
    fi
 
+  # The mask, if the test made one and there is one to compare it with
+   if test -f ${outfile}.map -a -f ${savfile}.map ; then
+     cmp_image ${outfile}.map ${savfile}.map
+     cmp_table "${outfile}.map[REGION]" "${savfile}.map[REGION]"
+   fi
+      ;;
+  esac
+
+
+  ####################################################################
+  # The other outputs of a test
+
+  case ${testid} in
+    # The 2nd image of the batch is the same run as new_rotated
+    new_four_batch )
+      cmp_image $OUTDIR/${testid}_rot.fits $SAVDIR/new_rotated.fits
+      cmp_image $OUTDIR/${testid}_rot.fits.map $SAVDIR/new_rotated.fits.map
+      ;;
+
+    # The bins of the tree, in mask number order, are the table of bins
+    new_four_tree )
+      cmp_image ${outfile}.lx $savfile
+      cmp_image ${outfile}.lx.map ${savfile}.map
+      ;;
+
+    # The hierarchy expanded for each snr of the sweep
+    new_four_sweep )
+      cmp_image ${outfile}.hx $savfile
+      cmp_image ${outfile}.hx.map ${savfile}.map
+      cmp_data "${outfile}.hx3[1]" "${outfile}.tmp[1]"
+      cmp_data "${outfile}.hx3.map[1]" "${outfile}.tmp.map[1]"
+      ;;
+
+    new_bands )
+      cmp_data "$OUTDIR/${testid}_b2.fits[1]" "$OUTDIR/${testid}_b2_ref.fits[1]"
+      ;;
+
+    # The counts in the stats line, w/o the file name, timings, and
+    # memory, which change from run to run
+    new_four_verbose )
+      sed -e 's/"infile": "[^"]*", //' -e 's/"wall": .*"snr_calls"/"snr_calls"/' \
+          -e 's/, "peak_rss_kb": [0-9]*}/}/' ${outfile}.json > $OUTDIR/${testid}.json_cmp
+      diff $OUTDIR/${testid}.json_cmp $SAVDIR/${testid}.json > /dev/null 2>>$LOGFILE
+      if  test $? -ne 0 ; then
+        echo "ERROR: STATS MISMATCH in ${outfile}.json" >> $LOGFILE
+        mismatch=0
+      fi
+      ;;
+  esac
+
   ######################################################################
   # ascii files
   # !!17